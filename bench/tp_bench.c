@@ -0,0 +1,379 @@
+/**
+ * @file tp_bench.c
+ * @brief Throughput and latency benchmark for tp_open, tp_get and tp_set
+ *
+ * Usage: tp_bench [-k keys] [-d depth] [-t threads] [-n reads] [-w writes] [-f file]
+ *
+ *   -k  Leaves in the generated parameter file, 10 to 100000 (default 1000)
+ *   -d  Object nesting above each leaf (default 3)
+ *   -t  Reader threads for the multi-threaded runs (default 4)
+ *   -n  tp_get calls per thread and run (default 200000)
+ *   -w  tp_set calls per durability level (default 200)
+ *   -f  Path of the generated file (default tp_bench.json)
+ *
+ * Every result is printed as one JSON object per line, so runs of different
+ * releases can be collected and compared by scripts. Latencies are in
+ * nanoseconds and include one clock_gettime() pair per call.
+ *
+ * Build together with the library, e.g.
+ *   cc -O2 -I. bench/tp_bench.c tinyparam.c -lcjson -lpthread -o tp_bench
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "tinyparam.h"
+
+typedef struct bench {
+    const char *file;   // Generated parameter file
+    int keys;           // Number of leaves
+    int depth;          // Objects above each leaf
+    int threads;        // Reader threads
+    long reads;         // tp_get calls per thread
+    long writes;        // tp_set calls per level
+    char **paths;       // Dotted key of every leaf
+} bench_t;
+
+typedef struct reader {
+    bench_t *b;             // Benchmark settings
+    tp_handle_t *h;         // Handle to read from
+    uint64_t *lat;          // Latency of each call
+    long n;                 // Calls to make
+    uint32_t seed;          // Key choice state
+    int *running;           // Readers still running, counted down as each finishes
+} reader_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t xorshift(uint32_t *s)
+{
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Sort latencies and print them as one result line
+ *
+ * @param extra Further JSON members, with a leading comma, or ""
+ */
+static void report(const char *name, const bench_t *b, int threads, uint64_t *lat, long n, uint64_t wall_ns,
+                   const char *extra)
+{
+    if (n <= 0) {
+        return;
+    }
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("{\"bench\":\"%s\",\"keys\":%d,\"depth\":%d,\"threads\":%d,\"ops\":%ld,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu%s}\n",
+           name, b->keys, b->depth, threads, n, wall_ns ? n * 1e9 / wall_ns : 0.0,
+           (unsigned long long)lat[n / 2], (unsigned long long)lat[n * 99 / 100],
+           (unsigned long long)lat[n * 999 / 1000], (unsigned long long)lat[n - 1], extra);
+    fflush(stdout);
+}
+
+/**
+ * @brief Write a parameter file with keys leaves spread over depth levels of objects
+ */
+static int generate(bench_t *b)
+{
+    int fanout = 1;
+    while (b->depth > 0 && fanout < 64) {
+        long total = 1;
+        for (int i = 0; i < b->depth; i++) {
+            total *= fanout + 1;
+        }
+        if (total > b->keys) {
+            break;
+        }
+        fanout++;
+    }
+
+    b->paths = (char **)calloc(b->keys, sizeof(char *));
+    cJSON *root = cJSON_CreateObject();
+    if (!b->paths || !root) {
+        return -1;
+    }
+    for (int i = 0; i < b->keys; i++) {
+        char path[256];
+        size_t len = 0;
+        cJSON *node = root;
+        int rest = i;
+        for (int d = 0; d < b->depth; d++) {
+            char name[16];
+            snprintf(name, sizeof(name), "g%d", rest % fanout);
+            rest /= fanout;
+            cJSON *child = cJSON_GetObjectItemCaseSensitive(node, name);
+            if (!child) {
+                child = cJSON_CreateObject();
+                cJSON_AddItemToObject(node, name, child);
+            }
+            node = child;
+            len += snprintf(path + len, sizeof(path) - len, "%s.", name);
+        }
+        char name[16];
+        char value[16];
+        snprintf(name, sizeof(name), "k%d", i);
+        snprintf(value, sizeof(value), "%d", i % 100);
+        cJSON_AddItemToObject(node, name, cJSON_CreateString(value));
+        snprintf(path + len, sizeof(path) - len, "%s", name);
+        b->paths[i] = strdup(path);
+    }
+
+    char *text = cJSON_Print(root);
+    cJSON_Delete(root);
+    FILE *fp = text ? fopen(b->file, "w") : NULL;
+    if (!fp) {
+        free(text);
+        return -1;
+    }
+    fputs(text, fp);
+    fclose(fp);
+    free(text);
+    return 0;
+}
+
+/**
+ * @brief Time tp_open in a child process, whose peak RSS then covers the open alone
+ */
+static void bench_open(bench_t *b)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        // Reset the peak RSS inherited from the parent, where supported
+        FILE *fp = fopen("/proc/self/clear_refs", "w");
+        if (fp) {
+            fputs("5", fp);
+            fclose(fp);
+        }
+        uint64_t t0 = now_ns();
+        tp_handle_t *h = tp_open((char *)b->file);
+        uint64_t t1 = now_ns();
+        long hwm = 0;
+        fp = fopen("/proc/self/status", "r");
+        char line[128];
+        while (fp && fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "VmHWM: %ld", &hwm) == 1) {
+                break;
+            }
+        }
+        if (fp) {
+            fclose(fp);
+        }
+        if (!hwm) {
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+            hwm = ru.ru_maxrss;
+        }
+        uint64_t res[2] = { h ? t1 - t0 : 0, (uint64_t)hwm };
+        ssize_t ret = write(fds[1], res, sizeof(res));
+        (void)ret;
+        tp_close(h);
+        _exit(h ? 0 : 1);
+    }
+    close(fds[1]);
+    uint64_t res[2] = { 0, 0 };
+    ssize_t got = pid > 0 ? read(fds[0], res, sizeof(res)) : -1;
+    close(fds[0]);
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+    if (got == (ssize_t)sizeof(res) && res[0]) {
+        printf("{\"bench\":\"open\",\"keys\":%d,\"depth\":%d,\"open_ns\":%llu,\"peak_rss_kb\":%llu}\n", b->keys,
+               b->depth, (unsigned long long)res[0], (unsigned long long)res[1]);
+        fflush(stdout);
+    }
+}
+
+static void *reader_run(void *arg)
+{
+    reader_t *r = (reader_t *)arg;
+    for (long i = 0; i < r->n; i++) {
+        char *key = r->b->paths[xorshift(&r->seed) % r->b->keys];
+        uint64_t t0 = now_ns();
+        char *value = tp_get(r->h, key);
+        r->lat[i] = now_ns() - t0;
+        free(value);
+    }
+    __atomic_sub_fetch(r->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * @brief Run readers on threads, optionally while a writer sets random keys
+ */
+static void bench_get(bench_t *b, tp_handle_t *h, int threads, int with_writer)
+{
+    reader_t *r = (reader_t *)calloc(threads, sizeof(reader_t));
+    pthread_t *tid = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    uint64_t *lat = (uint64_t *)malloc(sizeof(uint64_t) * b->reads * threads);
+    int running = threads;
+    if (!r || !tid || !lat) {
+        free(r);
+        free(tid);
+        free(lat);
+        return;
+    }
+
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < threads; i++) {
+        r[i].b = b;
+        r[i].h = h;
+        r[i].lat = lat + (size_t)i * b->reads;
+        r[i].n = b->reads;
+        r[i].seed = 2463534242u + i * 7919u;
+        r[i].running = &running;
+        pthread_create(&tid[i], NULL, reader_run, &r[i]);
+    }
+
+    long writes = 0;
+    if (with_writer) {
+        // Keep writing for as long as the readers run
+        uint32_t seed = 88172645u;
+        while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0) {
+            char value[16];
+            snprintf(value, sizeof(value), "%u", xorshift(&seed) % 100);
+            tp_set(h, b->paths[xorshift(&seed) % b->keys], value);
+            writes++;
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    uint64_t wall = now_ns() - t0;
+
+    long n = b->reads * threads;
+    char extra[64] = "";
+    if (with_writer) {
+        snprintf(extra, sizeof(extra), ",\"writes\":%ld", writes);
+    }
+    report(with_writer ? "get_under_set" : "get", b, threads, lat, n, wall, extra);
+    free(r);
+    free(tid);
+    free(lat);
+}
+
+/**
+ * @brief Time tp_set at one durability level
+ *
+ * @return uint64_t Median latency, 0 on failure
+ */
+static uint64_t bench_set(bench_t *b, tp_durability_t level, const char *name, uint64_t memory_p50)
+{
+    tp_options_t opts = { .durability = level };
+    tp_handle_t *h = tp_open_ex((char *)b->file, &opts);
+    uint64_t *lat = (uint64_t *)malloc(sizeof(uint64_t) * b->writes);
+    if (!h || !lat) {
+        tp_close(h);
+        free(lat);
+        return 0;
+    }
+
+    uint32_t seed = 3141592653u;
+    uint64_t t0 = now_ns();
+    for (long i = 0; i < b->writes; i++) {
+        char value[16];
+        snprintf(value, sizeof(value), "%u", xorshift(&seed) % 100);
+        char *key = b->paths[xorshift(&seed) % b->keys];
+        uint64_t t1 = now_ns();
+        tp_set(h, key, value);
+        lat[i] = now_ns() - t1;
+    }
+    uint64_t wall = now_ns() - t0;
+    tp_close(h);
+
+    qsort(lat, b->writes, sizeof(uint64_t), cmp_u64);
+    uint64_t p50 = lat[b->writes / 2];
+    char extra[96];
+    snprintf(extra, sizeof(extra), ",\"durability\":\"%s\"", name);
+    if (memory_p50 && p50 > memory_p50) {
+        // What the file write adds on top of the in-memory update
+        size_t len = strlen(extra);
+        snprintf(extra + len, sizeof(extra) - len, ",\"persist_p50_ns\":%llu",
+                 (unsigned long long)(p50 - memory_p50));
+    }
+    report("set", b, 1, lat, b->writes, wall, extra);
+    free(lat);
+    return p50;
+}
+
+int main(int argc, char **argv)
+{
+    bench_t b = { .file = "tp_bench.json", .keys = 1000, .depth = 3, .threads = 4, .reads = 200000, .writes = 200 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:d:t:n:w:f:")) != -1) {
+        switch (opt) {
+        case 'k': b.keys = atoi(optarg); break;
+        case 'd': b.depth = atoi(optarg); break;
+        case 't': b.threads = atoi(optarg); break;
+        case 'n': b.reads = atol(optarg); break;
+        case 'w': b.writes = atol(optarg); break;
+        case 'f': b.file = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-k keys] [-d depth] [-t threads] [-n reads] [-w writes] [-f file]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (b.keys < 10 || b.keys > 100000 || b.depth < 0 || b.depth > 16 || b.threads < 1 || b.reads < 1 ||
+        b.writes < 1) {
+        fprintf(stderr, "Keys must be 10 to 100000, depth 0 to 16, the other counts positive\n");
+        return 2;
+    }
+
+    if (generate(&b) != 0) {
+        fprintf(stderr, "Failed to generate %s: %s\n", b.file, strerror(errno));
+        return 1;
+    }
+
+    bench_open(&b);
+
+    tp_handle_t *h = tp_open((char *)b.file);
+    if (!h) {
+        fprintf(stderr, "Failed to open %s\n", b.file);
+        return 1;
+    }
+    bench_get(&b, h, 1, 0);
+    if (b.threads > 1) {
+        bench_get(&b, h, b.threads, 0);
+    }
+    bench_get(&b, h, b.threads, 1);
+    tp_close(h);
+
+    uint64_t memory = bench_set(&b, TP_DURABILITY_NONE, "none", 0);
+    bench_set(&b, TP_DURABILITY_RENAME, "rename", memory);
+    bench_set(&b, TP_DURABILITY_FULL, "full", memory);
+
+    for (int i = 0; i < b.keys; i++) {
+        free(b.paths[i]);
+    }
+    free(b.paths);
+    unlink(b.file);
+    return 0;
+}
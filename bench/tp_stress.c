@@ -0,0 +1,382 @@
+/**
+ * @file tp_stress.c
+ * @brief Multi-threaded stress test and scaling report for the concurrent read paths
+ *
+ * Usage: tp_stress [-t threads] [-w writers] [-k keys] [-m ms] [-f file]
+ *
+ *   -t  Most reader threads, runs double from 1 up to it (default 64)
+ *   -w  Writer threads running alongside the readers (default 1)
+ *   -k  Keys the writers cycle through (default 64)
+ *   -m  Duration of each run in milliseconds (default 200)
+ *   -f  Path of the generated file (default tp_stress.json)
+ *
+ * Every run opens the file in one mode: "rwlock" reads with tp_get_into(),
+ * "snapshot" with tp_snapshot_peek() on TP_OPEN_SNAPSHOT and "cache" with
+ * tp_get_into() on TP_OPEN_THREAD_CACHE. Writers own disjoint keys and set
+ * each to a rising sequence number with a check word, "seq:check", at
+ * TP_DURABILITY_NONE so the locks rather than file writes are measured.
+ * Writer 0 also sets two paired keys to the same number in one transaction.
+ *
+ * Readers count a value as torn if it does not parse, its check word is
+ * wrong, it was never written, or the two paired keys differ when read
+ * under one read guard or snapshot. A value is stale if it is older than
+ * the last tp_set() of that key that returned before the read started, or
+ * older than one the same reader saw before. Both bounds are exact: a read
+ * must never go back in time.
+ *
+ * Every run is printed as one JSON object per line, with "scaling" the
+ * read throughput relative to the one-reader run of the same mode times
+ * the number of readers, 1.0 being linear. The exit status is 1 if any
+ * torn or stale value was seen.
+ *
+ * Build together with the library, e.g.
+ *   cc -O2 -I. bench/tp_stress.c tinyparam.c -lcjson -lpthread -o tp_stress
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tinyparam.h"
+
+#define PAIR_EVERY 16 // Reads between two checks of the paired keys
+
+typedef enum mode {
+    MODE_RWLOCK,
+    MODE_SNAPSHOT,
+    MODE_CACHE,
+} read_mode_t;
+
+static const char *mode_names[] = { "rwlock", "snapshot", "cache" };
+
+typedef struct stress {
+    const char *file;       // Generated parameter file
+    int keys;               // Keys written by the writers
+    int writers;            // Writer threads
+    int max_threads;        // Most reader threads
+    long ms;                // Duration of one run
+    char **paths;           // Dotted key of every written leaf
+    tp_handle_t *h;         // Handle of the current run
+    read_mode_t mode;       // Read path of the current run
+    unsigned long *issued;  // Newest number handed to tp_set() per key
+    unsigned long *committed; // Newest number whose tp_set() returned per key
+    int stop;               // Set to end the run
+    pthread_barrier_t start; // Releases all threads of a run at once
+} stress_t;
+
+typedef struct worker {
+    stress_t *s;            // Shared state
+    int id;                 // Writer or reader number
+    unsigned long *last;    // Newest number this reader saw per key
+    long ops;               // Reads or writes done
+    long torn;              // Values that were never written or did not match
+    long stale;             // Values older than the bound
+} worker_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned long check_word(unsigned long seq)
+{
+    return (seq * 2654435761ul) & 0xfffffffful;
+}
+
+/**
+ * @brief Parse "seq:check"
+ *
+ * @return int 0 with *seq set, -1 if torn
+ */
+static int parse_value(const char *v, unsigned long *seq)
+{
+    unsigned long check;
+    char end;
+
+    if (!v || sscanf(v, "%lu:%lu%c", seq, &check, &end) != 2 || check != check_word(*seq)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write the parameter file, every key at sequence 0
+ */
+static int generate(stress_t *s)
+{
+    FILE *fp = fopen(s->file, "w");
+    if (!fp) {
+        return -1;
+    }
+    fprintf(fp, "{\n    \"stress\": {\n");
+    for (int i = 0; i < s->keys; i++) {
+        fprintf(fp, "        \"k%d\": \"0:0\",\n", i);
+    }
+    fprintf(fp, "        \"p0\": \"0:0\",\n        \"p1\": \"0:0\"\n    }\n}\n");
+    return fclose(fp);
+}
+
+/**
+ * @brief Read one key with the run's read path and check it against the bounds
+ */
+static void read_key(worker_t *w, int k, char *buf, size_t len)
+{
+    stress_t *s = w->s;
+    unsigned long floor = __atomic_load_n(&s->committed[k], __ATOMIC_ACQUIRE);
+    const char *v = NULL;
+    unsigned long seq = 0;
+    int torn;
+
+    if (s->mode == MODE_SNAPSHOT) {
+        tp_snapshot_t *snap = tp_snapshot_acquire(s->h);
+        v = snap ? tp_snapshot_peek(snap, s->paths[k]) : NULL;
+        torn = parse_value(v, &seq);
+        tp_snapshot_release(snap);
+    } else {
+        v = tp_get_into(s->h, s->paths[k], buf, len) >= 0 ? buf : NULL;
+        torn = parse_value(v, &seq);
+    }
+
+    if (torn || seq > __atomic_load_n(&s->issued[k], __ATOMIC_ACQUIRE)) {
+        w->torn++;
+    } else if (seq < floor || seq < w->last[k]) {
+        w->stale++;
+    } else {
+        w->last[k] = seq;
+    }
+}
+
+/**
+ * @brief Read both paired keys under one guard, they must come from the same transaction
+ */
+static void read_pair(worker_t *w)
+{
+    stress_t *s = w->s;
+    unsigned long a = 0;
+    unsigned long b = 0;
+    int torn;
+
+    if (s->mode == MODE_SNAPSHOT) {
+        tp_snapshot_t *snap = tp_snapshot_acquire(s->h);
+        torn = !snap || parse_value(tp_snapshot_peek(snap, "stress.p0"), &a) != 0 ||
+               parse_value(tp_snapshot_peek(snap, "stress.p1"), &b) != 0;
+        tp_snapshot_release(snap);
+    } else {
+        tp_read_lock(s->h);
+        torn = parse_value(tp_get_ref(s->h, "stress.p0"), &a) != 0 ||
+               parse_value(tp_get_ref(s->h, "stress.p1"), &b) != 0;
+        tp_read_unlock(s->h);
+    }
+    if (torn || a != b) {
+        w->torn++;
+    }
+}
+
+static void *reader_run(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    stress_t *s = w->s;
+    uint32_t seed = 2463534242u + (uint32_t)w->id * 7919u;
+    char buf[64];
+
+    pthread_barrier_wait(&s->start);
+    while (!__atomic_load_n(&s->stop, __ATOMIC_RELAXED)) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        // Thread caches give no guarantee across keys, so pairs are checked on the other paths
+        if (s->mode != MODE_CACHE && w->ops % PAIR_EVERY == 0) {
+            read_pair(w);
+        } else {
+            read_key(w, (int)(seed % (uint32_t)s->keys), buf, sizeof(buf));
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+static void *writer_run(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    stress_t *s = w->s;
+    unsigned long pair = 0;
+    char value[64];
+
+    pthread_barrier_wait(&s->start);
+    for (int k = w->id; !__atomic_load_n(&s->stop, __ATOMIC_RELAXED);) {
+        unsigned long seq = s->issued[k] + 1;
+        snprintf(value, sizeof(value), "%lu:%lu", seq, check_word(seq));
+        __atomic_store_n(&s->issued[k], seq, __ATOMIC_RELEASE);
+        if (tp_set(s->h, s->paths[k], value) != 0) {
+            w->torn++;
+        }
+        __atomic_store_n(&s->committed[k], seq, __ATOMIC_RELEASE);
+        w->ops++;
+        k += s->writers;
+        if (k >= s->keys) {
+            k = w->id;
+        }
+
+        if (w->id == 0 && w->ops % 4 == 0) {
+            tp_txn_t *t = tp_txn_begin(s->h);
+            pair++;
+            snprintf(value, sizeof(value), "%lu:%lu", pair, check_word(pair));
+            if (!t || tp_txn_set(t, "stress.p0", value) != 0 || tp_txn_set(t, "stress.p1", value) != 0 ||
+                tp_txn_commit(t) != 0) {
+                w->torn++;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run readers and writers for s->ms and print one result line
+ *
+ * @param base Reads per second of the one-reader run of this mode, 0 during that run
+ * @return double Reads per second, -1 if a torn or stale value was seen or the run failed
+ */
+static double run(stress_t *s, int readers, double base)
+{
+    int total = readers + s->writers;
+    worker_t *w = (worker_t *)calloc(total, sizeof(worker_t));
+    pthread_t *tid = (pthread_t *)calloc(total, sizeof(pthread_t));
+    unsigned long *last = (unsigned long *)calloc((size_t)readers * s->keys, sizeof(unsigned long));
+    if (!w || !tid || !last || pthread_barrier_init(&s->start, NULL, total + 1) != 0) {
+        free(w);
+        free(tid);
+        free(last);
+        return -1;
+    }
+
+    s->stop = 0;
+    int started = 0;
+    for (int i = 0; i < total; i++) {
+        w[i].s = s;
+        w[i].id = i < s->writers ? i : i - s->writers;
+        w[i].last = i < s->writers ? NULL : last + (size_t)w[i].id * s->keys;
+        if (pthread_create(&tid[i], NULL, i < s->writers ? writer_run : reader_run, &w[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started < total) {
+        // The barrier cannot be met, let nobody wait on it
+        fprintf(stderr, "Failed to start thread %d of %d\n", started + 1, total);
+        exit(1);
+    }
+
+    pthread_barrier_wait(&s->start);
+    uint64_t t0 = now_ns();
+    struct timespec ts = { s->ms / 1000, (s->ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELAXED);
+    long reads = 0;
+    long writes = 0;
+    long torn = 0;
+    long stale = 0;
+    for (int i = 0; i < total; i++) {
+        pthread_join(tid[i], NULL);
+        *(i < s->writers ? &writes : &reads) += w[i].ops;
+        torn += w[i].torn;
+        stale += w[i].stale;
+    }
+    uint64_t wall = now_ns() - t0;
+    pthread_barrier_destroy(&s->start);
+
+    double rate = wall ? reads * 1e9 / wall : 0.0;
+    printf("{\"bench\":\"stress\",\"mode\":\"%s\",\"readers\":%d,\"writers\":%d,\"keys\":%d,\"reads\":%ld,"
+           "\"reads_per_sec\":%.0f,\"per_reader\":%.0f,\"scaling\":%.2f,\"writes\":%ld,\"writes_per_sec\":%.0f,"
+           "\"torn\":%ld,\"stale\":%ld}\n",
+           mode_names[s->mode], readers, s->writers, s->keys, reads, rate, rate / readers,
+           base > 0 ? rate / (base * readers) : 1.0, writes, wall ? writes * 1e9 / wall : 0.0, torn, stale);
+    fflush(stdout);
+    free(w);
+    free(tid);
+    free(last);
+    return torn || stale ? -1 : rate;
+}
+
+int main(int argc, char **argv)
+{
+    stress_t s = { .file = "tp_stress.json", .keys = 64, .writers = 1, .max_threads = 64, .ms = 200 };
+    static const unsigned int flags[] = { 0, TP_OPEN_SNAPSHOT, TP_OPEN_THREAD_CACHE };
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:w:k:m:f:")) != -1) {
+        switch (opt) {
+        case 't': s.max_threads = atoi(optarg); break;
+        case 'w': s.writers = atoi(optarg); break;
+        case 'k': s.keys = atoi(optarg); break;
+        case 'm': s.ms = atol(optarg); break;
+        case 'f': s.file = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-w writers] [-k keys] [-m ms] [-f file]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (s.max_threads < 1 || s.max_threads > 1024 || s.writers < 0 || s.keys < 1 || s.keys > 100000 ||
+        s.writers > s.keys || s.ms < 1) {
+        fprintf(stderr, "Threads must be 1 to 1024, keys 1 to 100000, writers at most keys, ms positive\n");
+        return 2;
+    }
+
+    s.paths = (char **)calloc(s.keys, sizeof(char *));
+    s.issued = (unsigned long *)calloc(s.keys, sizeof(unsigned long));
+    s.committed = (unsigned long *)calloc(s.keys, sizeof(unsigned long));
+    if (!s.paths || !s.issued || !s.committed) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < s.keys; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "stress.k%d", i);
+        s.paths[i] = strdup(path);
+    }
+
+    for (int m = MODE_RWLOCK; m <= MODE_CACHE; m++) {
+        if (generate(&s) != 0) {
+            fprintf(stderr, "Failed to generate %s: %s\n", s.file, strerror(errno));
+            return 1;
+        }
+        memset(s.issued, 0, s.keys * sizeof(unsigned long));
+        memset(s.committed, 0, s.keys * sizeof(unsigned long));
+        tp_options_t opts = { .flags = flags[m], .durability = TP_DURABILITY_NONE };
+        s.h = tp_open_ex((char *)s.file, &opts);
+        if (!s.h) {
+            fprintf(stderr, "Failed to open %s in %s mode\n", s.file, mode_names[m]);
+            return 1;
+        }
+        s.mode = (read_mode_t)m;
+
+        double base = 0;
+        for (int readers = 1;; readers = readers * 2 > s.max_threads ? s.max_threads : readers * 2) {
+            double rate = run(&s, readers, base);
+            if (rate < 0) {
+                failed = 1;
+            } else if (readers == 1) {
+                base = rate;
+            }
+            if (readers == s.max_threads) {
+                break;
+            }
+        }
+        tp_close(s.h);
+    }
+
+    for (int i = 0; i < s.keys; i++) {
+        free(s.paths[i]);
+    }
+    free(s.paths);
+    free(s.issued);
+    free(s.committed);
+    unlink(s.file);
+    return failed;
+}
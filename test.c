@@ -1,9 +1,14 @@
 #include "tinyparam.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 
 // 模拟日志函数（如果 aml_log.h 不存在）
 #ifndef AML_LOGE
@@ -149,6 +154,1778 @@ void test_error_cases() {
     tp_close(handle);
 }
 
+// 测试用例：预解析键句柄
+void test_key_handles() {
+    printf("\n=== Test Key Handles ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+
+    tp_key_t *key = tp_key_resolve(handle, "system.audio.volume");
+    char *value = key ? tp_get_h(handle, key) : NULL;
+    if (value && strcmp(value, "50") == 0) {
+        printf("PASS: Get through key handle\n");
+    } else {
+        printf("FAIL: Get through key handle: %s\n", value ? value : "NULL");
+    }
+    free(value);
+
+    // 通过 tp_set 修改后句柄仍然有效
+    tp_set(handle, "system.audio.volume", "60");
+    value = key ? tp_get_h(handle, key) : NULL;
+    if (value && strcmp(value, "60") == 0) {
+        printf("PASS: Key handle valid after tp_set\n");
+    } else {
+        printf("FAIL: Key handle valid after tp_set: %s\n", value ? value : "NULL");
+    }
+    free(value);
+
+    int ret = key ? tp_set_h(handle, key, "70") : -1;
+    value = tp_get(handle, "system.audio.volume");
+    if (ret == 0 && value && strcmp(value, "70") == 0) {
+        printf("PASS: Set through key handle\n");
+    } else {
+        printf("FAIL: Set through key handle\n");
+    }
+    free(value);
+    tp_key_free(key);
+
+    // 索引查找与 cJSON 一样不区分大小写
+    value = tp_get(handle, "System.Display.Brightness");
+    if (value && strcmp(value, "75") == 0) {
+        printf("PASS: Case-insensitive indexed lookup\n");
+    } else {
+        printf("FAIL: Case-insensitive indexed lookup: %s\n", value ? value : "NULL");
+    }
+    free(value);
+
+    // 不存在的键无法解析
+    key = tp_key_resolve(handle, "system.invalid.key");
+    if (!key) {
+        printf("PASS: Failed to resolve nonexistent key as expected\n");
+    } else {
+        printf("FAIL: Resolved nonexistent key\n");
+        tp_key_free(key);
+    }
+
+    tp_close(handle);
+}
+
+// 测试用例：无锁快照读取
+void test_snapshots() {
+    printf("\n=== Test Snapshots ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .flags = TP_OPEN_SNAPSHOT };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+
+    // 持有快照期间的写入对该快照不可见
+    tp_snapshot_t *snap = tp_snapshot_acquire(handle);
+    tp_set(handle, "system.audio.volume", "80");
+    char *value = tp_snapshot_get(snap, "system.audio.volume");
+    if (value && strcmp(value, "50") == 0) {
+        printf("PASS: Snapshot isolated from later tp_set\n");
+    } else {
+        printf("FAIL: Snapshot isolated from later tp_set: %s\n", value ? value : "NULL");
+    }
+    free(value);
+    tp_snapshot_release(snap);
+
+    // 重新获取快照可以看到最新值
+    snap = tp_snapshot_acquire(handle);
+    value = tp_snapshot_get(snap, "system.audio.volume");
+    if (value && strcmp(value, "80") == 0) {
+        printf("PASS: New snapshot sees latest value\n");
+    } else {
+        printf("FAIL: New snapshot sees latest value: %s\n", value ? value : "NULL");
+    }
+    free(value);
+    tp_snapshot_release(snap);
+
+    // 写入文件失败的值不会出现在快照中，临时文件路径被目录占用
+    mkdir(TEST_JSON_FILE ".tmp", 0755);
+    int ret = tp_set(handle, "system.audio.volume", "81");
+    rmdir(TEST_JSON_FILE ".tmp");
+    snap = tp_snapshot_acquire(handle);
+    value = tp_snapshot_get(snap, "system.audio.volume");
+    if (ret != 0 && value && strcmp(value, "80") == 0) {
+        printf("PASS: Failed write not published\n");
+    } else {
+        printf("FAIL: Failed write not published: %s\n", value ? value : "NULL");
+    }
+    free(value);
+    tp_snapshot_release(snap);
+
+    // 多页索引：逐次写入后新快照看到全部新值，未修改的键保持原值
+    tp_close(handle);
+    FILE *fp = fopen(TEST_JSON_FILE, "w");
+    fprintf(fp, "{");
+    for (int i = 0; i < 40; i++) {
+        fprintf(fp, "%s\"k%d\": \"%d\"", i ? ", " : "", i, i);
+    }
+    fprintf(fp, "}");
+    fclose(fp);
+    handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    tp_set(handle, "k3", "103");
+    tp_set(handle, "k30", "130");
+    snap = tp_snapshot_acquire(handle);
+    int same = 1;
+    for (int i = 0; i < 40; i++) {
+        char key[16], want[16];
+        snprintf(key, sizeof(key), "k%d", i);
+        snprintf(want, sizeof(want), "%d", (i == 3 || i == 30) ? 100 + i : i);
+        const char *v = tp_snapshot_peek(snap, key);
+        same = same && v && strcmp(v, want) == 0;
+    }
+    tp_snapshot_release(snap);
+    if (handle && same) {
+        printf("PASS: Snapshot pages follow each write\n");
+    } else {
+        printf("FAIL: Snapshot pages follow each write\n");
+    }
+
+    // 重新加载增加了键，快照随之重建
+    fp = fopen(TEST_JSON_FILE, "w");
+    fprintf(fp, "{\"k3\": \"103\", \"k40\": \"40\"}");
+    fclose(fp);
+    tp_reload(handle);
+    snap = tp_snapshot_acquire(handle);
+    const char *added = tp_snapshot_peek(snap, "k40");
+    const char *removed = tp_snapshot_peek(snap, "k30");
+    if (added && strcmp(added, "40") == 0 && !removed) {
+        printf("PASS: Snapshot rebuilt after key set change\n");
+    } else {
+        printf("FAIL: Snapshot rebuilt after key set change\n");
+    }
+    tp_snapshot_release(snap);
+
+    // 未启用快照模式时获取失败
+    tp_handle_t *plain = tp_open(TEST_JSON_FILE);
+    if (plain && !tp_snapshot_acquire(plain)) {
+        printf("PASS: Snapshot refused without TP_OPEN_SNAPSHOT\n");
+    } else {
+        printf("FAIL: Snapshot refused without TP_OPEN_SNAPSHOT\n");
+    }
+    tp_close(plain);
+
+    tp_close(handle);
+}
+
+// 读取文件中的参数值（使用新句柄，验证是否已持久化）
+static char *read_persisted(const char *key) {
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        return NULL;
+    }
+    char *value = tp_get(handle, (char *)key);
+    tp_close(handle);
+    return value;
+}
+
+// 测试用例：延迟写入与合并
+void test_write_behind() {
+    printf("\n=== Test Write Behind ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .flags = TP_OPEN_WRITE_BEHIND, .flush_interval_ms = 10000 };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+
+    // 写入只更新内存，文件保持不变
+    tp_set(handle, "system.audio.volume", "61");
+    tp_set(handle, "system.audio.volume", "62");
+    char *value = tp_get(handle, "system.audio.volume");
+    char *stored = read_persisted("system.audio.volume");
+    if (value && strcmp(value, "62") == 0 && stored && strcmp(stored, "50") == 0) {
+        printf("PASS: tp_set deferred persistence\n");
+    } else {
+        printf("FAIL: tp_set deferred persistence\n");
+    }
+    free(value);
+    free(stored);
+
+    // tp_flush 立即写入文件
+    int ret = tp_flush(handle);
+    stored = read_persisted("system.audio.volume");
+    if (ret == 0 && stored && strcmp(stored, "62") == 0) {
+        printf("PASS: tp_flush persisted pending changes\n");
+    } else {
+        printf("FAIL: tp_flush persisted pending changes\n");
+    }
+    free(stored);
+
+    // tp_close 写入剩余的修改
+    tp_set(handle, "system.display.brightness", "90");
+    tp_close(handle);
+    stored = read_persisted("system.display.brightness");
+    if (stored && strcmp(stored, "90") == 0) {
+        printf("PASS: tp_close flushed pending changes\n");
+    } else {
+        printf("FAIL: tp_close flushed pending changes\n");
+    }
+    free(stored);
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int failed;
+    char stored[16];
+} async_result_t;
+
+static void async_done(tp_handle_t *h, const char *key, int status, void *ctx) {
+    async_result_t *r = (async_result_t *)ctx;
+    char *stored = status == 0 ? read_persisted(key) : NULL;
+    (void)h;
+    pthread_mutex_lock(&r->lock);
+    r->done++;
+    r->failed += status != 0;
+    snprintf(r->stored, sizeof(r->stored), "%s", stored ? stored : "");
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    free(stored);
+}
+
+static void async_wait(async_result_t *r, int count) {
+    pthread_mutex_lock(&r->lock);
+    while (r->done < count) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+// 测试异步写入与完成回调
+void test_async_set() {
+    printf("\n=== Test Async Set ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        printf("FAIL: Open for async writes\n");
+        return;
+    }
+    async_result_t r = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+    // 返回时内存中的值已更新，回调时文件已写入
+    int ret = tp_set_async(handle, "system.audio.volume", "71", async_done, &r);
+    char *value = tp_get(handle, "system.audio.volume");
+    async_wait(&r, 1);
+    if (ret == 0 && value && strcmp(value, "71") == 0 && r.failed == 0 && strcmp(r.stored, "71") == 0) {
+        printf("PASS: Async set visible at once and persisted on completion\n");
+    } else {
+        printf("FAIL: Async set visible at once and persisted on completion\n");
+    }
+    free(value);
+
+    // 写入失败时回调报告错误，临时文件路径被目录占用
+    mkdir(TEST_JSON_FILE ".tmp", 0755);
+    ret = tp_set_async(handle, "system.audio.volume", "72", async_done, &r);
+    async_wait(&r, 2);
+    rmdir(TEST_JSON_FILE ".tmp");
+    if (ret == 0 && r.failed == 1) {
+        printf("PASS: Async set reports write failure\n");
+    } else {
+        printf("FAIL: Async set reports write failure\n");
+    }
+
+    // 缺失的键同步失败，不调用回调
+    if (tp_set_async(handle, "system.audio.missing", "1", async_done, &r) != 0) {
+        printf("PASS: Async set of missing key rejected\n");
+    } else {
+        printf("FAIL: Async set of missing key rejected\n");
+    }
+
+    // tp_close 等待所有排队的写入及其回调
+    for (int i = 0; i < 20; i++) {
+        char v[16];
+        snprintf(v, sizeof(v), "%d", 80 + i);
+        tp_set_async(handle, "system.display.brightness", v, async_done, &r);
+    }
+    tp_close(handle);
+    char *stored = read_persisted("system.display.brightness");
+    if (r.done == 22 && r.failed == 1 && stored && strcmp(stored, "99") == 0) {
+        printf("PASS: tp_close drained async writes\n");
+    } else {
+        printf("FAIL: tp_close drained async writes\n");
+    }
+    free(stored);
+}
+
+// 测试用例：批量事务写入
+void test_transactions() {
+    printf("\n=== Test Transactions ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+
+    tp_txn_t *txn = tp_txn_begin(handle);
+    tp_txn_set(txn, "system.audio.volume", "20");
+    tp_txn_set(txn, "system.audio.mute", "true");
+    tp_txn_set(txn, "system.display.brightness", "30");
+    int ret = tp_txn_commit(txn);
+    char *volume = read_persisted("system.audio.volume");
+    char *mute = read_persisted("system.audio.mute");
+    if (ret == 0 && volume && strcmp(volume, "20") == 0 && mute && strcmp(mute, "true") == 0) {
+        printf("PASS: Commit applied and persisted all values\n");
+    } else {
+        printf("FAIL: Commit applied and persisted all values\n");
+    }
+    free(volume);
+    free(mute);
+
+    // 任意键不存在时整个事务不生效
+    txn = tp_txn_begin(handle);
+    tp_txn_set(txn, "system.audio.volume", "99");
+    tp_txn_set(txn, "system.invalid.key", "1");
+    ret = tp_txn_commit(txn);
+    volume = tp_get(handle, "system.audio.volume");
+    if (ret != 0 && volume && strcmp(volume, "20") == 0) {
+        printf("PASS: Commit with missing key changed nothing\n");
+    } else {
+        printf("FAIL: Commit with missing key changed nothing\n");
+    }
+    free(volume);
+
+    // 放弃的事务不生效
+    txn = tp_txn_begin(handle);
+    tp_txn_set(txn, "system.audio.volume", "98");
+    tp_txn_abort(txn);
+    volume = tp_get(handle, "system.audio.volume");
+    if (volume && strcmp(volume, "20") == 0) {
+        printf("PASS: Aborted transaction changed nothing\n");
+    } else {
+        printf("FAIL: Aborted transaction changed nothing\n");
+    }
+    free(volume);
+
+    tp_close(handle);
+}
+
+// 测试修改历史与回滚
+void test_history() {
+    printf("\n=== Test History ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .history = 4 };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open with history\n");
+        return;
+    }
+
+    // 记录键、旧值和新值，最新的在前
+    tp_set(handle, "system.audio.volume", "51");
+    tp_set(handle, "system.audio.volume", "52");
+    tp_set(handle, "system.display.brightness", "81");
+    tp_history_t hist[8];
+    int n = tp_history(handle, hist, 8);
+    if (n == 3 && strcmp(hist[0].key, "system.display.brightness") == 0 && strcmp(hist[0].old_value, "75") == 0 &&
+        strcmp(hist[0].new_value, "81") == 0 && strcmp(hist[2].old_value, "50") == 0 && hist[2].time.tv_sec > 0) {
+        printf("PASS: Changes recorded\n");
+    } else {
+        printf("FAIL: Changes recorded\n");
+    }
+
+    // 回滚最近两次修改，一次写入文件，回滚本身不记录
+    int undone = tp_rollback(handle, 2);
+    char *volume = read_persisted("system.audio.volume");
+    char *brightness = read_persisted("system.display.brightness");
+    if (undone == 2 && volume && strcmp(volume, "51") == 0 && brightness && strcmp(brightness, "75") == 0 &&
+        tp_history(handle, hist, 8) == 1) {
+        printf("PASS: Rollback of last changes\n");
+    } else {
+        printf("FAIL: Rollback of last changes\n");
+    }
+    free(volume);
+    free(brightness);
+
+    // 环形缓冲区满后覆盖最旧的记录，回滚到最早仍记录的修改为止
+    for (int i = 0; i < 6; i++) {
+        char v[16];
+        snprintf(v, sizeof(v), "%d", 60 + i);
+        tp_set(handle, "system.audio.volume", v);
+    }
+    undone = tp_rollback(handle, 10);
+    volume = tp_get(handle, "system.audio.volume");
+    if (tp_history(handle, hist, 8) == 0 && undone == 4 && volume && strcmp(volume, "61") == 0) {
+        printf("PASS: Ring keeps the newest changes\n");
+    } else {
+        printf("FAIL: Ring keeps the newest changes\n");
+    }
+    free(volume);
+
+    // 旧值过长被截断的记录不能回滚
+    char long_value[100];
+    memset(long_value, 'x', sizeof(long_value) - 1);
+    long_value[sizeof(long_value) - 1] = '\0';
+    tp_set(handle, "system.audio.mute", long_value);
+    tp_set(handle, "system.audio.mute", "short");
+    tp_set(handle, "system.audio.volume", "70");
+    undone = tp_rollback(handle, 3);
+    char *mute = tp_get(handle, "system.audio.mute");
+    if (undone == 1 && mute && strcmp(mute, "short") == 0) {
+        printf("PASS: Rollback stops at truncated change\n");
+    } else {
+        printf("FAIL: Rollback stops at truncated change\n");
+    }
+    free(mute);
+    tp_close(handle);
+
+    // 未启用历史时失败
+    handle = tp_open(TEST_JSON_FILE);
+    if (handle && tp_rollback(handle, 1) == -1 && tp_history(handle, hist, 8) == -1) {
+        printf("PASS: History disabled by default\n");
+    } else {
+        printf("FAIL: History disabled by default\n");
+    }
+    if (handle) {
+        tp_close(handle);
+    }
+}
+
+// 测试用例：追加式变更日志
+void test_journal() {
+    printf("\n=== Test Journal ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    unlink(TEST_JSON_FILE ".journal");
+    tp_options_t opts = { .flags = TP_OPEN_JOURNAL };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+
+    // 写入只追加日志，不重写主文件
+    tp_set(handle, "system.audio.volume", "33");
+    tp_close(handle);
+    char *stored = read_persisted("system.audio.volume");
+    if (stored && strcmp(stored, "50") == 0) {
+        printf("PASS: tp_set appended to journal only\n");
+    } else {
+        printf("FAIL: tp_set appended to journal only\n");
+    }
+    free(stored);
+
+    // 重新打开时回放日志，并丢弃损坏的尾部
+    FILE *fp = fopen(TEST_JSON_FILE ".journal", "a");
+    fwrite("garbage", 1, 7, fp);
+    fclose(fp);
+    handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    char *value = handle ? tp_get(handle, "system.audio.volume") : NULL;
+    if (value && strcmp(value, "33") == 0) {
+        printf("PASS: Journal replayed on open\n");
+    } else {
+        printf("FAIL: Journal replayed on open: %s\n", value ? value : "NULL");
+    }
+    free(value);
+    tp_close(handle);
+
+    // 超过阈值后压缩进主文件
+    opts.journal_limit = 1;
+    handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    tp_set(handle, "system.display.brightness", "44");
+    tp_close(handle);
+    stored = read_persisted("system.display.brightness");
+    char *volume = read_persisted("system.audio.volume");
+    if (stored && strcmp(stored, "44") == 0 && volume && strcmp(volume, "33") == 0) {
+        printf("PASS: Journal compacted into base file\n");
+    } else {
+        printf("FAIL: Journal compacted into base file\n");
+    }
+    free(stored);
+    free(volume);
+
+    unlink(TEST_JSON_FILE ".journal");
+}
+
+// 测试用例：无分配读取
+void test_zero_copy_reads() {
+    printf("\n=== Test Zero Copy Reads ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .flags = TP_OPEN_SNAPSHOT };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+
+    char buf[8];
+    int n = tp_get_into(handle, "system.audio.mute", buf, sizeof(buf));
+    if (n == 5 && strcmp(buf, "false") == 0) {
+        printf("PASS: tp_get_into copied value\n");
+    } else {
+        printf("FAIL: tp_get_into copied value\n");
+    }
+
+    // 缓冲区不足时截断并返回完整长度
+    n = tp_get_into(handle, "system.audio.mute", buf, 3);
+    if (n == 5 && strcmp(buf, "fa") == 0) {
+        printf("PASS: tp_get_into truncated value\n");
+    } else {
+        printf("FAIL: tp_get_into truncated value\n");
+    }
+
+    tp_read_lock(handle);
+    const char *ref = tp_get_ref(handle, "system.audio.volume");
+    if (ref && strcmp(ref, "50") == 0) {
+        printf("PASS: tp_get_ref borrowed value\n");
+    } else {
+        printf("FAIL: tp_get_ref borrowed value\n");
+    }
+    tp_read_unlock(handle);
+
+    tp_snapshot_t *snap = tp_snapshot_acquire(handle);
+    ref = tp_snapshot_peek(snap, "system.display.brightness");
+    if (ref && strcmp(ref, "75") == 0) {
+        printf("PASS: tp_snapshot_peek borrowed value\n");
+    } else {
+        printf("FAIL: tp_snapshot_peek borrowed value\n");
+    }
+    tp_snapshot_release(snap);
+
+    tp_close(handle);
+}
+
+// 测试用例：数值与布尔类型访问
+void test_typed_access() {
+    printf("\n=== Test Typed Access ===\n");
+
+    // 字符串形式的数值与布尔值
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+    int volume = 0;
+    int mute = 1;
+    if (tp_get_int(handle, "system.audio.volume", &volume) == 0 && volume == 50 &&
+        tp_get_bool(handle, "system.audio.mute", &mute) == 0 && mute == 0) {
+        printf("PASS: Typed get on string values\n");
+    } else {
+        printf("FAIL: Typed get on string values\n");
+    }
+    tp_set_int(handle, "system.audio.volume", 65);
+    char *value = tp_get(handle, "system.audio.volume");
+    if (value && strcmp(value, "65") == 0) {
+        printf("PASS: Typed set keeps string type\n");
+    } else {
+        printf("FAIL: Typed set keeps string type\n");
+    }
+    free(value);
+    tp_close(handle);
+
+    // 原生 JSON 数值与布尔值
+    FILE *fp = fopen("typed.json", "w");
+    fputs("{\"audio\": {\"volume\": 50, \"gain\": 0.5, \"mute\": false}}", fp);
+    fclose(fp);
+    handle = tp_open("typed.json");
+    if (!handle) {
+        AML_LOGE("Failed to open typed.json\n");
+        return;
+    }
+    double gain = 0;
+    if (tp_get_double(handle, "audio.gain", &gain) == 0 && gain == 0.5 &&
+        tp_get_int(handle, "audio.volume", &volume) == 0 && volume == 50) {
+        printf("PASS: Typed get on native values\n");
+    } else {
+        printf("FAIL: Typed get on native values\n");
+    }
+    if (tp_set_bool(handle, "audio.mute", 1) == 0 && tp_set_double(handle, "audio.gain", 0.25) == 0 &&
+        tp_set(handle, "audio.volume", "loud") != 0) {
+        printf("PASS: Typed set on native values\n");
+    } else {
+        printf("FAIL: Typed set on native values\n");
+    }
+    tp_close(handle);
+
+    handle = tp_open("typed.json");
+    mute = 0;
+    if (handle && tp_get_bool(handle, "audio.mute", &mute) == 0 && mute == 1 &&
+        tp_get_double(handle, "audio.gain", &gain) == 0 && gain == 0.25) {
+        printf("PASS: Native values persisted\n");
+    } else {
+        printf("FAIL: Native values persisted\n");
+    }
+    tp_close(handle);
+    unlink("typed.json");
+}
+
+// 测试编译后的二进制镜像
+void test_compiled_image() {
+    printf("\n=== Test Compiled Image ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    if (tp_compile(TEST_JSON_FILE, "test.tpb") != 0) {
+        printf("FAIL: Compile image\n");
+        return;
+    }
+    tp_handle_t *handle = tp_open("test.tpb");
+    if (!handle) {
+        printf("FAIL: Open compiled image\n");
+        unlink("test.tpb");
+        return;
+    }
+
+    char *value = tp_get(handle, "system.audio.volume");
+    int volume = 0;
+    if (value && strcmp(value, "50") == 0 && tp_get_int(handle, "SYSTEM.AUDIO.VOLUME", &volume) == 0 &&
+        volume == 50) {
+        printf("PASS: Read from compiled image\n");
+    } else {
+        printf("FAIL: Read from compiled image\n");
+    }
+    free(value);
+
+    tp_key_t *k = tp_key_resolve(handle, "system.audio.volume");
+    value = tp_get_h(handle, k);
+    if (value && strcmp(value, "50") == 0 && !tp_get_ref(handle, "system.audio.missing") &&
+        tp_set(handle, "system.audio.volume", "60") != 0) {
+        printf("PASS: Compiled image is read-only\n");
+    } else {
+        printf("FAIL: Compiled image is read-only\n");
+    }
+    free(value);
+    tp_key_free(k);
+    tp_close(handle);
+    unlink("test.tpb");
+}
+
+// 记录回调收到的最后一次变更
+typedef struct {
+    int count;
+    char key[64];
+    char value[64];
+} watch_record_t;
+
+static void record_change(tp_handle_t *h, const char *key, const char *value, void *ctx) {
+    (void)h;
+    watch_record_t *r = (watch_record_t *)ctx;
+    snprintf(r->key, sizeof(r->key), "%s", key);
+    snprintf(r->value, sizeof(r->value), "%s", value);
+    __atomic_add_fetch(&r->count, 1, __ATOMIC_RELEASE);
+}
+
+// 测试变更通知
+void test_watch() {
+    printf("\n=== Test Watch ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+
+    // 前缀匹配：只有 system.audio 下的键触发回调
+    watch_record_t audio = { 0 };
+    tp_watch_t *w = tp_watch(handle, "system.audio", record_change, &audio);
+    tp_set(handle, "system.display.brightness", "90");
+    tp_set(handle, "system.audio.volume", "55");
+    if (audio.count == 1 && strcmp(audio.key, "system.audio.volume") == 0 && strcmp(audio.value, "55") == 0) {
+        printf("PASS: Watch fires for matching keys only\n");
+    } else {
+        printf("FAIL: Watch fires for matching keys only\n");
+    }
+
+    tp_unwatch(handle, w);
+    tp_set(handle, "system.audio.volume", "60");
+    if (audio.count == 1) {
+        printf("PASS: Unwatch stops callbacks\n");
+    } else {
+        printf("FAIL: Unwatch stops callbacks\n");
+    }
+    tp_close(handle);
+
+    // 共享模式下其他进程的修改也会通知
+    shm_unlink("/tinyparam.test");
+    tp_options_t opts = { .flags = TP_OPEN_SHARED, .shm_name = "/tinyparam.test" };
+    handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open shared store\n");
+        return;
+    }
+    watch_record_t all = { 0 };
+    tp_watch(handle, "", record_change, &all);
+    pid_t pid = fork();
+    if (pid == 0) {
+        tp_handle_t *child = tp_open_ex(TEST_JSON_FILE, &opts);
+        int ret = child && tp_set(child, "system.audio.mute", "true") == 0 ? 0 : 1;
+        tp_close(child);
+        _exit(ret);
+    }
+    waitpid(pid, NULL, 0);
+    for (int i = 0; i < 200 && __atomic_load_n(&all.count, __ATOMIC_ACQUIRE) == 0; i++) {
+        usleep(10000);
+    }
+    if (__atomic_load_n(&all.count, __ATOMIC_ACQUIRE) == 1 && strcmp(all.key, "system.audio.mute") == 0 &&
+        strcmp(all.value, "true") == 0) {
+        printf("PASS: Watch sees writes from another process\n");
+    } else {
+        printf("FAIL: Watch sees writes from another process\n");
+    }
+    tp_close(handle);
+    shm_unlink("/tinyparam.test");
+}
+
+// 测试重新加载外部修改的文件
+void test_reload() {
+    printf("\n=== Test Reload ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        AML_LOGE("Failed to open %s\n", TEST_JSON_FILE);
+        return;
+    }
+    tp_key_t *k = tp_key_resolve(handle, "system.audio.volume");
+    watch_record_t rec = { 0 };
+    tp_watch_t *w = tp_watch(handle, "system.audio", record_change, &rec);
+
+    // 文件未变化时不重新解析
+    if (tp_reload(handle) == 0) {
+        printf("PASS: Reload skips unchanged file\n");
+    } else {
+        printf("FAIL: Reload skips unchanged file\n");
+    }
+
+    // 外部只修改数值：原地更新，键句柄仍然有效
+    FILE *fp = fopen(TEST_JSON_FILE ".new", "w");
+    fputs("{\"system\": {\"audio\": {\"volume\": \"35\", \"mute\": \"false\"}, "
+          "\"display\": {\"brightness\": \"75\"}}}", fp);
+    fclose(fp);
+    rename(TEST_JSON_FILE ".new", TEST_JSON_FILE);
+    // 通知线程可能已经先完成了重新加载
+    tp_reload(handle);
+    for (int i = 0; i < 200 && __atomic_load_n(&rec.count, __ATOMIC_ACQUIRE) == 0; i++) {
+        usleep(10000);
+    }
+    char *value = tp_get_h(handle, k);
+    if (value && strcmp(value, "35") == 0 && __atomic_load_n(&rec.count, __ATOMIC_ACQUIRE) >= 1 &&
+        strcmp(rec.key, "system.audio.volume") == 0) {
+        printf("PASS: Reload applies changed values\n");
+    } else {
+        printf("FAIL: Reload applies changed values\n");
+    }
+    free(value);
+    tp_unwatch(handle, w);
+
+    // 外部增加键：整棵树替换
+    fp = fopen(TEST_JSON_FILE ".new", "w");
+    fputs("{\"system\": {\"audio\": {\"volume\": \"40\", \"mute\": \"false\", \"balance\": \"0\"}, "
+          "\"display\": {\"brightness\": \"75\"}}}", fp);
+    fclose(fp);
+    rename(TEST_JSON_FILE ".new", TEST_JSON_FILE);
+    tp_reload(handle);
+    value = tp_get_h(handle, k);
+    char *balance = tp_get(handle, "system.audio.balance");
+    if (value && balance && strcmp(value, "40") == 0 && strcmp(balance, "0") == 0) {
+        printf("PASS: Reload picks up new keys\n");
+    } else {
+        printf("FAIL: Reload picks up new keys\n");
+    }
+    free(value);
+    free(balance);
+    tp_key_free(k);
+    tp_close(handle);
+}
+
+// 测试 arena 分配的参数树
+void test_arena() {
+    printf("\n=== Test Arena ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .flags = TP_OPEN_ARENA };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open with arena\n");
+        return;
+    }
+
+    // 反复替换值，旧值回到池中，最终值正确
+    char buf[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "%d", i);
+        tp_set(handle, "system.audio.volume", buf);
+    }
+    tp_set(handle, "system.display.brightness", "a much longer brightness value than the original");
+    char *value = tp_get(handle, "system.audio.volume");
+    if (value && strcmp(value, "99") == 0) {
+        printf("PASS: Set on arena tree\n");
+    } else {
+        printf("FAIL: Set on arena tree\n");
+    }
+    free(value);
+
+    // 外部修改后重新加载，树换到新的 arena
+    FILE *fp = fopen(TEST_JSON_FILE ".new", "w");
+    fputs("{\"system\": {\"audio\": {\"volume\": \"12\"}}}", fp);
+    fclose(fp);
+    rename(TEST_JSON_FILE ".new", TEST_JSON_FILE);
+    value = tp_reload(handle) == 1 ? tp_get(handle, "system.audio.volume") : NULL;
+    if (value && strcmp(value, "12") == 0) {
+        printf("PASS: Reload into a new arena\n");
+    } else {
+        printf("FAIL: Reload into a new arena\n");
+    }
+    free(value);
+    tp_close(handle);
+}
+
+// 测试原地改写文件中的值
+void test_inplace() {
+    printf("\n=== Test In-place Writes ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .flags = TP_OPEN_INPLACE };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open with in-place writes\n");
+        return;
+    }
+    struct stat before, after;
+    stat(TEST_JSON_FILE, &before);
+
+    // 长度不超过原值，只覆盖原位置，文件不被替换
+    tp_set(handle, "system.audio.volume", "7");
+    stat(TEST_JSON_FILE, &after);
+    char *value = read_persisted("system.audio.volume");
+    if (after.st_ino == before.st_ino && after.st_size == before.st_size && value && strcmp(value, "7") == 0) {
+        printf("PASS: Value rewritten in place\n");
+    } else {
+        printf("FAIL: Value rewritten in place\n");
+    }
+    free(value);
+
+    // 超出原位置时回退为整体重写
+    tp_set(handle, "system.audio.volume", "a value too long for the slot");
+    stat(TEST_JSON_FILE, &after);
+    value = read_persisted("system.audio.volume");
+    if (after.st_ino != before.st_ino && value && strcmp(value, "a value too long for the slot") == 0) {
+        printf("PASS: Oversized value rewrites the file\n");
+    } else {
+        printf("FAIL: Oversized value rewrites the file\n");
+    }
+    free(value);
+
+    // 整体重写后重新定位，其他键仍可原地改写
+    stat(TEST_JSON_FILE, &before);
+    tp_set(handle, "system.display.brightness", "9");
+    stat(TEST_JSON_FILE, &after);
+    value = read_persisted("system.display.brightness");
+    char *volume = read_persisted("system.audio.volume");
+    if (after.st_ino == before.st_ino && value && strcmp(value, "9") == 0 && volume &&
+        strcmp(volume, "a value too long for the slot") == 0) {
+        printf("PASS: Slots located again after a rewrite\n");
+    } else {
+        printf("FAIL: Slots located again after a rewrite\n");
+    }
+    free(value);
+    free(volume);
+
+    // 文件被外部改写后偏移失效，回退为整体重写，文件仍可解析
+    FILE *fp = fopen(TEST_JSON_FILE, "w");
+    fputs("{\"system\":{\"display\":{\"brightness\":\"1\"},\"audio\":{\"mute\":\"true\",\"volume\":\"3\"}}}", fp);
+    fclose(fp);
+    tp_set(handle, "system.display.brightness", "8");
+    value = read_persisted("system.display.brightness");
+    volume = read_persisted("system.audio.volume");
+    if (value && strcmp(value, "8") == 0 && volume && strcmp(volume, "a value too long for the slot") == 0) {
+        printf("PASS: Outside edit forces a full rewrite\n");
+    } else {
+        printf("FAIL: Outside edit forces a full rewrite\n");
+    }
+    free(value);
+    free(volume);
+
+    // 不能与日志模式同时使用
+    opts.flags = TP_OPEN_INPLACE | TP_OPEN_JOURNAL;
+    tp_handle_t *bad = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!bad) {
+        printf("PASS: In-place writes rejected with journal\n");
+    } else {
+        printf("FAIL: In-place writes rejected with journal\n");
+        tp_close(bad);
+    }
+    tp_close(handle);
+
+    // 数字按 cJSON 整体重写时的格式写入，-0 写成 0
+    fp = fopen(TEST_JSON_FILE, "w");
+    fputs("{\"gain\": 5}", fp);
+    fclose(fp);
+    opts.flags = TP_OPEN_INPLACE;
+    handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    stat(TEST_JSON_FILE, &before);
+    int ok = handle && tp_set(handle, "gain", "-0") == 0;
+    stat(TEST_JSON_FILE, &after);
+    char content[64] = { 0 };
+    fp = fopen(TEST_JSON_FILE, "r");
+    if (fp) {
+        fread(content, 1, sizeof(content) - 1, fp);
+        fclose(fp);
+    }
+    if (ok && after.st_ino == before.st_ino && strstr(content, "0") && !strstr(content, "-0")) {
+        printf("PASS: Number written in place as cJSON prints it\n");
+    } else {
+        printf("FAIL: Number written in place as cJSON prints it (%s)\n", content);
+    }
+    tp_close(handle);
+}
+
+// 测试持久化级别
+void test_durability() {
+    printf("\n=== Test Durability Levels ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .durability = TP_DURABILITY_NONE };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open with durability level\n");
+        return;
+    }
+
+    // 仅内存：文件保持不变
+    tp_set(handle, "system.audio.volume", "61");
+    char *value = read_persisted("system.audio.volume");
+    char *memory = tp_get(handle, "system.audio.volume");
+    if (value && strcmp(value, "50") == 0 && memory && strcmp(memory, "61") == 0) {
+        printf("PASS: Memory-only set leaves the file alone\n");
+    } else {
+        printf("FAIL: Memory-only set leaves the file alone\n");
+    }
+    free(value);
+    free(memory);
+
+    // 切换到更强的级别时先写出未保存的修改
+    tp_set_durability(handle, TP_DURABILITY_FULL);
+    value = read_persisted("system.audio.volume");
+    if (value && strcmp(value, "61") == 0) {
+        printf("PASS: Pending changes written on switch\n");
+    } else {
+        printf("FAIL: Pending changes written on switch\n");
+    }
+    free(value);
+
+    tp_set(handle, "system.audio.volume", "62");
+    value = read_persisted("system.audio.volume");
+    if (value && strcmp(value, "62") == 0) {
+        printf("PASS: Full durability set persisted\n");
+    } else {
+        printf("FAIL: Full durability set persisted\n");
+    }
+    free(value);
+
+    // 运行时切换到异步写入，由 tp_flush 写出
+    tp_set_durability(handle, TP_DURABILITY_ASYNC);
+    tp_set(handle, "system.audio.volume", "63");
+    char *before = read_persisted("system.audio.volume");
+    tp_flush(handle);
+    value = read_persisted("system.audio.volume");
+    if (before && strcmp(before, "62") == 0 && value && strcmp(value, "63") == 0) {
+        printf("PASS: Async level defers to the flusher\n");
+    } else {
+        printf("FAIL: Async level defers to the flusher\n");
+    }
+    free(before);
+    free(value);
+    tp_close(handle);
+
+    // 日志模式不支持异步级别
+    opts.flags = TP_OPEN_JOURNAL;
+    opts.durability = TP_DURABILITY_FULL;
+    handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (handle && tp_set_durability(handle, TP_DURABILITY_ASYNC) != 0 &&
+        tp_set(handle, "system.audio.volume", "64") == 0) {
+        printf("PASS: Journal handle rejects async level\n");
+    } else {
+        printf("FAIL: Journal handle rejects async level\n");
+    }
+    tp_close(handle);
+    unlink(TEST_JSON_FILE ".journal");
+}
+
+// 测试紧凑格式输出
+void test_compact_output() {
+    printf("\n=== Test Compact Output ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .flags = TP_OPEN_COMPACT };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open with compact output\n");
+        return;
+    }
+
+    // 多次写入复用同一缓冲区，输出不含缩进和换行
+    int ok = 1;
+    char buf[32];
+    for (int i = 0; i < 10; i++) {
+        snprintf(buf, sizeof(buf), "%d", i);
+        ok &= tp_set(handle, "system.audio.volume", buf) == 0;
+    }
+    FILE *fp = fopen(TEST_JSON_FILE, "r");
+    char content[512] = { 0 };
+    if (fp) {
+        fread(content, 1, sizeof(content) - 1, fp);
+        fclose(fp);
+    }
+    if (ok && !strchr(content, '\n') && !strchr(content, '\t') && strstr(content, "\"volume\":\"9\"")) {
+        printf("PASS: File written without formatting\n");
+    } else {
+        printf("FAIL: File written without formatting\n");
+    }
+    tp_close(handle);
+
+    char *value = read_persisted("system.audio.volume");
+    if (value && strcmp(value, "9") == 0) {
+        printf("PASS: Compact file reads back\n");
+    } else {
+        printf("FAIL: Compact file reads back\n");
+    }
+    free(value);
+}
+
+// 收集子树遍历结果
+typedef struct {
+    int count;
+    int stop_after;
+    char keys[256];
+} subtree_record_t;
+
+static int collect_leaf(tp_handle_t *h, const char *key, const char *value, void *ctx) {
+    (void)h;
+    subtree_record_t *r = (subtree_record_t *)ctx;
+    size_t len = strlen(r->keys);
+    snprintf(r->keys + len, sizeof(r->keys) - len, "%s=%s;", key, value);
+    return ++r->count == r->stop_after;
+}
+
+// 测试按前缀批量读取
+void test_subtree() {
+    printf("\n=== Test Subtree Reads ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        printf("FAIL: Open for subtree reads\n");
+        return;
+    }
+
+    // 前缀下的所有叶子按文件顺序访问，键写入调用方缓冲区
+    char key[64];
+    subtree_record_t r = { 0 };
+    int n = tp_get_subtree(handle, "System.Audio", key, sizeof(key), collect_leaf, &r);
+    if (n == 2 && strcmp(r.keys, "system.audio.volume=50;system.audio.mute=false;") == 0) {
+        printf("PASS: Visit leaves under a prefix\n");
+    } else {
+        printf("FAIL: Visit leaves under a prefix (%d, %s)\n", n, r.keys);
+    }
+
+    // 整棵树、单个叶子、提前停止
+    memset(&r, 0, sizeof(r));
+    int all = tp_get_subtree(handle, NULL, key, sizeof(key), collect_leaf, &r);
+    memset(&r, 0, sizeof(r));
+    int leaf = tp_get_subtree(handle, "system.display.brightness", key, sizeof(key), collect_leaf, &r);
+    memset(&r, 0, sizeof(r));
+    r.stop_after = 1;
+    int stopped = tp_get_subtree(handle, "", key, sizeof(key), collect_leaf, &r);
+    if (all == 3 && leaf == 1 && stopped == 1) {
+        printf("PASS: Whole tree, single leaf and early stop\n");
+    } else {
+        printf("FAIL: Whole tree, single leaf and early stop\n");
+    }
+
+    // 前缀不存在或缓冲区不足
+    memset(&r, 0, sizeof(r));
+    if (tp_get_subtree(handle, "system.video", key, sizeof(key), collect_leaf, &r) == -1 &&
+        tp_get_subtree(handle, "system", key, 12, collect_leaf, &r) == -1) {
+        printf("PASS: Missing prefix and short key buffer rejected\n");
+    } else {
+        printf("FAIL: Missing prefix and short key buffer rejected\n");
+    }
+    tp_close(handle);
+
+    // 编译镜像按键顺序访问
+    tp_compile(TEST_JSON_FILE, "test.tpb");
+    handle = tp_open("test.tpb");
+    memset(&r, 0, sizeof(r));
+    n = handle ? tp_get_subtree(handle, "system.audio", key, sizeof(key), collect_leaf, &r) : -1;
+    if (n == 2 && strcmp(r.keys, "system.audio.mute=false;system.audio.volume=50;") == 0) {
+        printf("PASS: Visit leaves of a compiled image\n");
+    } else {
+        printf("FAIL: Visit leaves of a compiled image (%d, %s)\n", n, r.keys);
+    }
+    tp_close(handle);
+    unlink("test.tpb");
+}
+
+// 测试挂载多个文件
+void test_mount() {
+    printf("\n=== Test Mounted Files ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    FILE *fp = fopen("test_audio.json", "w");
+    fputs("{\"volume\": \"10\", \"mute\": \"true\"}", fp);
+    fclose(fp);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle || tp_mount(handle, "system.audio", "test_audio.json", NULL) != 0) {
+        printf("FAIL: Mount a file\n");
+        tp_close(handle);
+        return;
+    }
+
+    // 前缀下的键由挂载的文件提供，写入只改该文件
+    char *value = tp_get(handle, "system.audio.volume");
+    int ok = value && strcmp(value, "10") == 0;
+    free(value);
+    ok = ok && tp_set(handle, "system.audio.volume", "11") == 0;
+    tp_handle_t *shard = tp_open("test_audio.json");
+    char *shard_value = shard ? tp_get(shard, "volume") : NULL;
+    char *own = read_persisted("system.audio.volume");
+    int mute = 0;
+    if (ok && shard_value && strcmp(shard_value, "11") == 0 && own && strcmp(own, "50") == 0 &&
+        tp_get_bool(handle, "SYSTEM.AUDIO.MUTE", &mute) == 0 && mute == 1) {
+        printf("PASS: Mounted keys served by their own file\n");
+    } else {
+        printf("FAIL: Mounted keys served by their own file\n");
+    }
+    free(shard_value);
+    free(own);
+    tp_close(shard);
+
+    // 键句柄和事务按文件路由，事务不能跨文件
+    tp_key_t *k = tp_key_resolve(handle, "system.audio.volume");
+    ok = k && tp_set_h(handle, k, "12") == 0;
+    value = k ? tp_get_h(handle, k) : NULL;
+    tp_key_free(k);
+    tp_txn_t *t = tp_txn_begin(handle);
+    int cross = tp_txn_set(t, "system.audio.volume", "13") == 0 &&
+                tp_txn_set(t, "system.display.brightness", "1") != 0;
+    tp_txn_commit(t);
+    char *after = tp_get(handle, "system.audio.volume");
+    if (ok && value && strcmp(value, "12") == 0 && cross && after && strcmp(after, "13") == 0) {
+        printf("PASS: Key handles and transactions routed to the mount\n");
+    } else {
+        printf("FAIL: Key handles and transactions routed to the mount\n");
+    }
+    free(value);
+    free(after);
+
+    // 子树遍历包含挂载文件，隐藏自身文件中被覆盖的键
+    char key[64];
+    subtree_record_t r = { 0 };
+    int n = tp_get_subtree(handle, "system", key, sizeof(key), collect_leaf, &r);
+    if (n == 3 && strcmp(r.keys, "system.display.brightness=75;system.audio.volume=13;system.audio.mute=true;") == 0) {
+        printf("PASS: Subtree spans mounted files\n");
+    } else {
+        printf("FAIL: Subtree spans mounted files (%d, %s)\n", n, r.keys);
+    }
+
+    // 借用的值在读保护内来自挂载文件，延迟加载的挂载也可借用
+    fp = fopen("test_net.json", "w");
+    fputs("{\"wifi\": {\"ssid\": \"home\"}}", fp);
+    fclose(fp);
+    tp_options_t lazy = { .flags = TP_OPEN_LAZY };
+    ok = tp_mount(handle, "net", "test_net.json", &lazy) == 0;
+    tp_read_lock(handle);
+    const char *ref = tp_get_ref(handle, "system.audio.volume");
+    const char *ssid = tp_get_ref(handle, "net.wifi.ssid");
+    ok = ok && ref && strcmp(ref, "13") == 0 && ssid && strcmp(ssid, "home") == 0;
+    tp_read_unlock(handle);
+    if (ok) {
+        printf("PASS: Borrowed values from mounted files\n");
+    } else {
+        printf("FAIL: Borrowed values from mounted files\n");
+    }
+
+    // 重叠的挂载前缀被拒绝
+    if (tp_mount(handle, "system.audio.eq", "test_audio.json", NULL) != 0 &&
+        tp_mount(handle, "system", "test_audio.json", NULL) != 0) {
+        printf("PASS: Overlapping mount rejected\n");
+    } else {
+        printf("FAIL: Overlapping mount rejected\n");
+    }
+    tp_close(handle);
+    unlink("test_audio.json");
+    unlink("test_net.json");
+}
+
+// 与 tools/tp_gen 生成的结构体相同的形式
+typedef struct {
+    struct {
+        struct {
+            int volume;
+            int mute;
+        } audio;
+        struct {
+            char brightness[8];
+        } display;
+    } system;
+} bind_params_t;
+
+static const tp_bind_desc_t bind_desc[] = {
+    { "system.audio.volume", TP_BIND_INT, offsetof(bind_params_t, system.audio.volume), sizeof(int) },
+    { "system.audio.mute", TP_BIND_BOOL, offsetof(bind_params_t, system.audio.mute), sizeof(int) },
+    { "system.display.brightness", TP_BIND_STRING, offsetof(bind_params_t, system.display.brightness), 8 },
+};
+
+// 测试结构体绑定
+void test_bind() {
+    printf("\n=== Test Struct Binding ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        printf("FAIL: Open for binding\n");
+        return;
+    }
+
+    // 绑定时填充所有字段
+    bind_params_t params;
+    memset(&params, 0, sizeof(params));
+    tp_bind_t *b = tp_bind(handle, bind_desc, 3, &params);
+    if (b && params.system.audio.volume == 50 && params.system.audio.mute == 0 &&
+        strcmp(params.system.display.brightness, "75") == 0) {
+        printf("PASS: Bound struct filled\n");
+    } else {
+        printf("FAIL: Bound struct filled\n");
+    }
+
+    // 修改参数后字段随之更新，超长字符串被截断
+    tp_set(handle, "system.audio.volume", "33");
+    tp_set_bool(handle, "system.audio.mute", 1);
+    tp_set(handle, "system.display.brightness", "123456789");
+    if (params.system.audio.volume == 33 && params.system.audio.mute == 1 &&
+        strcmp(params.system.display.brightness, "1234567") == 0) {
+        printf("PASS: Bound struct follows updates\n");
+    } else {
+        printf("FAIL: Bound struct follows updates\n");
+    }
+    tp_unbind(b);
+
+    // 解除绑定后不再更新；缺失的键使绑定失败
+    tp_set(handle, "system.audio.volume", "34");
+    tp_bind_desc_t missing = { "system.audio.bass", TP_BIND_INT, 0, sizeof(int) };
+    int dummy = 0;
+    if (params.system.audio.volume == 33 && !tp_bind(handle, &missing, 1, &dummy)) {
+        printf("PASS: Unbind and missing keys\n");
+    } else {
+        printf("FAIL: Unbind and missing keys\n");
+    }
+    tp_close(handle);
+}
+
+// 测试多进程共享内存存储
+void test_stats() {
+    printf("\n=== Test Stats ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        printf("FAIL: Open for stats\n");
+        return;
+    }
+
+    tp_stats_t st;
+    memset(&st, 0xff, sizeof(st));
+    if (tp_stats(handle, &st) != 0) {
+        // 未定义 TP_ENABLE_STATS 时接口失败并清零输出
+        if (st.gets == 0 && st.lookup.count == 0) {
+            printf("PASS: Stats compiled out\n");
+        } else {
+            printf("FAIL: Stats compiled out\n");
+        }
+        tp_close(handle);
+        return;
+    }
+
+    // 三次读取、一次未命中、一次写入
+    char buf[32];
+    char *value = tp_get(handle, "system.audio.volume");
+    free(value);
+    tp_get_into(handle, "system.audio.volume", buf, sizeof(buf));
+    int volume = 0;
+    tp_get_int(handle, "system.audio.volume", &volume);
+    value = tp_get(handle, "system.audio.missing");
+    free(value);
+    tp_set(handle, "system.audio.volume", "42");
+
+    tp_stats(handle, &st);
+    uint64_t total = 0;
+    for (int i = 0; i < TP_STATS_BUCKETS; i++) {
+        total += st.lookup.buckets[i];
+    }
+    if (st.gets == 4 && st.misses == 1 && st.sets == 1 && total == st.lookup.count && st.lookup.count >= 4) {
+        printf("PASS: Get, set and miss counters\n");
+    } else {
+        printf("FAIL: Get, set and miss counters\n");
+    }
+    if (st.persists == 1 && st.bytes_written > 0 && st.serialize.count == 1 && st.write.count == 1 &&
+        st.rename.count == 1 && st.lock_wait.count >= 6) {
+        printf("PASS: Persistence counters and histograms\n");
+    } else {
+        printf("FAIL: Persistence counters and histograms\n");
+    }
+    tp_close(handle);
+}
+
+void test_miss_cache() {
+    printf("\n=== Test Miss Cache ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_handle_t *handle = tp_open(TEST_JSON_FILE);
+    if (!handle) {
+        printf("FAIL: Open for miss cache\n");
+        return;
+    }
+
+    // 存在的键命中，不存在的键（包括大小写不同的存在键）按规则返回
+    if (tp_has(handle, "system.audio.volume") == 1 && tp_has(handle, "SYSTEM.Audio.Mute") == 1 &&
+        tp_has(handle, "system.audio.missing") == 0 && tp_has(handle, "system.audio") == 0) {
+        printf("PASS: tp_has reports existing and missing keys\n");
+    } else {
+        printf("FAIL: tp_has reports existing and missing keys\n");
+    }
+    int misses = 0;
+    for (int i = 0; i < 1000; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "optional.key%d", i);
+        misses += !tp_has(handle, key);
+    }
+    if (misses == 1000) {
+        printf("PASS: Absent keys are rejected\n");
+    } else {
+        printf("FAIL: Absent keys are rejected\n");
+    }
+
+    // 可选读取：缺失时返回默认值的副本
+    char *value = tp_get_opt(handle, "system.audio.volume", "0");
+    char *fallback = tp_get_opt(handle, "system.audio.missing", "7");
+    char *none = tp_get_opt(handle, "system.audio.missing", NULL);
+    if (value && strcmp(value, "50") == 0 && fallback && strcmp(fallback, "7") == 0 && !none) {
+        printf("PASS: tp_get_opt returns value or default\n");
+    } else {
+        printf("FAIL: tp_get_opt returns value or default\n");
+    }
+    free(value);
+    free(fallback);
+
+    // 重新加载增加了新键，过滤器随之重建
+    FILE *fp = fopen(TEST_JSON_FILE ".new", "w");
+    fputs("{\"system\": {\"audio\": {\"volume\": \"50\", \"mute\": \"false\", \"balance\": \"0\"}, "
+          "\"display\": {\"brightness\": \"75\"}}}", fp);
+    fclose(fp);
+    rename(TEST_JSON_FILE ".new", TEST_JSON_FILE);
+    tp_reload(handle);
+    value = tp_get(handle, "system.audio.balance");
+    if (tp_has(handle, "system.audio.balance") && value && strcmp(value, "0") == 0) {
+        printf("PASS: Keys added by reload are found\n");
+    } else {
+        printf("FAIL: Keys added by reload are found\n");
+    }
+    free(value);
+
+    // 键集合反复变化时过滤器原地更新，新键可见、旧键被拒绝
+    int ok = 1;
+    for (int i = 0; i < 50; i++) {
+        fp = fopen(TEST_JSON_FILE ".new", "w");
+        fprintf(fp, "{\"system\": {\"audio\": {\"volume\": \"50\", \"extra%d\": \"%d\"}}}", i, i);
+        fclose(fp);
+        rename(TEST_JSON_FILE ".new", TEST_JSON_FILE);
+        char key[64], prev[64];
+        snprintf(key, sizeof(key), "system.audio.extra%d", i);
+        snprintf(prev, sizeof(prev), "system.audio.extra%d", i - 1);
+        ok &= tp_reload(handle) == 1 && tp_has(handle, key) == 1 && tp_has(handle, prev) == 0;
+    }
+    if (ok) {
+        printf("PASS: Filter follows repeated key set changes\n");
+    } else {
+        printf("FAIL: Filter follows repeated key set changes\n");
+    }
+    tp_close(handle);
+}
+
+// 读线程：缓存命中后写入的新值必须立即可见
+typedef struct {
+    tp_handle_t *handle;
+    int stop;
+    int bad;
+    int last;
+} cache_reader_t;
+
+static void *cache_reader(void *arg) {
+    cache_reader_t *r = (cache_reader_t *)arg;
+    int prev = 0;
+    while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        int v = -1;
+        if (tp_get_int(r->handle, "system.audio.volume", &v) != 0 || v < prev) {
+            r->bad = 1;
+        }
+        prev = v;
+    }
+    tp_get_int(r->handle, "system.audio.volume", &r->last);
+    return NULL;
+}
+
+void test_thread_cache() {
+    printf("\n=== Test Thread Cache ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    tp_options_t opts = { .flags = TP_OPEN_THREAD_CACHE, .durability = TP_DURABILITY_NONE };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open with thread cache\n");
+        return;
+    }
+
+    // 重复读取命中缓存，写入后缓存失效
+    char buf[32];
+    int ok = tp_get_into(handle, "system.audio.volume", buf, sizeof(buf)) == 2 && strcmp(buf, "50") == 0;
+    ok &= tp_get_into(handle, "SYSTEM.audio.VOLUME", buf, sizeof(buf)) == 2 && strcmp(buf, "50") == 0;
+    tp_set(handle, "system.audio.volume", "60");
+    char *value = tp_get(handle, "system.audio.volume");
+    int volume = 0;
+    ok &= value && strcmp(value, "60") == 0 && tp_get_int(handle, "system.audio.volume", &volume) == 0 &&
+          volume == 60;
+    free(value);
+    if (ok) {
+        printf("PASS: Cached reads see tp_set\n");
+    } else {
+        printf("FAIL: Cached reads see tp_set\n");
+    }
+
+    // 多个读线程与写线程并发，值单调递增且最终一致
+    cache_reader_t readers[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        readers[i] = (cache_reader_t){ .handle = handle };
+        pthread_create(&threads[i], NULL, cache_reader, &readers[i]);
+    }
+    for (int i = 61; i <= 300; i++) {
+        tp_set_int(handle, "system.audio.volume", i);
+    }
+    ok = 1;
+    for (int i = 0; i < 4; i++) {
+        __atomic_store_n(&readers[i].stop, 1, __ATOMIC_RELEASE);
+        pthread_join(threads[i], NULL);
+        ok &= !readers[i].bad && readers[i].last == 300;
+    }
+    if (ok) {
+        printf("PASS: Concurrent readers never see stale values\n");
+    } else {
+        printf("FAIL: Concurrent readers never see stale values\n");
+    }
+    tp_close(handle);
+}
+
+// 生成含大对象的文件，大对象超过逐层解析的阈值
+static void create_lazy_json(const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        return;
+    }
+    fputs("{\"system\": {\"audio\": {\"volume\": \"50\", \"mute\": \"false\"}}, \"calib\": {", fp);
+    for (int i = 0; i < 300; i++) {
+        fprintf(fp, "%s\"t%d\": {\"gain\": \"%d\", \"offset\": %d}", i ? ", " : "", i, i * 2, i);
+    }
+    fputs("}, \"esc\\\"name\": {\"x\": \"1\"}}", fp);
+    fclose(fp);
+}
+
+typedef struct {
+    tp_handle_t *handle;
+    int first;
+    int ok;
+} lazy_reader_t;
+
+static void *lazy_reader(void *arg) {
+    lazy_reader_t *r = (lazy_reader_t *)arg;
+    r->ok = 1;
+    for (int i = r->first; i < 300; i += 4) {
+        char key[64];
+        int offset = -1;
+        snprintf(key, sizeof(key), "calib.t%d.offset", i);
+        r->ok &= tp_get_int(r->handle, key, &offset) == 0 && offset == i;
+    }
+    return NULL;
+}
+
+void test_lazy() {
+    printf("\n=== Test Lazy Parse ===\n");
+
+    create_lazy_json(TEST_JSON_FILE);
+    tp_options_t opts = { .flags = TP_OPEN_LAZY };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open lazily\n");
+        return;
+    }
+
+    // 按需解析：大对象内部的键、转义的成员名和缺失的键
+    char *value = tp_get(handle, "calib.t150.gain");
+    char *esc = tp_get(handle, "esc\"name.x");
+    if (value && strcmp(value, "300") == 0 && esc && strcmp(esc, "1") == 0 &&
+        tp_has(handle, "calib.t150.missing") == 0 && tp_has(handle, "nothing") == 0) {
+        printf("PASS: Lazy reads parse on demand\n");
+    } else {
+        printf("FAIL: Lazy reads parse on demand\n");
+    }
+    free(value);
+    free(esc);
+
+    // 缺失的键被记住，新嫁接的键直接插入索引，不重建索引
+    unsigned long gen = handle->gen;
+    int absent = 0;
+    for (int i = 0; i < 100; i++) {
+        absent += tp_has(handle, "calib.t150.missing") == 0 && tp_has(handle, "system.audio.eq") == 0;
+    }
+    value = tp_get(handle, "calib.t151.gain");
+    if (absent == 100 && value && strcmp(value, "302") == 0 && gen == handle->gen) {
+        printf("PASS: Lazy misses and grafts keep the index\n");
+    } else {
+        printf("FAIL: Lazy misses and grafts keep the index\n");
+    }
+    free(value);
+
+    // 多线程同时首次访问不同子树
+    lazy_reader_t readers[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        readers[i] = (lazy_reader_t){ .handle = handle, .first = i };
+        pthread_create(&threads[i], NULL, lazy_reader, &readers[i]);
+    }
+    int ok = 1;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        ok &= readers[i].ok;
+    }
+    if (ok) {
+        printf("PASS: Concurrent first reads\n");
+    } else {
+        printf("FAIL: Concurrent first reads\n");
+    }
+
+    // 首次写入解析整个文件，写出的文件完整
+    tp_key_t *k = tp_key_resolve(handle, "system.audio.volume");
+    ok = k && tp_set(handle, "system.audio.volume", "70") == 0;
+    value = k ? tp_get_h(handle, k) : NULL;
+    ok &= value && strcmp(value, "70") == 0;
+    free(value);
+    tp_key_free(k);
+    tp_close(handle);
+    value = read_persisted("calib.t299.gain");
+    char *volume = read_persisted("system.audio.volume");
+    if (ok && value && strcmp(value, "598") == 0 && volume && strcmp(volume, "70") == 0) {
+        printf("PASS: First write keeps the whole file\n");
+    } else {
+        printf("FAIL: First write keeps the whole file\n");
+    }
+    free(value);
+    free(volume);
+
+    // 结构损坏的文件打开失败
+    FILE *fp = fopen(TEST_JSON_FILE, "w");
+    fputs("{\"system\": {\"audio\": {\"volume\": \"50\"}", fp);
+    fclose(fp);
+    handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("PASS: Malformed file rejected\n");
+    } else {
+        printf("FAIL: Malformed file rejected\n");
+        tp_close(handle);
+    }
+}
+
+void test_parser() {
+    printf("\n=== Test Parser Backends ===\n");
+
+    // 各种值类型、嵌套、超过16字节的转义字符串，以及交给cJSON处理的代理对
+    FILE *fp = fopen(TEST_JSON_FILE, "w");
+    if (!fp) {
+        return;
+    }
+    fputs("{\n\t\"system\": {\"audio\": {\"volume\": \"50\", \"mute\": false, \"eq\": [1, -1.5e3, 0, [], {}]}},\n"
+          "  \"text\": \"a fairly long value with \\\"quotes\\\", a back\\\\slash, a\\/slash\\nand a tab\\t\\u0041\",\n"
+          "  \"esc\\\"key\": null, \"big\": 123456789012, \"on\": true, \"empty\": \"\",\n"
+          "  \"emoji\": \"\\ud83d\\ude00\", \"list\": [\"x\", {\"y\": [true, false, null]}]\n}\n", fp);
+    fclose(fp);
+
+    tp_options_t opts = { .parser = TP_PARSER_CJSON };
+    tp_handle_t *slow = tp_open_ex(TEST_JSON_FILE, &opts);
+    tp_handle_t *fast = tp_open(TEST_JSON_FILE);
+    opts = (tp_options_t){ .flags = TP_OPEN_ARENA };
+    tp_handle_t *arena = tp_open_ex(TEST_JSON_FILE, &opts);
+    char *a = slow ? cJSON_PrintUnformatted(slow->root) : NULL;
+    char *b = fast ? cJSON_PrintUnformatted(fast->root) : NULL;
+    char *c = arena ? cJSON_PrintUnformatted(arena->root) : NULL;
+    if (a && b && c && strcmp(a, b) == 0 && strcmp(a, c) == 0 && cJSON_Compare(slow->root, fast->root, 1)) {
+        printf("PASS: Fast parser builds the same tree as cJSON\n");
+    } else {
+        printf("FAIL: Fast parser builds the same tree as cJSON\n");
+    }
+    cJSON_free(a);
+    cJSON_free(b);
+    cJSON_free(c);
+
+    char *text = fast ? tp_get(fast, "text") : NULL;
+    if (text && strcmp(text, "a fairly long value with \"quotes\", a back\\slash, a/slash\nand a tab\tA") == 0) {
+        printf("PASS: Escapes decoded\n");
+    } else {
+        printf("FAIL: Escapes decoded\n");
+    }
+    free(text);
+    if (slow) {
+        tp_close(slow);
+    }
+    if (fast) {
+        tp_close(fast);
+    }
+    if (arena) {
+        tp_close(arena);
+    }
+
+    // 损坏的文件两种解析器都拒绝
+    const char *bad[] = { "{\"a\": \"1\",}", "{\"a\": \"1\"", "{\"a\": +1}", "[1 2]", "{\"a\" \"1\"}" };
+    int ok = 1;
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        fp = fopen(TEST_JSON_FILE, "w");
+        fputs(bad[i], fp);
+        fclose(fp);
+        opts = (tp_options_t){ .parser = TP_PARSER_CJSON };
+        tp_handle_t *h1 = tp_open_ex(TEST_JSON_FILE, &opts);
+        tp_handle_t *h2 = tp_open(TEST_JSON_FILE);
+        ok &= !h1 && !h2;
+        if (h1) {
+            tp_close(h1);
+        }
+        if (h2) {
+            tp_close(h2);
+        }
+    }
+    if (ok) {
+        printf("PASS: Malformed files rejected by both parsers\n");
+    } else {
+        printf("FAIL: Malformed files rejected by both parsers\n");
+    }
+}
+
+void test_shared_store() {
+    printf("\n=== Test Shared Store ===\n");
+
+    create_test_json(TEST_JSON_FILE);
+    shm_unlink("/tinyparam.test");
+    tp_options_t opts = { .flags = TP_OPEN_SHARED, .shm_name = "/tinyparam.test" };
+    tp_handle_t *handle = tp_open_ex(TEST_JSON_FILE, &opts);
+    if (!handle) {
+        printf("FAIL: Open shared store\n");
+        return;
+    }
+
+    // 共享内存段的权限与参数文件相同
+    chmod(TEST_JSON_FILE, 0600);
+    shm_unlink("/tinyparam.private");
+    tp_options_t priv = { .flags = TP_OPEN_SHARED, .shm_name = "/tinyparam.private" };
+    tp_handle_t *other = tp_open_ex(TEST_JSON_FILE, &priv);
+    int fd = shm_open("/tinyparam.private", O_RDONLY, 0);
+    struct stat st;
+    if (other && fd >= 0 && fstat(fd, &st) == 0 && (st.st_mode & 0777) == 0600) {
+        printf("PASS: Shared store is as private as the file\n");
+    } else {
+        printf("FAIL: Shared store is as private as the file\n");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    tp_close(other);
+    shm_unlink("/tinyparam.private");
+    chmod(TEST_JSON_FILE, 0644);
+
+    // 创建进程中途退出留下的未完成段会被重建，而不是等待超时
+    fd = shm_open("/tinyparam.private", O_RDWR | O_CREAT, 0600);
+    if (fd >= 0) {
+        ftruncate(fd, 4096);
+        close(fd);
+    }
+    other = tp_open_ex(TEST_JSON_FILE, &priv);
+    char *rebuilt = other ? tp_get(other, "system.audio.volume") : NULL;
+    if (rebuilt && strcmp(rebuilt, "50") == 0) {
+        printf("PASS: Unfinished shared store rebuilt\n");
+    } else {
+        printf("FAIL: Unfinished shared store rebuilt\n");
+    }
+    free(rebuilt);
+
+    // 段中没有的键不会悄悄变成进程私有，而是打开失败
+    FILE *fp = fopen("test_extra.json", "w");
+    fputs("{\"system\": {\"audio\": {\"volume\": \"50\", \"mute\": \"false\", \"eq\": \"flat\"}}}", fp);
+    fclose(fp);
+    tp_handle_t *extra = tp_open_ex("test_extra.json", &priv);
+    if (!extra) {
+        printf("PASS: Key missing from the shared store rejected\n");
+    } else {
+        printf("FAIL: Key missing from the shared store rejected\n");
+        tp_close(extra);
+    }
+    unlink("test_extra.json");
+    tp_close(other);
+    shm_unlink("/tinyparam.private");
+
+    // 子进程修改参数，父进程无需重新打开即可看到
+    pid_t pid = fork();
+    if (pid == 0) {
+        tp_handle_t *child = tp_open_ex(TEST_JSON_FILE, &opts);
+        int ret = child && tp_set(child, "system.audio.volume", "77") == 0 ? 0 : 1;
+        tp_close(child);
+        _exit(ret);
+    }
+    int status = -1;
+    waitpid(pid, &status, 0);
+
+    char *value = tp_get(handle, "system.audio.volume");
+    int volume = 0;
+    if (status == 0 && value && strcmp(value, "77") == 0 &&
+        tp_get_int(handle, "system.audio.volume", &volume) == 0 && volume == 77) {
+        printf("PASS: Set from another process is visible\n");
+    } else {
+        printf("FAIL: Set from another process is visible\n");
+    }
+    free(value);
+
+    // 本进程的修改需包含子进程的修改一起写入文件
+    tp_set(handle, "system.display.brightness", "80");
+    tp_close(handle);
+    handle = tp_open(TEST_JSON_FILE);
+    char *volume_str = handle ? tp_get(handle, "system.audio.volume") : NULL;
+    char *brightness = handle ? tp_get(handle, "system.display.brightness") : NULL;
+    if (volume_str && brightness && strcmp(volume_str, "77") == 0 && strcmp(brightness, "80") == 0) {
+        printf("PASS: File holds writes of every process\n");
+    } else {
+        printf("FAIL: File holds writes of every process\n");
+    }
+    free(volume_str);
+    free(brightness);
+    tp_close(handle);
+    shm_unlink("/tinyparam.test");
+}
+
 // 线程任务：并发读取
 void *thread_read(void *arg) {
     tp_handle_t *handle = (tp_handle_t *)arg;
@@ -213,6 +1990,31 @@ int main() {
     // 运行所有测试用例
     test_basic_operations();
     test_error_cases();
+    test_key_handles();
+    test_snapshots();
+    test_write_behind();
+    test_async_set();
+    test_transactions();
+    test_history();
+    test_journal();
+    test_zero_copy_reads();
+    test_typed_access();
+    test_compiled_image();
+    test_shared_store();
+    test_watch();
+    test_reload();
+    test_arena();
+    test_inplace();
+    test_durability();
+    test_compact_output();
+    test_subtree();
+    test_mount();
+    test_bind();
+    test_stats();
+    test_miss_cache();
+    test_thread_cache();
+    test_lazy();
+    test_parser();
     test_thread_safety();
 
     // 清理测试文件
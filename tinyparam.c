@@ -1,374 +1,7374 @@
+// For pthread_rwlockattr_setkind_np()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "tinyparam.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
 #include "aml_log.h" // Assume logging functions are defined here
 
+#define TP_FLUSH_INTERVAL_MS 1000 // Default write-behind interval
+#define TP_PRINT_MIN 4096         // Initial size of the serialization buffer
+
+static int tp_persist(tp_handle_t *h);
+static void tp_async_fini(tp_handle_t *h);
+static int tp_history_init(tp_handle_t *h);
+static void tp_inplace_clear(tp_handle_t *h);
+static int tp_journal_open(tp_handle_t *h, size_t limit);
+
+typedef struct tp_entry {
+    char *path;         // Full dotted path of the leaf
+    uint32_t hash;      // Case-insensitive hash of path
+    cJSON *node;        // Leaf node in the tree
+    double num;         // Cached numeric value, valid with TP_VAL_NUM
+    int bval;           // Cached boolean value, valid with TP_VAL_BOOL
+    int vflags;         // TP_VAL_* flags describing the cached values
+    uint32_t shm_slot;  // Shared-memory slot plus one, 0 when the key is not shared
+    uint32_t shm_seq;   // Slot sequence the node was last synced to
+    uint32_t ord;       // Position among all leaves in document order
+    uint32_t slot_len;  // Bytes of the value and its trailing blanks in the file, 0 if unknown
+    size_t slot_off;    // File offset of the value, valid with slot_len
+} tp_entry_t;
+
+#define TP_VAL_NUM  (1 << 0) // Value reads as a number
+#define TP_VAL_BOOL (1 << 1) // Value reads as a boolean
+
+struct tp_index {
+    tp_entry_t *slots;  // Open-addressing table, NULL path marks an empty slot
+    size_t mask;        // Table size minus one, size is a power of two
+    size_t count;       // Number of occupied slots
+    size_t leaves;      // Leaves visited in document order, shadowed duplicates included
+};
+
+#ifdef TP_ENABLE_STATS
 /**
- * @brief Open and parse a JSON file
+ * @brief Read the monotonic clock in nanoseconds
+ */
+static uint64_t tp_stat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Add the time elapsed since start to a histogram
+ */
+static void tp_stat_record(tp_histogram_t *hist, uint64_t start)
+{
+    uint64_t ns = tp_stat_now() - start;
+    unsigned int b = ns ? 64 - (unsigned int)__builtin_clzll(ns) : 0;
+    uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[b < TP_STATS_BUCKETS ? b : TP_STATS_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED)) {
+    }
+}
+
+// Count into h->stats, allocated by tp_open_ex()
+#define TP_STAT_ADD(h, field, n) __atomic_fetch_add(&(h)->stats->field, (n), __ATOMIC_RELAXED)
+// Run stmt and add its duration to the histogram of h->stats
+#define TP_STAT_TIMED(h, hist, stmt) \
+    do { \
+        uint64_t tp_start_ = tp_stat_now(); \
+        stmt; \
+        tp_stat_record(&(h)->stats->hist, tp_start_); \
+    } while (0)
+// Time a span whose end is not in the same block as its start
+#define TP_STAT_START(t) uint64_t t = tp_stat_now()
+#define TP_STAT_STOP(h, hist, t) tp_stat_record(&(h)->stats->hist, t)
+#else
+#define TP_STAT_ADD(h, field, n) ((void)0)
+#define TP_STAT_TIMED(h, hist, stmt) \
+    do { \
+        stmt; \
+    } while (0)
+#define TP_STAT_START(t) ((void)0)
+#define TP_STAT_STOP(h, hist, t) ((void)0)
+#endif
+
+/**
+ * @brief Hash a dotted path, ignoring case like cJSON_GetObjectItem does
+ */
+static uint32_t tp_hash(const char *s)
+{
+    uint32_t hash = 2166136261u;
+    while (*s) {
+        hash ^= (uint32_t)tolower((unsigned char)*s++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void tp_put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void tp_put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint16_t tp_get_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t tp_get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief Parse a whole string as a number
  *
- * @param file Path to the JSON file
- * @return tp_handle_t* Handle for the opened file, or NULL on failure
+ * @return int 1 if s is a plain decimal number, 0 otherwise
  */
-tp_handle_t *tp_open(char *file)
+static int tp_parse_num(const char *s, double *out)
 {
-    tp_handle_t *handle = NULL;
-    cJSON *root = NULL;
-    char *buf = NULL;
-    FILE *fp = NULL;
+    if (!s || !(isdigit((unsigned char)*s) || *s == '-' || *s == '+' || *s == '.')) {
+        return 0;
+    }
+    char *end = NULL;
+    errno = 0;
+    double d = strtod(s, &end);
+    if (end == s || *end != '\0' || errno == ERANGE) {
+        return 0;
+    }
+    *out = d;
+    return 1;
+}
 
-    // Check if file exists
-    if (access(file, F_OK) != 0) {
-        AML_LOGE("File %s does not exist\n", file);
+/**
+ * @brief Parse "true" or "false", ignoring case
+ *
+ * @return int 1 if s is a boolean word, 0 otherwise
+ */
+static int tp_parse_bool(const char *s, int *out)
+{
+    if (s && strcasecmp(s, "true") == 0) {
+        *out = 1;
+        return 1;
+    }
+    if (s && strcasecmp(s, "false") == 0) {
+        *out = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Refresh the native values cached for a leaf
+ *
+ * Numbers and booleans read as each other, and string values like "50" or
+ * "false" are parsed once here so typed reads never convert strings.
+ */
+static void tp_entry_cache(tp_entry_t *e)
+{
+    cJSON *n = e->node;
+
+    e->vflags = 0;
+    switch (n->type & 0xFF) {
+    case cJSON_Number:
+        e->num = n->valuedouble;
+        e->bval = e->num != 0;
+        e->vflags = TP_VAL_NUM | TP_VAL_BOOL;
+        break;
+    case cJSON_True:
+    case cJSON_False:
+        e->bval = (n->type & 0xFF) == cJSON_True;
+        e->num = e->bval;
+        e->vflags = TP_VAL_NUM | TP_VAL_BOOL;
+        break;
+    case cJSON_String:
+        if (tp_parse_num(n->valuestring, &e->num)) {
+            e->bval = e->num != 0;
+            e->vflags = TP_VAL_NUM | TP_VAL_BOOL;
+        } else if (tp_parse_bool(n->valuestring, &e->bval)) {
+            e->num = e->bval;
+            e->vflags = TP_VAL_NUM | TP_VAL_BOOL;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Find the slot holding a path, or the empty slot where it belongs
+ */
+static tp_entry_t *tp_index_slot(struct tp_index *idx, const char *path, uint32_t hash)
+{
+    size_t i = hash & idx->mask;
+    while (idx->slots[i].path) {
+        if (idx->slots[i].hash == hash && strcasecmp(idx->slots[i].path, path) == 0) {
+            break;
+        }
+        i = (i + 1) & idx->mask;
+    }
+    return &idx->slots[i];
+}
+
+/**
+ * @brief Count leaf nodes below an object
+ */
+static size_t tp_count_leaves(cJSON *obj)
+{
+    size_t n = 0;
+    for (cJSON *c = obj->child; c; c = c->next) {
+        n += (c->type == cJSON_Object) ? tp_count_leaves(c) : 1;
+    }
+    return n;
+}
+
+/**
+ * @brief Insert one leaf into the index, the index must have a free slot
+ *
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int tp_index_leaf(struct tp_index *idx, cJSON *c, const char *path)
+{
+    // First match wins, as with cJSON_GetObjectItem
+    uint32_t hash = tp_hash(path);
+    tp_entry_t *e = tp_index_slot(idx, path, hash);
+    uint32_t ord = (uint32_t)idx->leaves++;
+    if (e->path) {
+        return 0;
+    }
+    e->ord = ord;
+    e->path = strdup(path);
+    if (!e->path) {
+        return -1;
+    }
+    e->hash = hash;
+    e->node = c;
+    tp_entry_cache(e);
+    idx->count++;
+    return 0;
+}
+
+/**
+ * @brief Insert every leaf below an object into the index
+ *
+ * @param idx Index being built
+ * @param obj Object whose children are visited
+ * @param path Buffer holding the dotted path of obj, grown as needed
+ * @param cap Capacity of the path buffer
+ * @param len Length of the path of obj
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int tp_index_add(struct tp_index *idx, cJSON *obj, char **path, size_t *cap, size_t len)
+{
+    for (cJSON *c = obj->child; c; c = c->next) {
+        if (!c->string) {
+            continue;
+        }
+        size_t klen = strlen(c->string);
+        size_t need = len + klen + 2;
+        if (need > *cap) {
+            char *p = (char *)realloc(*path, need * 2);
+            if (!p) {
+                return -1;
+            }
+            *path = p;
+            *cap = need * 2;
+        }
+        size_t n = len;
+        if (n) {
+            (*path)[n++] = '.';
+        }
+        memcpy(*path + n, c->string, klen + 1);
+        n += klen;
+
+        if (c->type == cJSON_Object) {
+            if (tp_index_add(idx, c, path, cap, n) != 0) {
+                return -1;
+            }
+        } else if (tp_index_leaf(idx, c, *path) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Release a path index
+ */
+static void tp_index_free(struct tp_index *idx)
+{
+    if (idx) {
+        for (size_t i = 0; i <= idx->mask; i++) {
+            free(idx->slots[i].path);
+        }
+        free(idx->slots);
+        free(idx);
+    }
+}
+
+/**
+ * @brief Build a hash index from full dotted path to leaf node
+ *
+ * @param root Root object of the tree
+ * @return struct tp_index* Index, or NULL on failure
+ */
+static struct tp_index *tp_index_build(cJSON *root)
+{
+    struct tp_index *idx = (struct tp_index *)calloc(1, sizeof(struct tp_index));
+    if (!idx) {
         return NULL;
     }
 
-    // Allocate handle
-    handle = (tp_handle_t *)calloc(1, sizeof(tp_handle_t));
-    if (!handle) {
-        AML_LOGE("Memory allocation failed for handle\n");
+    // Keep the load factor at or below one half
+    size_t size = 16;
+    size_t leaves = tp_count_leaves(root);
+    while (size < leaves * 2) {
+        size <<= 1;
+    }
+    idx->mask = size - 1;
+    idx->slots = (tp_entry_t *)calloc(size, sizeof(tp_entry_t));
+    if (!idx->slots) {
+        free(idx);
         return NULL;
     }
 
-    // Initialize mutex
-    if (pthread_mutex_init(&handle->lock, NULL) != 0) {
-        AML_LOGE("Mutex initialization failed\n");
-        free(handle);
+    size_t cap = 128;
+    char *path = (char *)malloc(cap);
+    if (!path || tp_index_add(idx, root, &path, &cap, 0) != 0) {
+        free(path);
+        tp_index_free(idx);
         return NULL;
     }
+    free(path);
+    return idx;
+}
 
-    // Save filename
-    handle->filename = strdup(file);
-    if (!handle->filename) {
-        AML_LOGE("Memory allocation failed for filename\n");
-        pthread_mutex_destroy(&handle->lock);
-        free(handle);
+/**
+ * @brief Look up a leaf by full dotted path
+ *
+ * @return tp_entry_t* Entry, or NULL if not indexed
+ */
+static tp_entry_t *tp_index_find(struct tp_index *idx, const char *path)
+{
+    tp_entry_t *e = tp_index_slot(idx, path, tp_hash(path));
+    return e->path ? e : NULL;
+}
+
+#define TP_BLOOM_BITS 16 // Filter bits per key, with four probes about 0.5% false positives
+
+struct tp_bloom {
+    struct tp_bloom *next;  // Older filter on the retired list
+    size_t mask;            // Number of words minus one, a power of two
+    uint64_t words[];       // Every key sets four bits in one word
+};
+
+/**
+ * @brief Allocate an empty filter sized for a number of keys
+ */
+static struct tp_bloom *tp_bloom_create(size_t keys)
+{
+    size_t words = 1;
+    while (words * 64 < keys * TP_BLOOM_BITS) {
+        words <<= 1;
+    }
+    struct tp_bloom *b = (struct tp_bloom *)calloc(1, sizeof(struct tp_bloom) + words * sizeof(uint64_t));
+    if (b) {
+        b->mask = words - 1;
+    }
+    return b;
+}
+
+/**
+ * @brief Compute the word and bit mask of a key, ignoring case like lookups do
+ */
+static uint64_t *tp_bloom_bits(struct tp_bloom *b, const char *key, uint64_t *bits)
+{
+    uint32_t hash = tp_hash(key);
+    uint32_t mix = (hash ^ (hash >> 16)) * 0x45d9f3bu;
+
+    *bits = 0;
+    for (int i = 0; i < 4; i++) {
+        *bits |= (uint64_t)1 << ((mix >> (i * 6)) & 63);
+    }
+    return &b->words[hash & b->mask];
+}
+
+/**
+ * @brief Add a key to a filter that is not yet published
+ */
+static void tp_bloom_add(struct tp_bloom *b, const char *key)
+{
+    uint64_t bits;
+    *tp_bloom_bits(b, key, &bits) |= bits;
+}
+
+/**
+ * @brief Build a filter over every path of an index
+ *
+ * @param idx Index to take the paths from
+ * @param cur Filter in use, the new one is never smaller so it can replace it in place
+ * @return struct tp_bloom* Filter, or NULL on allocation failure
+ */
+static struct tp_bloom *tp_bloom_build(struct tp_index *idx, const struct tp_bloom *cur)
+{
+    size_t keys = cur ? (cur->mask + 1) * 64 / TP_BLOOM_BITS : 0;
+    struct tp_bloom *b = tp_bloom_create(idx->count > keys ? idx->count : keys);
+    for (size_t i = 0; b && i <= idx->mask; i++) {
+        if (idx->slots[i].path) {
+            tp_bloom_add(b, idx->slots[i].path);
+        }
+    }
+    return b;
+}
+
+/**
+ * @brief Replace the filter of a handle
+ *
+ * Readers probe the filter without any lock. A filter of the same size is
+ * copied over the current one word by word; every key lives in a single
+ * word, so a reader sees either its old or its new bits. Only a filter that
+ * had to grow is swapped in, and the replaced one is kept until tp_close().
+ * Filters at least double when they grow, so the retired ones never add up
+ * to more than the current one. Must be called with h->lock held for
+ * writing, or before the handle is shared.
+ *
+ * @param h Handle to the JSON file
+ * @param b New filter, taken over by the handle; NULL turns filtering off
+ */
+static void tp_bloom_publish(tp_handle_t *h, struct tp_bloom *b)
+{
+    struct tp_bloom *cur = h->bloom;
+    if (cur && b && b->mask == cur->mask) {
+        for (size_t i = 0; i <= cur->mask; i++) {
+            __atomic_store_n(&cur->words[i], b->words[i], __ATOMIC_RELAXED);
+        }
+        free(b);
+        return;
+    }
+    struct tp_bloom *old = __atomic_exchange_n(&h->bloom, b, __ATOMIC_ACQ_REL);
+    if (old) {
+        old->next = h->bloom_retired;
+        h->bloom_retired = old;
+    }
+}
+
+/**
+ * @brief Tell whether a key is certainly absent, without taking any lock
+ *
+ * @return int 1 if the key does not exist, 0 if it may exist
+ */
+static int tp_bloom_reject(tp_handle_t *h, const char *key)
+{
+    struct tp_bloom *b = __atomic_load_n(&h->bloom, __ATOMIC_ACQUIRE);
+    uint64_t bits;
+
+    if (!b || (__atomic_load_n(tp_bloom_bits(b, key, &bits), __ATOMIC_RELAXED) & bits) == bits) {
+        return 0;
+    }
+    TP_STAT_ADD(h, misses, 1);
+    return 1;
+}
+
+/**
+ * @brief Release a handle's filter and every retired one
+ */
+static void tp_bloom_free(tp_handle_t *h)
+{
+    tp_bloom_publish(h, NULL);
+    while (h->bloom_retired) {
+        struct tp_bloom *b = h->bloom_retired;
+        h->bloom_retired = b->next;
+        free(b);
+    }
+}
+
+#define TP_VERSION_PAGE 16 // Index slots per copy-on-write page of a snapshot version
+
+struct tp_version_slot {
+    char *path;                 // Full dotted path, NULL marks an empty slot
+    uint32_t hash;              // Case-insensitive hash of path
+    cJSON *node;                // Detached copy of the leaf
+};
+
+struct tp_version_page {
+    unsigned int refs;          // Versions sharing the page, guarded by snap_lock
+    struct tp_version_slot slots[TP_VERSION_PAGE];
+};
+
+struct tp_version {
+    unsigned long gen;          // Tree generation the pages mirror
+    size_t count;               // Occupied slots of the mirrored index
+    size_t mask;                // Slot mask of the mirrored index
+    size_t npages;              // Entries of pages
+    struct tp_version_page **pages; // Copies of the index slots, shared with other versions while unchanged
+    struct tp_version *next;    // Next entry on the retired list
+};
+
+#define TP_CACHELINE 64
+
+struct tp_snapshot {
+    struct tp_version *hp;      // Version this thread is reading, NULL when idle
+    int depth;                  // Nested acquire count, touched by the owner only
+    int in_use;                 // Slot owned by a live thread, guarded by snap_lock
+    struct tp_snapshot *next;   // Next slot registered on the handle
+} __attribute__((aligned(TP_CACHELINE)));
+
+/**
+ * @brief Drop one reference to a version page, freeing it with the last
+ */
+static void tp_version_page_put(struct tp_version_page *pg)
+{
+    if (pg && --pg->refs == 0) {
+        for (size_t i = 0; i < TP_VERSION_PAGE; i++) {
+            free(pg->slots[i].path);
+            cJSON_Delete(pg->slots[i].node);
+        }
+        free(pg);
+    }
+}
+
+/**
+ * @brief Copy one page of index slots
+ *
+ * @param idx Live index, read with h->lock held
+ * @param p Page number
+ * @return struct tp_version_page* Page with one reference, or NULL on failure
+ */
+static struct tp_version_page *tp_version_page_build(struct tp_index *idx, size_t p)
+{
+    struct tp_version_page *pg = (struct tp_version_page *)calloc(1, sizeof(struct tp_version_page));
+    if (!pg) {
+        return NULL;
+    }
+    pg->refs = 1;
+    for (size_t i = 0; i < TP_VERSION_PAGE && p * TP_VERSION_PAGE + i <= idx->mask; i++) {
+        tp_entry_t *e = &idx->slots[p * TP_VERSION_PAGE + i];
+        if (!e->path) {
+            continue;
+        }
+        pg->slots[i].hash = e->hash;
+        pg->slots[i].path = strdup(e->path);
+        pg->slots[i].node = cJSON_Duplicate(e->node, 1);
+        if (!pg->slots[i].path || !pg->slots[i].node) {
+            tp_version_page_put(pg);
+            return NULL;
+        }
+    }
+    return pg;
+}
+
+/**
+ * @brief Release a snapshot version
+ *
+ * Must be called with h->snap_lock held, or with no other user of the handle.
+ */
+static void tp_version_free(struct tp_version *v)
+{
+    if (v) {
+        for (size_t p = 0; p < v->npages; p++) {
+            tp_version_page_put(v->pages[p]);
+        }
+        free(v->pages);
+        free(v);
+    }
+}
+
+/**
+ * @brief Mark the snapshot page of an entry as changed
+ *
+ * Must be called with h->lock held for writing, after the value of e changed.
+ */
+static void tp_version_touch(tp_handle_t *h, tp_entry_t *e)
+{
+    size_t p = (size_t)(e - h->index->slots) / TP_VERSION_PAGE;
+    if (p < h->snap_pages) {
+        h->snap_dirty[p / 64] |= 1ull << (p % 64);
+    }
+}
+
+/**
+ * @brief Build an immutable copy of the index slots
+ *
+ * Pages untouched since prev are shared with it, so a write costs one page
+ * per changed key. A full copy happens at open and after the index was
+ * rebuilt. Must be called with h->lock held for reading and, once
+ * h->current exists, with h->snap_lock held.
+ *
+ * @param h Handle to the JSON file
+ * @param prev Version to share pages with, NULL for a full copy
+ * @return struct tp_version* New version, or NULL on failure
+ */
+static struct tp_version *tp_version_build(tp_handle_t *h, struct tp_version *prev)
+{
+    struct tp_index *idx = h->index;
+    struct tp_version *v = (struct tp_version *)calloc(1, sizeof(struct tp_version));
+    if (!v) {
+        return NULL;
+    }
+    v->gen = h->gen;
+    v->count = idx->count;
+    v->mask = idx->mask;
+    v->npages = (idx->mask + TP_VERSION_PAGE) / TP_VERSION_PAGE;
+    v->pages = (struct tp_version_page **)calloc(v->npages, sizeof(struct tp_version_page *));
+    if (!v->pages) {
+        free(v);
         return NULL;
     }
 
-    // Open file in read-write mode
-    fp = fopen(file, "r+");
+    // Pages are only comparable while the slots hold the same paths
+    int share = prev && prev->gen == v->gen && prev->count == v->count && prev->mask == v->mask &&
+                h->snap_pages == v->npages;
+    size_t words = (v->npages + 63) / 64;
+    if (!share && h->snap_pages != v->npages) {
+        uint64_t *dirty = (uint64_t *)calloc(words, sizeof(uint64_t));
+        if (!dirty) {
+            tp_version_free(v);
+            return NULL;
+        }
+        free(h->snap_dirty);
+        h->snap_dirty = dirty;
+        h->snap_pages = v->npages;
+    }
+
+    for (size_t p = 0; p < v->npages; p++) {
+        if (share && !(h->snap_dirty[p / 64] & (1ull << (p % 64)))) {
+            v->pages[p] = prev->pages[p];
+            v->pages[p]->refs++;
+            continue;
+        }
+        v->pages[p] = tp_version_page_build(idx, p);
+        if (!v->pages[p]) {
+            tp_version_free(v);
+            return NULL;
+        }
+    }
+    memset(h->snap_dirty, 0, words * sizeof(uint64_t));
+    return v;
+}
+
+/**
+ * @brief Look up a leaf in a snapshot version, probing as tp_index_slot() does
+ *
+ * @return cJSON* Copy of the leaf, or NULL if the version does not hold path
+ */
+static cJSON *tp_version_find(struct tp_version *v, const char *path)
+{
+    uint32_t hash = tp_hash(path);
+    for (size_t i = hash & v->mask;; i = (i + 1) & v->mask) {
+        struct tp_version_slot *vs = &v->pages[i / TP_VERSION_PAGE]->slots[i % TP_VERSION_PAGE];
+        if (!vs->path) {
+            return NULL;
+        }
+        if (vs->hash == hash && strcasecmp(vs->path, path) == 0) {
+            return vs->node;
+        }
+    }
+}
+
+/**
+ * @brief Free retired versions that no reader slot points at
+ *
+ * Must be called with h->snap_lock held.
+ */
+static void tp_snapshot_reclaim(tp_handle_t *h)
+{
+    struct tp_version **pv = &h->retired;
+    while (*pv) {
+        struct tp_version *v = *pv;
+        struct tp_snapshot *s;
+        for (s = h->readers; s; s = s->next) {
+            if (__atomic_load_n(&s->hp, __ATOMIC_SEQ_CST) == v) {
+                break;
+            }
+        }
+        if (s) {
+            pv = &v->next;
+        } else {
+            *pv = v->next;
+            tp_version_free(v);
+        }
+    }
+}
+
+/**
+ * @brief Publish the current tree as the new snapshot version
+ *
+ * Readers that already hold the previous version keep using it; it is freed
+ * once the last of them releases it. No-op unless opened with TP_OPEN_SNAPSHOT.
+ *
+ * @param h Handle to the JSON file
+ */
+static void tp_snapshot_publish(tp_handle_t *h)
+{
+    if (!(h->flags & TP_OPEN_SNAPSHOT)) {
+        return;
+    }
+
+    // snap_lock keeps publication in build order, so the newest tree wins
+    pthread_mutex_lock(&h->snap_lock);
+    pthread_rwlock_rdlock(&h->lock);
+    struct tp_version *v = tp_version_build(h, h->current);
+    pthread_rwlock_unlock(&h->lock);
+    if (!v) {
+        AML_LOGE("Failed to build snapshot version\n");
+        pthread_mutex_unlock(&h->snap_lock);
+        return;
+    }
+
+    struct tp_version *old = __atomic_exchange_n(&h->current, v, __ATOMIC_SEQ_CST);
+    old->next = h->retired;
+    h->retired = old;
+    tp_snapshot_reclaim(h);
+    pthread_mutex_unlock(&h->snap_lock);
+}
+
+/**
+ * @brief Thread-exit destructor returning a reader slot to the handle
+ */
+static void tp_snapshot_exit(void *arg)
+{
+    struct tp_snapshot *s = (struct tp_snapshot *)arg;
+    __atomic_store_n(&s->hp, NULL, __ATOMIC_SEQ_CST);
+    s->depth = 0;
+    __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Set up snapshot state and publish the initial version
+ *
+ * @param h Handle with a parsed tree
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_snapshot_init(tp_handle_t *h)
+{
+    if (pthread_mutex_init(&h->snap_lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_key_create(&h->snap_key, tp_snapshot_exit) != 0) {
+        pthread_mutex_destroy(&h->snap_lock);
+        return -1;
+    }
+    h->current = tp_version_build(h, NULL);
+    if (!h->current) {
+        free(h->snap_dirty);
+        h->snap_dirty = NULL;
+        h->snap_pages = 0;
+        pthread_key_delete(h->snap_key);
+        pthread_mutex_destroy(&h->snap_lock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Tear down snapshot state, no snapshot may still be held
+ */
+static void tp_snapshot_fini(tp_handle_t *h)
+{
+    pthread_key_delete(h->snap_key);
+    tp_version_free(h->current);
+    free(h->snap_dirty);
+    h->snap_dirty = NULL;
+    h->snap_pages = 0;
+    while (h->retired) {
+        struct tp_version *v = h->retired;
+        h->retired = v->next;
+        tp_version_free(v);
+    }
+    while (h->readers) {
+        struct tp_snapshot *s = h->readers;
+        h->readers = s->next;
+        free(s);
+    }
+    pthread_mutex_destroy(&h->snap_lock);
+}
+
+#define TP_CACHE_SLOTS 128 // Entries of a thread's read cache, direct-mapped by key hash
+#define TP_CACHE_KEY 64     // Longest cached key including the NUL
+#define TP_CACHE_VALUE 64   // Longest cached string value including the NUL
+
+struct tp_cache_entry {
+    unsigned long version;  // Handle version the entry was filled at, 0 when empty
+    uint32_t hash;          // Case-insensitive hash of key
+    int has_str;            // value holds the whole string value
+    int vflags;             // TP_VAL_* flags describing num and bval
+    int bval;               // Cached boolean value
+    double num;             // Cached numeric value
+    char key[TP_CACHE_KEY]; // Key as it was asked for
+    char value[TP_CACHE_VALUE];
+};
+
+struct tp_cache {
+    struct tp_cache *next;  // Next cache of the handle
+    int in_use;             // Owned by a live thread, cleared when it exits
+    struct tp_cache_entry slots[TP_CACHE_SLOTS];
+};
+
+/**
+ * @brief Release a thread's cache for reuse when the thread exits
+ */
+static void tp_cache_exit(void *arg)
+{
+    struct tp_cache *c = (struct tp_cache *)arg;
+    __atomic_store_n(&c->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Set up per-thread read caches
+ *
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_cache_init(tp_handle_t *h)
+{
+    if (pthread_mutex_init(&h->cache_lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_key_create(&h->cache_key, tp_cache_exit) != 0) {
+        pthread_mutex_destroy(&h->cache_lock);
+        return -1;
+    }
+    // Empty entries hold version 0 and must never match
+    h->version = 1;
+    return 0;
+}
+
+/**
+ * @brief Tear down per-thread read caches, no reader may still be running
+ */
+static void tp_cache_fini(tp_handle_t *h)
+{
+    pthread_key_delete(h->cache_key);
+    while (h->caches) {
+        struct tp_cache *c = h->caches;
+        h->caches = c->next;
+        free(c);
+    }
+    pthread_mutex_destroy(&h->cache_lock);
+}
+
+/**
+ * @brief Mark every value cached by any thread as stale
+ *
+ * Must be called with h->lock held for writing, after the change.
+ */
+static void tp_cache_invalidate(tp_handle_t *h)
+{
+    __atomic_store_n(&h->version, h->version + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Find a current entry for a key in the calling thread's cache
+ *
+ * Takes no lock: the entry is current if it was filled at the version the
+ * handle has now, since every change bumps the version.
+ *
+ * @param h Handle to the JSON file
+ * @param key Dotted key
+ * @return struct tp_cache_entry* Entry, or NULL on a cache miss
+ */
+static struct tp_cache_entry *tp_cache_hit(tp_handle_t *h, const char *key)
+{
+    if (!(h->flags & TP_OPEN_THREAD_CACHE)) {
+        return NULL;
+    }
+    struct tp_cache *c = (struct tp_cache *)pthread_getspecific(h->cache_key);
+    if (!c) {
+        return NULL;
+    }
+    uint32_t hash = tp_hash(key);
+    struct tp_cache_entry *ce = &c->slots[hash & (TP_CACHE_SLOTS - 1)];
+    // Relaxed is enough, the entry itself is only ever touched by this thread
+    if (ce->version != __atomic_load_n(&h->version, __ATOMIC_RELAXED) || ce->hash != hash ||
+        strcasecmp(ce->key, key) != 0) {
+        return NULL;
+    }
+    return ce;
+}
+
+/**
+ * @brief Remember the value of an entry in the calling thread's cache
+ *
+ * Must be called with h->lock held, so the value matches the version.
+ *
+ * @param h Handle to the JSON file
+ * @param key Dotted key as the caller asked for it
+ * @param e Entry found for key
+ */
+static void tp_cache_fill(tp_handle_t *h, const char *key, tp_entry_t *e)
+{
+    size_t klen = strlen(key);
+    if (!(h->flags & TP_OPEN_THREAD_CACHE) || klen >= TP_CACHE_KEY) {
+        return;
+    }
+
+    struct tp_cache *c = (struct tp_cache *)pthread_getspecific(h->cache_key);
+    if (!c) {
+        // Reuse the cache of an exited thread, its entries stay valid by version
+        pthread_mutex_lock(&h->cache_lock);
+        for (c = h->caches; c; c = c->next) {
+            if (!__atomic_load_n(&c->in_use, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+        }
+        if (!c) {
+            c = (struct tp_cache *)calloc(1, sizeof(struct tp_cache));
+            if (!c) {
+                pthread_mutex_unlock(&h->cache_lock);
+                return;
+            }
+            c->next = h->caches;
+            h->caches = c;
+        }
+        c->in_use = 1;
+        pthread_mutex_unlock(&h->cache_lock);
+        pthread_setspecific(h->cache_key, c);
+    }
+
+    uint32_t hash = tp_hash(key);
+    struct tp_cache_entry *ce = &c->slots[hash & (TP_CACHE_SLOTS - 1)];
+    const char *str = e->node->valuestring;
+    ce->hash = hash;
+    memcpy(ce->key, key, klen + 1);
+    ce->has_str = str && strlen(str) < TP_CACHE_VALUE;
+    if (ce->has_str) {
+        strcpy(ce->value, str);
+    }
+    ce->vflags = e->vflags;
+    ce->num = e->num;
+    ce->bval = e->bval;
+    ce->version = __atomic_load_n(&h->version, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Background flusher, persists a dirty tree at most once per interval
+ */
+static void *tp_flusher(void *arg)
+{
+    tp_handle_t *h = (tp_handle_t *)arg;
+
+    pthread_mutex_lock(&h->flush_lock);
+    for (;;) {
+        while (!h->dirty && !h->flush_stop) {
+            pthread_cond_wait(&h->flush_cond, &h->flush_lock);
+        }
+        if (!h->dirty) {
+            break;
+        }
+
+        // Let a burst of updates coalesce before writing
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += h->flush_interval_ms / 1000;
+        ts.tv_nsec += (long)(h->flush_interval_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while (!h->flush_stop &&
+               pthread_cond_timedwait(&h->flush_cond, &h->flush_lock, &ts) != ETIMEDOUT) {
+        }
+        if (!h->dirty) {
+            continue;
+        }
+
+        h->dirty = 0;
+        pthread_mutex_unlock(&h->flush_lock);
+        int ret = tp_persist(h);
+        pthread_mutex_lock(&h->flush_lock);
+        if (ret != 0) {
+            // Retry on the next interval, or give up if closing
+            h->dirty = !h->flush_stop;
+        }
+    }
+    pthread_mutex_unlock(&h->flush_lock);
+    return NULL;
+}
+
+/**
+ * @brief Start the write-behind flusher thread
+ *
+ * @param h Handle to the JSON file
+ * @param interval_ms Minimum time between two writes, 0 for the default
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_flush_init(tp_handle_t *h, unsigned int interval_ms)
+{
+    pthread_condattr_t attr;
+
+    h->flush_interval_ms = interval_ms ? interval_ms : TP_FLUSH_INTERVAL_MS;
+    if (pthread_mutex_init(&h->flush_lock, NULL) != 0) {
+        return -1;
+    }
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&h->flush_cond, &attr) != 0) {
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_destroy(&h->flush_lock);
+        return -1;
+    }
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&h->flusher, NULL, tp_flusher, h) != 0) {
+        pthread_cond_destroy(&h->flush_cond);
+        pthread_mutex_destroy(&h->flush_lock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Stop the flusher thread after it wrote any pending changes
+ */
+static void tp_flush_fini(tp_handle_t *h)
+{
+    pthread_mutex_lock(&h->flush_lock);
+    h->flush_stop = 1;
+    pthread_cond_broadcast(&h->flush_cond);
+    pthread_mutex_unlock(&h->flush_lock);
+    pthread_join(h->flusher, NULL);
+    pthread_cond_destroy(&h->flush_cond);
+    pthread_mutex_destroy(&h->flush_lock);
+}
+
+/**
+ * @brief Current durability level of tp_set()
+ */
+static int tp_durability(tp_handle_t *h)
+{
+    return __atomic_load_n(&h->durability, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Mark the tree as changed and wake the flusher
+ */
+static void tp_mark_dirty(tp_handle_t *h)
+{
+    pthread_mutex_lock(&h->flush_lock);
+    if (!h->dirty) {
+        h->dirty = 1;
+        pthread_cond_signal(&h->flush_cond);
+    }
+    pthread_mutex_unlock(&h->flush_lock);
+}
+
+/*
+ * Vectorized scanning
+ *
+ * The helpers look at 16 bytes at a time with SSE2 or NEON when the target
+ * has them and fall back to a byte loop for the tail and other targets. The
+ * mapping a file is parsed from is not NUL-terminated, so no load reaches
+ * past end.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TP_VEC 16
+#define TP_VEC_SHIFT 0          // log2 of mask bits per byte
+#define TP_VEC_ALL 0xFFFFull    // Mask with every byte set
+typedef __m128i tp_vec_t;
+#define tp_vec_load(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define tp_vec_eq(v, c) _mm_cmpeq_epi8((v), _mm_set1_epi8((char)(c)))
+#define tp_vec_le(v, c) _mm_cmpeq_epi8(_mm_max_epu8((v), _mm_set1_epi8((char)(c))), _mm_set1_epi8((char)(c)))
+#define tp_vec_or(a, b) _mm_or_si128((a), (b))
+#define tp_vec_mask(v) ((uint64_t)(unsigned int)_mm_movemask_epi8(v))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TP_VEC 16
+#define TP_VEC_SHIFT 2          // vshrn leaves four bits per byte
+#define TP_VEC_ALL (~0ull)
+typedef uint8x16_t tp_vec_t;
+#define tp_vec_load(p) vld1q_u8((const uint8_t *)(const void *)(p))
+#define tp_vec_eq(v, c) vceqq_u8((v), vdupq_n_u8((uint8_t)(c)))
+#define tp_vec_le(v, c) vcleq_u8((v), vdupq_n_u8((uint8_t)(c)))
+#define tp_vec_or(a, b) vorrq_u8((a), (b))
+#define tp_vec_mask(v) vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0)
+#endif
+
+/**
+ * @brief Find the first '"' or '\\'
+ *
+ * @return const char* Position of the byte, or end if there is none
+ */
+static const char *tp_find_quote(const char *p, const char *end)
+{
+#ifdef TP_VEC
+    for (; end - p >= TP_VEC; p += TP_VEC) {
+        tp_vec_t v = tp_vec_load(p);
+        uint64_t m = tp_vec_mask(tp_vec_or(tp_vec_eq(v, '"'), tp_vec_eq(v, '\\')));
+        if (m) {
+            return p + (__builtin_ctzll(m) >> TP_VEC_SHIFT);
+        }
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\') {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * @brief Find the first quote or bracket, the only bytes that matter when skipping a container
+ *
+ * @return const char* Position of the byte, or end if there is none
+ */
+static const char *tp_find_structural(const char *p, const char *end)
+{
+#ifdef TP_VEC
+    for (; end - p >= TP_VEC; p += TP_VEC) {
+        tp_vec_t v = tp_vec_load(p);
+        tp_vec_t q = tp_vec_or(tp_vec_eq(v, '"'), tp_vec_or(tp_vec_eq(v, '{'), tp_vec_eq(v, '}')));
+        uint64_t m = tp_vec_mask(tp_vec_or(q, tp_vec_or(tp_vec_eq(v, '['), tp_vec_eq(v, ']'))));
+        if (m) {
+            return p + (__builtin_ctzll(m) >> TP_VEC_SHIFT);
+        }
+    }
+#endif
+    while (p < end && *p != '"' && *p != '{' && *p != '}' && *p != '[' && *p != ']') {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * @brief Skip what cJSON treats as whitespace, every byte up to and including ' '
+ */
+static const char *tp_skip_space(const char *p, const char *end)
+{
+    // Most runs are a line break and some indentation, check a byte first
+    if (p < end && (unsigned char)*p > ' ') {
+        return p;
+    }
+#ifdef TP_VEC
+    for (; end - p >= TP_VEC; p += TP_VEC) {
+        uint64_t m = tp_vec_mask(tp_vec_le(tp_vec_load(p), ' ')) ^ TP_VEC_ALL;
+        if (m) {
+            return p + (__builtin_ctzll(m) >> TP_VEC_SHIFT);
+        }
+    }
+#endif
+    while (p < end && (unsigned char)*p <= ' ') {
+        p++;
+    }
+    return p;
+}
+
+/*
+ * Fast JSON parser (TP_PARSER_FAST)
+ *
+ * Builds the same cJSON tree cJSON_ParseWithLength() would, with nodes and
+ * strings from the cJSON allocator so arenas and cJSON_Delete() work as
+ * usual. It only takes the common path: anything unusual, such as a \u
+ * escape outside the basic plane, a very long number or deep nesting, makes
+ * it give up and the caller parses the text again with cJSON, which also
+ * reports the error if the text is malformed.
+ */
+#define TP_FAST_DEPTH 1000  // Nesting limit, matches cJSON's default
+#define TP_FAST_NUMBER 64   // Longest number text including the NUL, matches cJSON
+
+struct tp_fast {
+    const char *p;      // Next byte to parse
+    const char *end;    // End of the text
+};
+
+static int tp_fast_hex(const char *p)
+{
+    int v = 0;
+
+    for (int i = 0; i < 4; i++) {
+        int c = (unsigned char)p[i];
+        int d = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+        if (d < 0) {
+            return -1;
+        }
+        v = v << 4 | d;
+    }
+    return v;
+}
+
+/**
+ * @brief Parse a quoted string at f->p
+ *
+ * @return char* Unescaped string from cJSON_malloc(), or NULL to give up
+ */
+static char *tp_fast_string(struct tp_fast *f)
+{
+    const char *start = f->p + 1;
+    const char *p = tp_find_quote(start, f->end);
+
+    if (p >= f->end) {
+        return NULL;
+    }
+    if (*p == '"') {
+        char *s = (char *)cJSON_malloc(p - start + 1);
+        if (s) {
+            memcpy(s, start, p - start);
+            s[p - start] = '\0';
+            f->p = p + 1;
+        }
+        return s;
+    }
+
+    // Escapes only shrink the text, so its length bounds the result
+    const char *close = p;
+    while (close < f->end && *close != '"') {
+        close = tp_find_quote(*close == '\\' ? close + 2 : close, f->end);
+    }
+    if (close >= f->end) {
+        return NULL;
+    }
+    char *s = (char *)cJSON_malloc(close - start + 1);
+    if (!s) {
+        return NULL;
+    }
+    size_t n = p - start;
+    memcpy(s, start, n);
+    while (p < close) {
+        if (*p != '\\') {
+            const char *q = tp_find_quote(p, close);
+            memcpy(s + n, p, q - p);
+            n += q - p;
+            p = q;
+            continue;
+        }
+        int c = p[1];
+        p += 2;
+        switch (c) {
+        case 'b': s[n++] = '\b'; break;
+        case 'f': s[n++] = '\f'; break;
+        case 'n': s[n++] = '\n'; break;
+        case 'r': s[n++] = '\r'; break;
+        case 't': s[n++] = '\t'; break;
+        case '"':
+        case '\\':
+        case '/':
+            s[n++] = (char)c;
+            break;
+        case 'u': {
+            // Surrogates and NUL are left to cJSON
+            int u = close - p >= 4 ? tp_fast_hex(p) : -1;
+            if (u <= 0 || (u >= 0xD800 && u <= 0xDFFF)) {
+                cJSON_free(s);
+                return NULL;
+            }
+            if (u < 0x80) {
+                s[n++] = (char)u;
+            } else if (u < 0x800) {
+                s[n++] = (char)(0xC0 | u >> 6);
+                s[n++] = (char)(0x80 | (u & 0x3F));
+            } else {
+                s[n++] = (char)(0xE0 | u >> 12);
+                s[n++] = (char)(0x80 | ((u >> 6) & 0x3F));
+                s[n++] = (char)(0x80 | (u & 0x3F));
+            }
+            p += 4;
+            break;
+        }
+        default:
+            cJSON_free(s);
+            return NULL;
+        }
+    }
+    s[n] = '\0';
+    f->p = close + 1;
+    return s;
+}
+
+static cJSON *tp_fast_value(struct tp_fast *f, int depth);
+
+/**
+ * @brief Parse the members of an object or the elements of an array at f->p
+ *
+ * @return int 0 on success, -1 to give up
+ */
+static int tp_fast_children(struct tp_fast *f, cJSON *node, int depth)
+{
+    int object = *f->p == '{';
+    char close = object ? '}' : ']';
+    cJSON *tail = NULL;
+
+    if (depth >= TP_FAST_DEPTH) {
+        return -1;
+    }
+    f->p = tp_skip_space(f->p + 1, f->end);
+    if (f->p < f->end && *f->p == close) {
+        f->p++;
+        return 0;
+    }
+    for (;;) {
+        char *name = NULL;
+        if (object) {
+            if (f->p >= f->end || *f->p != '"' || !(name = tp_fast_string(f))) {
+                return -1;
+            }
+            f->p = tp_skip_space(f->p, f->end);
+            if (f->p >= f->end || *f->p != ':') {
+                cJSON_free(name);
+                return -1;
+            }
+            f->p = tp_skip_space(f->p + 1, f->end);
+        }
+        cJSON *item = tp_fast_value(f, depth + 1);
+        if (!item) {
+            cJSON_free(name);
+            return -1;
+        }
+        item->string = name;
+        // Link like cJSON does, the first child's prev points at the last one
+        if (tail) {
+            tail->next = item;
+            item->prev = tail;
+        } else {
+            node->child = item;
+        }
+        tail = item;
+        node->child->prev = tail;
+
+        f->p = tp_skip_space(f->p, f->end);
+        if (f->p < f->end && *f->p == ',') {
+            f->p = tp_skip_space(f->p + 1, f->end);
+            continue;
+        }
+        if (f->p < f->end && *f->p == close) {
+            f->p++;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+/**
+ * @brief Parse one value at f->p, whitespace before it already skipped
+ *
+ * @return cJSON* Parsed value, or NULL to give up
+ */
+static cJSON *tp_fast_value(struct tp_fast *f, int depth)
+{
+    size_t left = f->end - f->p;
+    cJSON *node;
+
+    if (!left) {
+        return NULL;
+    }
+    switch (*f->p) {
+    case '"': {
+        char *s = tp_fast_string(f);
+        node = s ? cJSON_CreateNull() : NULL;
+        if (!node) {
+            cJSON_free(s);
+            return NULL;
+        }
+        node->type = cJSON_String;
+        node->valuestring = s;
+        return node;
+    }
+    case '{':
+    case '[':
+        node = *f->p == '{' ? cJSON_CreateObject() : cJSON_CreateArray();
+        if (node && tp_fast_children(f, node, depth) != 0) {
+            cJSON_Delete(node);
+            node = NULL;
+        }
+        return node;
+    case 'n':
+        if (left >= 4 && memcmp(f->p, "null", 4) == 0) {
+            f->p += 4;
+            return cJSON_CreateNull();
+        }
+        return NULL;
+    case 't':
+        if (left >= 4 && memcmp(f->p, "true", 4) == 0) {
+            f->p += 4;
+            return cJSON_CreateTrue();
+        }
+        return NULL;
+    case 'f':
+        if (left >= 5 && memcmp(f->p, "false", 5) == 0) {
+            f->p += 5;
+            return cJSON_CreateFalse();
+        }
+        return NULL;
+    default:
+        break;
+    }
+
+    // Numbers are taken the way cJSON takes them: the run of number characters, then strtod()
+    if (*f->p != '-' && (*f->p < '0' || *f->p > '9')) {
+        return NULL;
+    }
+    char num[TP_FAST_NUMBER];
+    size_t n = 0;
+    while (n < left && n < sizeof(num) - 1 && f->p[n] && strchr("0123456789+-eE.", f->p[n])) {
+        num[n] = f->p[n];
+        n++;
+    }
+    if (!n || n == sizeof(num) - 1) {
+        return NULL;
+    }
+    num[n] = '\0';
+    char *after;
+    double d = strtod(num, &after);
+    if (after == num) {
+        return NULL;
+    }
+    f->p += after - num;
+    return cJSON_CreateNumber(d);
+}
+
+/**
+ * @brief Parse a buffer with the fast parser, falling back to cJSON
+ *
+ * @param parser tp_parser_t to use
+ * @return cJSON* Parsed tree, or NULL with cJSON_GetErrorPtr() set on failure
+ */
+static cJSON *tp_json_parse(const char *buf, size_t len, int parser)
+{
+    if (parser == TP_PARSER_FAST) {
+        struct tp_fast f = { buf, buf + len };
+        if (len >= 3 && memcmp(buf, "\xEF\xBB\xBF", 3) == 0) {
+            f.p += 3;
+        }
+        f.p = tp_skip_space(f.p, f.end);
+        cJSON *root = tp_fast_value(&f, 0);
+        if (root) {
+            return root;
+        }
+    }
+    return cJSON_ParseWithLength(buf, len);
+}
+
+/*
+ * Arena-backed trees (TP_OPEN_ARENA)
+ *
+ * cJSON allocates through process-wide hooks. They bump-allocate from the
+ * calling thread's current arena while one is set, which only happens around
+ * a parse, and fall through to malloc()/free() otherwise. Nodes and strings of
+ * an arena tree are never freed one by one; the whole arena goes at once.
+ * Values stored later come from a per-handle pool of size classes.
+ */
+#define TP_ARENA_CHUNK 16384    // Minimum arena chunk size
+#define TP_POOL_MIN 16          // Smallest pool block, classes double up to TP_POOL_MAX
+#define TP_POOL_MAX 256         // Largest pooled value including the NUL, bigger ones use malloc()
+#define TP_POOL_CLASSES 5       // Number of size classes from TP_POOL_MIN to TP_POOL_MAX
+#define TP_POOL_KEEP 64         // Free blocks kept per class
+
+struct tp_arena_chunk {
+    struct tp_arena_chunk *next;    // Older chunk
+    size_t size;                    // Usable bytes in data
+    size_t used;                    // Bytes handed out
+    max_align_t data[];             // Allocation space
+};
+
+struct tp_arena {
+    struct tp_arena_chunk *chunks;  // Newest chunk first, allocations come from it
+};
+
+struct tp_pool {
+    pthread_mutex_t lock;               // Guards the free lists
+    void *free[TP_POOL_CLASSES];        // Free blocks per class, linked through their first word
+    unsigned int count[TP_POOL_CLASSES]; // Length of each free list
+};
+
+static __thread struct tp_arena *tp_cur_arena; // Arena cJSON allocates from on this thread
+
+static struct tp_arena_chunk *tp_arena_chunk_new(size_t size)
+{
+    struct tp_arena_chunk *c = (struct tp_arena_chunk *)malloc(sizeof(struct tp_arena_chunk) + size);
+    if (c) {
+        c->next = NULL;
+        c->size = size;
+        c->used = 0;
+    }
+    return c;
+}
+
+/**
+ * @brief Create an arena whose first chunk can hold about size bytes
+ */
+static struct tp_arena *tp_arena_create(size_t size)
+{
+    struct tp_arena *a = (struct tp_arena *)calloc(1, sizeof(struct tp_arena));
+    if (!a) {
+        return NULL;
+    }
+    a->chunks = tp_arena_chunk_new(size < TP_ARENA_CHUNK ? TP_ARENA_CHUNK : size);
+    if (!a->chunks) {
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+static void *tp_arena_alloc(struct tp_arena *a, size_t n)
+{
+    struct tp_arena_chunk *c = a->chunks;
+
+    n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if (n > c->size - c->used) {
+        size_t size = c->size * 2;
+        c = tp_arena_chunk_new(size < n ? n : size);
+        if (!c) {
+            return NULL;
+        }
+        c->next = a->chunks;
+        a->chunks = c;
+    }
+    void *p = (char *)c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+/**
+ * @brief Check whether p points into the arena
+ */
+static int tp_arena_owns(struct tp_arena *a, const void *p)
+{
+    for (struct tp_arena_chunk *c = a->chunks; c; c = c->next) {
+        if ((uintptr_t)p >= (uintptr_t)c->data && (uintptr_t)p < (uintptr_t)c->data + c->size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void tp_arena_destroy(struct tp_arena *a)
+{
+    if (a) {
+        while (a->chunks) {
+            struct tp_arena_chunk *c = a->chunks;
+            a->chunks = c->next;
+            free(c);
+        }
+        free(a);
+    }
+}
+
+static void *tp_hook_malloc(size_t n)
+{
+    struct tp_arena *a = tp_cur_arena;
+    return a ? tp_arena_alloc(a, n) : malloc(n);
+}
+
+static void tp_hook_free(void *p)
+{
+    // cJSON frees a failed parse node by node, arena memory goes with the arena
+    struct tp_arena *a = tp_cur_arena;
+    if (!a || !tp_arena_owns(a, p)) {
+        free(p);
+    }
+}
+
+static void tp_hooks_install(void)
+{
+    cJSON_Hooks hooks = { tp_hook_malloc, tp_hook_free };
+    cJSON_InitHooks(&hooks);
+}
+
+/**
+ * @brief Parse a buffer into a fresh arena
+ *
+ * The root node is copied to the heap, so the tree can later take children
+ * from another arena's tree and this arena can still be released whole.
+ *
+ * @return cJSON* Parsed tree, or NULL on failure
+ */
+static cJSON *tp_arena_parse(const char *buf, size_t len, int parser, struct tp_arena **arena)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, tp_hooks_install);
+
+    // Nodes and strings take a few times the size of their source text
+    struct tp_arena *a = tp_arena_create(len * 4);
+    if (!a) {
+        AML_LOGE("Memory allocation failed for arena\n");
+        return NULL;
+    }
+    tp_cur_arena = a;
+    cJSON *parsed = tp_json_parse(buf, len, parser);
+    tp_cur_arena = NULL;
+
+    cJSON *root = parsed ? (cJSON *)malloc(sizeof(cJSON)) : NULL;
+    if (!root) {
+        tp_arena_destroy(a);
+        return NULL;
+    }
+    *root = *parsed;
+    *arena = a;
+    return root;
+}
+
+static struct tp_pool *tp_pool_create(void)
+{
+    struct tp_pool *p = (struct tp_pool *)calloc(1, sizeof(struct tp_pool));
+    if (p && pthread_mutex_init(&p->lock, NULL) != 0) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+static void tp_pool_destroy(struct tp_pool *p)
+{
+    if (p) {
+        for (int i = 0; i < TP_POOL_CLASSES; i++) {
+            while (p->free[i]) {
+                void *b = p->free[i];
+                p->free[i] = *(void **)b;
+                free(b);
+            }
+        }
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+    }
+}
+
+/**
+ * @brief Copy a value for storing in the tree, from the pool when the handle has one
+ *
+ * Pool blocks carry their size class in a header word before the string.
+ *
+ * @return char* Copy to release with tp_value_free(), or NULL on failure
+ */
+static char *tp_value_dup(tp_handle_t *h, const char *s)
+{
+    struct tp_pool *p = h->pool;
+    if (!p) {
+        return strdup(s);
+    }
+
+    size_t len = strlen(s) + 1;
+    size_t cls = 0;
+    while (cls < TP_POOL_CLASSES && (size_t)TP_POOL_MIN << cls < len) {
+        cls++;
+    }
+
+    size_t *b = NULL;
+    if (cls < TP_POOL_CLASSES) {
+        pthread_mutex_lock(&p->lock);
+        b = (size_t *)p->free[cls];
+        if (b) {
+            p->free[cls] = *(void **)b;
+            p->count[cls]--;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (!b) {
+        b = (size_t *)malloc(sizeof(size_t) + (cls < TP_POOL_CLASSES ? (size_t)TP_POOL_MIN << cls : len));
+        if (!b) {
+            return NULL;
+        }
+    }
+    b[0] = cls;
+    memcpy(b + 1, s, len);
+    return (char *)(b + 1);
+}
+
+/**
+ * @brief Release a value from tp_value_dup(), a pool block goes back to its class
+ */
+static void tp_value_free(tp_handle_t *h, char *s)
+{
+    struct tp_pool *p = h->pool;
+    if (!p || !s) {
+        free(s);
+        return;
+    }
+
+    size_t *b = (size_t *)s - 1;
+    size_t cls = b[0];
+    if (cls < TP_POOL_CLASSES) {
+        pthread_mutex_lock(&p->lock);
+        if (p->count[cls] < TP_POOL_KEEP) {
+            *(void **)b = p->free[cls];
+            p->free[cls] = b;
+            p->count[cls]++;
+            b = NULL;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    free(b);
+}
+
+/**
+ * @brief Release a string taken out of the tree, which may live in the arena
+ *
+ * Must be called with h->lock held, so the arena cannot be replaced meanwhile.
+ */
+static void tp_value_release(tp_handle_t *h, char *s)
+{
+    if (!h->arena || !tp_arena_owns(h->arena, s)) {
+        tp_value_free(h, s);
+    }
+}
+
+/**
+ * @brief Free a tree, releasing pooled values first when it lives in an arena
+ *
+ * @param h Handle the tree belongs to
+ * @param root Tree to free
+ * @param arena Arena backing the tree, or NULL for a heap tree
+ * @param idx Index of the tree, used to find pooled values
+ */
+static void tp_tree_free(tp_handle_t *h, cJSON *root, struct tp_arena *arena, struct tp_index *idx)
+{
+    if (!root) {
+        return;
+    }
+    if (!arena) {
+        cJSON_Delete(root);
+        return;
+    }
+
+    for (size_t i = 0; idx && i <= idx->mask; i++) {
+        cJSON *n = idx->slots[i].node;
+        if (idx->slots[i].path && (n->type & 0xFF) == cJSON_String && !tp_arena_owns(arena, n->valuestring)) {
+            tp_value_free(h, n->valuestring);
+        }
+    }
+    free(root);
+    tp_arena_destroy(arena);
+}
+
+struct tp_watch {
+    char *prefix;           // Key or dotted prefix the watch matches
+    size_t len;             // Length of prefix
+    tp_watch_cb cb;         // Callback, NULL once removed during a dispatch
+    void *ctx;              // Caller context passed to cb
+    struct tp_watch *next;  // Next registered watch
+};
+
+typedef struct tp_change {
+    char *key;      // Dotted path of the changed leaf
+    char *value;    // New value as text
+} tp_change_t;
+
+struct tp_changes {
+    tp_change_t *v;     // Changes in the order they were applied
+    size_t n;           // Number of changes
+    size_t cap;         // Capacity of v
+};
+
+/**
+ * @brief Format a number in the shortest form that reads back exactly, as cJSON prints numbers
+ */
+static void tp_format_num(double value, char buf[32])
+{
+    snprintf(buf, 32, "%1.15g", value);
+    if (strtod(buf, NULL) != value) {
+        snprintf(buf, 32, "%1.17g", value);
+    }
+}
+
+/**
+ * @brief Render a leaf as text without allocating
+ *
+ * @param type cJSON type of the leaf
+ * @param str String value, used for cJSON_String
+ * @param num Numeric value, used for cJSON_Number
+ * @param buf Scratch space for numbers
+ * @return const char* str, buf or a literal
+ */
+static const char *tp_leaf_text(int type, const char *str, double num, char buf[32])
+{
+    switch (type) {
+    case cJSON_String:
+        return str;
+    case cJSON_Number:
+        tp_format_num(num, buf);
+        return buf;
+    case cJSON_True:
+        return "true";
+    case cJSON_False:
+        return "false";
+    default:
+        return "null";
+    }
+}
+
+/**
+ * @brief Render the value of a leaf as text
+ *
+ * @return char* Newly allocated text, or NULL on failure
+ */
+static char *tp_value_text(cJSON *n)
+{
+    char buf[32];
+
+    return strdup(tp_leaf_text(n->type & 0xFF, n->valuestring, n->valuedouble, buf));
+}
+
+/**
+ * @brief Record that a leaf changed, for watchers to be told after the locks are dropped
+ *
+ * A NULL node records that the key was removed.
+ */
+static void tp_changes_add(struct tp_changes *c, const char *key, cJSON *n)
+{
+    if (c->n == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 8;
+        tp_change_t *v = (tp_change_t *)realloc(c->v, cap * sizeof(tp_change_t));
+        if (!v) {
+            AML_LOGE("Memory allocation failed for change of %s\n", key);
+            return;
+        }
+        c->v = v;
+        c->cap = cap;
+    }
+
+    tp_change_t *ch = &c->v[c->n];
+    ch->key = strdup(key);
+    ch->value = n ? tp_value_text(n) : NULL;
+    if (!ch->key || (n && !ch->value)) {
+        AML_LOGE("Memory allocation failed for change of %s\n", key);
+        free(ch->key);
+        free(ch->value);
+        return;
+    }
+    c->n++;
+}
+
+/**
+ * @brief Drop recorded changes from index from onwards
+ */
+static void tp_changes_truncate(struct tp_changes *c, size_t from)
+{
+    while (c->n > from) {
+        c->n--;
+        free(c->v[c->n].key);
+        free(c->v[c->n].value);
+    }
+    if (!c->n) {
+        free(c->v);
+        c->v = NULL;
+        c->cap = 0;
+    }
+}
+
+/**
+ * @brief Check whether any watch is registered, so writers can skip recording changes
+ */
+static int tp_watched(tp_handle_t *h)
+{
+    return __atomic_load_n(&h->watches, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/**
+ * @brief Match a key against a watch prefix
+ *
+ * A prefix matches the key itself and every key below it, the empty prefix
+ * matches all keys. Case is ignored as for lookups.
+ */
+static int tp_watch_match(const struct tp_watch *w, const char *key)
+{
+    if (!w->len) {
+        return 1;
+    }
+    return strncasecmp(key, w->prefix, w->len) == 0 && (key[w->len] == '\0' || key[w->len] == '.');
+}
+
+/**
+ * @brief Run the callbacks of matching watches, then free the changes
+ *
+ * Must be called without h->lock, h->io_lock or the shared store lock held.
+ * Callbacks run one at a time; they may call tp_set(), tp_watch() and
+ * tp_unwatch() on the same handle.
+ */
+static void tp_watch_notify(tp_handle_t *h, struct tp_changes *c)
+{
+    if (!c->n) {
+        return;
+    }
+
+    pthread_mutex_lock(&h->watch_lock);
+    h->watch_depth++;
+    for (size_t i = 0; i < c->n; i++) {
+        for (struct tp_watch *w = h->watches; w; w = w->next) {
+            if (w->cb && tp_watch_match(w, c->v[i].key)) {
+                w->cb(h, c->v[i].key, c->v[i].value, w->ctx);
+            }
+        }
+    }
+
+    // Watches removed by a callback are unlinked once no dispatch walks the list
+    if (--h->watch_depth == 0) {
+        struct tp_watch **pp = &h->watches;
+        while (*pp) {
+            struct tp_watch *w = *pp;
+            if (w->cb) {
+                pp = &w->next;
+                continue;
+            }
+            __atomic_store_n(pp, w->next, __ATOMIC_RELEASE);
+            free(w->prefix);
+            free(w);
+        }
+    }
+    pthread_mutex_unlock(&h->watch_lock);
+    tp_changes_truncate(c, 0);
+}
+
+/*
+ * Shared-memory store layout, in host byte order since it never leaves the machine:
+ *
+ *   struct tp_shm          header and the process-shared writer lock
+ *   uint32_t buckets[]     open-addressing table of slot numbers plus one
+ *   struct tp_shm_slot[]   one seqlocked value per leaf
+ *   char keys[]            NUL-terminated dotted paths
+ *
+ * The key set is fixed when the segment is created, only values change.
+ */
+#define TP_SHM_MAGIC 0x314d5354u // "TSM1"
+#define TP_SHM_VERSION 1
+#define TP_SHM_VALUE 256         // Capacity of a string value in a slot, including the NUL
+
+struct tp_shm {
+    uint32_t magic;         // Stored last by the creator, segment is ready once set
+    uint32_t version;       // TP_SHM_VERSION
+    uint32_t count;         // Number of slots
+    uint32_t mask;          // Bucket count minus one, a power of two
+    uint32_t buckets_off;   // Offset of the bucket table
+    uint32_t slots_off;     // Offset of the slot array
+    uint32_t keys_off;      // Offset of the key strings
+    uint32_t wseq;          // Bumped after every write batch, lets idle writers skip a sync
+    pthread_mutex_t lock;   // Robust process-shared lock serializing writers and the file
+};
+
+struct tp_shm_value {
+    int32_t type;               // cJSON type of the leaf
+    int32_t vflags;             // TP_VAL_* flags
+    int32_t bval;               // Native boolean value, valid with TP_VAL_BOOL
+    uint32_t len;               // Length of str
+    double num;                 // Native numeric value, valid with TP_VAL_NUM
+    char str[TP_SHM_VALUE];     // String value, empty for non-string leaves
+};
+
+struct tp_shm_slot {
+    uint32_t seq;               // Odd while a writer is updating the value
+    uint32_t key_off;           // Offset of the key, relative to keys_off
+    struct tp_shm_value v;      // Value, read under the sequence
+};
+
+static struct tp_shm_slot *tp_shm_slots(struct tp_shm *s)
+{
+    return (struct tp_shm_slot *)((char *)s + s->slots_off);
+}
+
+/**
+ * @brief Copy a slot value without locking, retrying while a writer is active
+ */
+static void tp_shm_read(struct tp_shm_slot *slot, struct tp_shm_value *out)
+{
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(out, &slot->v, offsetof(struct tp_shm_value, str));
+        size_t len = out->len < TP_SHM_VALUE ? out->len : TP_SHM_VALUE - 1;
+        memcpy(out->str, slot->v.str, len);
+        out->str[len] = '\0';
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Store the current value of an entry into its slot
+ *
+ * Must be called with the segment lock held.
+ */
+static void tp_shm_write(struct tp_shm *s, tp_entry_t *e)
+{
+    struct tp_shm_slot *slot = &tp_shm_slots(s)[e->shm_slot - 1];
+    cJSON *n = e->node;
+    uint32_t seq = slot->seq;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->v.type = n->type & 0xFF;
+    slot->v.vflags = e->vflags;
+    slot->v.bval = e->bval;
+    slot->v.num = e->num;
+    slot->v.len = 0;
+    if (slot->v.type == cJSON_String) {
+        slot->v.len = (uint32_t)strlen(n->valuestring);
+        memcpy(slot->v.str, n->valuestring, slot->v.len + 1);
+    }
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    e->shm_seq = seq + 2;
+}
+
+/**
+ * @brief Bring the private tree up to date with the segment
+ *
+ * Must be called with the segment lock held, so no slot is mid-update.
+ *
+ * @param h Handle with a shared store
+ * @param c Receives the changed keys, or NULL
+ * @return int 0 on success, -1 if a value could not be copied
+ */
+static int tp_shm_pull(tp_handle_t *h, struct tp_changes *c)
+{
+    struct tp_shm *s = h->shm;
+    struct tp_shm_slot *slots = tp_shm_slots(s);
+    int ret = 0;
+
+    if (s->wseq == h->shm_wseq) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&h->lock);
+    // The writer rewrote the file, whatever spans were taken no longer apply
+    tp_inplace_clear(h);
+    for (size_t i = 0; i <= h->index->mask; i++) {
+        tp_entry_t *e = &h->index->slots[i];
+        if (!e->path || !e->shm_slot || slots[e->shm_slot - 1].seq == e->shm_seq) {
+            continue;
+        }
+
+        struct tp_shm_slot *slot = &slots[e->shm_slot - 1];
+        cJSON *n = e->node;
+        switch (slot->v.type) {
+        case cJSON_String: {
+            char *str = tp_value_dup(h, slot->v.str);
+            if (!str) {
+                AML_LOGE("Memory allocation failed for value\n");
+                ret = -1;
+                continue;
+            }
+            if ((n->type & 0xFF) == cJSON_String) {
+                tp_value_release(h, n->valuestring);
+            }
+            n->type = (n->type & ~0xFF) | cJSON_String;
+            n->valuestring = str;
+            break;
+        }
+        case cJSON_Number:
+            cJSON_SetNumberHelper(n, slot->v.num);
+            break;
+        default:
+            n->type = (n->type & ~0xFF) | (slot->v.bval ? cJSON_True : cJSON_False);
+            break;
+        }
+        tp_entry_cache(e);
+        e->shm_seq = slot->seq;
+        if (c) {
+            tp_changes_add(c, e->path, n);
+        }
+    }
+    if (ret == 0) {
+        h->shm_wseq = s->wseq;
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return ret;
+}
+
+/**
+ * @brief Take the segment writer lock, recovering it from a crashed owner
+ */
+static void tp_shm_lock(tp_handle_t *h)
+{
+    struct tp_shm *s = h->shm;
+
+    if (pthread_mutex_lock(&s->lock) == EOWNERDEAD) {
+        // Release slots the dead writer left odd, their content may be torn
+        AML_LOGE("Recovering shared store of %s from a crashed writer\n", h->filename);
+        struct tp_shm_slot *slots = tp_shm_slots(s);
+        for (uint32_t i = 0; i < s->count; i++) {
+            if (slots[i].seq & 1) {
+                __atomic_store_n(&slots[i].seq, slots[i].seq + 1, __ATOMIC_RELEASE);
+            }
+        }
+        s->wseq++;
+        pthread_mutex_consistent(&s->lock);
+    }
+}
+
+static void tp_shm_unlock(tp_handle_t *h)
+{
+    pthread_mutex_unlock(&h->shm->lock);
+}
+
+/**
+ * @brief Find the slot of a key in the segment's bucket table
+ *
+ * @return uint32_t Slot number plus one, or 0 if the key is not in the segment
+ */
+static uint32_t tp_shm_find(struct tp_shm *s, size_t size, const char *path, uint32_t hash)
+{
+    const uint32_t *buckets = (const uint32_t *)((char *)s + s->buckets_off);
+
+    for (uint32_t i = hash & s->mask, probes = 0; probes <= s->mask; i = (i + 1) & s->mask, probes++) {
+        uint32_t b = buckets[i];
+        if (!b || b > s->count) {
+            return 0;
+        }
+        // Bounds-check the key, the segment is trusted no more than a file
+        size_t off = s->keys_off + (size_t)tp_shm_slots(s)[b - 1].key_off;
+        const char *k = (const char *)s + off;
+        if (off < size && strnlen(k, size - off) < size - off && strcasecmp(k, path) == 0) {
+            return b;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Lay out and fill a new segment from the parsed tree
+ *
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_shm_create(tp_handle_t *h, int fd)
+{
+    struct tp_index *idx = h->index;
+    size_t keys_len = 0;
+    uint32_t buckets = 1;
+
+    for (size_t i = 0; i <= idx->mask; i++) {
+        tp_entry_t *e = &idx->slots[i];
+        if (!e->path) {
+            continue;
+        }
+        if ((e->node->type & 0xFF) == cJSON_String && strlen(e->node->valuestring) >= TP_SHM_VALUE) {
+            AML_LOGE("Value of %s is too long for the shared store\n", e->path);
+            return -1;
+        }
+        keys_len += strlen(e->path) + 1;
+    }
+    while (buckets < idx->count * 2) {
+        buckets <<= 1;
+    }
+
+    size_t buckets_off = (sizeof(struct tp_shm) + 7) & ~(size_t)7;
+    size_t slots_off = (buckets_off + buckets * sizeof(uint32_t) + 7) & ~(size_t)7;
+    size_t keys_off = slots_off + idx->count * sizeof(struct tp_shm_slot);
+    size_t size = keys_off + keys_len;
+    if (size > UINT32_MAX) {
+        AML_LOGE("Parameter file %s too large for the shared store\n", h->filename);
+        return -1;
+    }
+    // Drop whatever a crashed creator left, so the segment starts zero-filled
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)size) != 0) {
+        AML_LOGE("Failed to size shared store: %s\n", strerror(errno));
+        return -1;
+    }
+    struct tp_shm *s = (struct tp_shm *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s == MAP_FAILED) {
+        AML_LOGE("Failed to map shared store: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // ftruncate() zero-filled the segment, so empty buckets and even sequences need no setup
+    s->version = TP_SHM_VERSION;
+    s->count = (uint32_t)idx->count;
+    s->mask = buckets - 1;
+    s->buckets_off = (uint32_t)buckets_off;
+    s->slots_off = (uint32_t)slots_off;
+    s->keys_off = (uint32_t)keys_off;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int err = pthread_mutex_init(&s->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (err != 0) {
+        AML_LOGE("Failed to initialize shared store lock: %s\n", strerror(err));
+        munmap(s, size);
+        return -1;
+    }
+
+    uint32_t *table = (uint32_t *)((char *)s + buckets_off);
+    struct tp_shm_slot *slots = tp_shm_slots(s);
+    size_t key_pos = 0;
+    uint32_t n = 0;
+    for (size_t i = 0; i <= idx->mask; i++) {
+        tp_entry_t *e = &idx->slots[i];
+        if (!e->path) {
+            continue;
+        }
+        size_t klen = strlen(e->path);
+        memcpy((char *)s + keys_off + key_pos, e->path, klen + 1);
+        slots[n].key_off = (uint32_t)key_pos;
+        key_pos += klen + 1;
+
+        uint32_t b = e->hash & s->mask;
+        while (table[b]) {
+            b = (b + 1) & s->mask;
+        }
+        table[b] = ++n;
+        e->shm_slot = n;
+        tp_shm_write(s, e);
+    }
+
+    h->shm = s;
+    h->shm_size = size;
+    __atomic_store_n(&s->magic, TP_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Map a segment created by another process and bind the tree to its slots
+ *
+ * Must be called with the flock of the segment held, so no creator is
+ * filling it at the same time.
+ *
+ * @return int 0 on success, 1 if the segment was never completed, -1 on failure
+ */
+static int tp_shm_attach(tp_handle_t *h, int fd)
+{
+    struct stat st;
+    struct tp_shm *s = NULL;
+
+    if (fstat(fd, &st) != 0) {
+        AML_LOGE("Failed to stat shared store: %s\n", strerror(errno));
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct tp_shm)) {
+        return 1;
+    }
+    s = (struct tp_shm *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s == MAP_FAILED) {
+        AML_LOGE("Failed to map shared store: %s\n", strerror(errno));
+        return -1;
+    }
+    if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != TP_SHM_MAGIC) {
+        munmap(s, st.st_size);
+        return 1;
+    }
+    size_t size = st.st_size;
+    if (s->version != TP_SHM_VERSION || s->slots_off > size ||
+        s->count > (size - s->slots_off) / sizeof(struct tp_shm_slot) ||
+        s->keys_off > size || s->buckets_off + ((size_t)s->mask + 1) * sizeof(uint32_t) > s->slots_off) {
+        AML_LOGE("Shared store of %s is incompatible\n", h->filename);
+        goto fail;
+    }
+
+    // A key the segment does not know would silently stay private to this process
+    for (size_t i = 0; i <= h->index->mask; i++) {
+        tp_entry_t *e = &h->index->slots[i];
+        if (!e->path) {
+            continue;
+        }
+        e->shm_slot = tp_shm_find(s, size, e->path, e->hash);
+        e->shm_seq = e->shm_slot ? UINT32_MAX : 0;
+        if (!e->shm_slot) {
+            AML_LOGE("Key %s of %s is not in its shared store, remove the segment after changing the key set\n",
+                     e->path, h->filename);
+            goto fail;
+        }
+    }
+    h->shm = s;
+    h->shm_size = size;
+    h->shm_wseq = s->wseq - 1;
+
+    tp_shm_lock(h);
+    int ret = tp_shm_pull(h, NULL);
+    tp_shm_unlock(h);
+    if (ret != 0) {
+        h->shm = NULL;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (s) {
+        munmap(s, st.st_size);
+    }
+    return -1;
+}
+
+/**
+ * @brief Create or attach to the shared-memory store of a parameter file
+ *
+ * @param h Handle with the tree parsed and indexed
+ * @param name shm_open() name, or NULL to derive one from the file's real path
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_shm_open(tp_handle_t *h, const char *name)
+{
+    char buf[32];
+
+    if (!name) {
+        char *real = realpath(h->filename, NULL);
+        const char *p = real ? real : h->filename;
+        uint32_t hash = 2166136261u;
+        for (; *p; p++) {
+            hash = (hash ^ (unsigned char)*p) * 16777619u;
+        }
+        free(real);
+        snprintf(buf, sizeof(buf), "/tinyparam.%08x", hash);
+        name = buf;
+    }
+
+    // The segment is as accessible as the file it mirrors, never more
+    struct stat st;
+    mode_t mode = stat(h->filename, &st) == 0 ? (st.st_mode & 0666) : 0600;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, mode);
+    if (fd < 0) {
+        AML_LOGE("Failed to open shared store %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    // Whoever holds the lock and finds no finished segment builds it, so one
+    // left half-made by a crashed creator is rebuilt instead of waited on
+    if (flock(fd, LOCK_EX) != 0) {
+        AML_LOGE("Failed to lock shared store %s: %s\n", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int ret = tp_shm_attach(h, fd);
+    if (ret > 0) {
+        ret = tp_shm_create(h, fd);
+    }
+    // The mapping keeps the open file alive, so closing alone would not unlock
+    flock(fd, LOCK_UN);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Read a key from the shared store
+ *
+ * @param h Handle to the JSON file
+ * @param e Entry of the key, resolved under h->lock
+ * @param v Receives the value
+ * @return int 1 if the value came from the store, 0 if the key is private to this process
+ */
+static int tp_shm_get(tp_handle_t *h, tp_entry_t *e, struct tp_shm_value *v)
+{
+    if (!h->shm || !e || !e->shm_slot) {
+        return 0;
+    }
+    tp_shm_read(&tp_shm_slots(h->shm)[e->shm_slot - 1], v);
+    return 1;
+}
+
+/**
+ * @brief Deliver changes made by other processes to the watches of a handle
+ *
+ * Every write replaces the file by rename, so a close-after-write or a move
+ * onto the file's name in its directory signals a change from any process.
+ */
+static void *tp_notifier(void *arg)
+{
+    tp_handle_t *h = (tp_handle_t *)arg;
+    const char *base = strrchr(h->filename, '/');
+    base = base ? base + 1 : h->filename;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = h->inotify_fd, .events = POLLIN },
+        { .fd = h->notify_pipe[0], .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AML_LOGE("Failed to wait for changes of %s: %s\n", h->filename, strerror(errno));
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+
+        ssize_t len = read(h->inotify_fd, buf, sizeof(buf));
+        int changed = 0;
+        for (ssize_t off = 0; off < len;) {
+            struct inotify_event *ev = (struct inotify_event *)(buf + off);
+            if (ev->len && strcmp(ev->name, base) == 0) {
+                changed = 1;
+            }
+            off += sizeof(struct inotify_event) + ev->len;
+        }
+        if (!changed) {
+            continue;
+        }
+
+        if (h->shm) {
+            struct tp_changes c = { 0 };
+            tp_shm_lock(h);
+            tp_shm_pull(h, &c);
+            tp_shm_unlock(h);
+            tp_watch_notify(h, &c);
+        } else {
+            tp_reload(h);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start watching the file for changes made by other processes
+ *
+ * Must be called with h->watch_lock held.
+ *
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_notifier_init(tp_handle_t *h)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(h->filename, '/');
+
+    if (!slash) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash == h->filename ? 1 : slash - h->filename), h->filename);
+    }
+
+    h->inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (h->inotify_fd < 0) {
+        AML_LOGE("Failed to initialize inotify: %s\n", strerror(errno));
+        return -1;
+    }
+    if (inotify_add_watch(h->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        AML_LOGE("Failed to watch %s: %s\n", dir, strerror(errno));
+        goto fail;
+    }
+    if (pipe(h->notify_pipe) != 0) {
+        AML_LOGE("Failed to create notifier pipe: %s\n", strerror(errno));
+        goto fail;
+    }
+    if (pthread_create(&h->notifier, NULL, tp_notifier, h) != 0) {
+        AML_LOGE("Failed to start notifier thread\n");
+        close(h->notify_pipe[0]);
+        close(h->notify_pipe[1]);
+        goto fail;
+    }
+    h->notifier_running = 1;
+    return 0;
+
+fail:
+    close(h->inotify_fd);
+    h->inotify_fd = -1;
+    return -1;
+}
+
+/**
+ * @brief Stop the notifier thread and free all watches
+ */
+static void tp_watch_fini(tp_handle_t *h)
+{
+    if (h->notifier_running) {
+        char c = 0;
+        if (write(h->notify_pipe[1], &c, 1) != 1) {
+            AML_LOGE("Failed to wake notifier thread\n");
+        }
+        pthread_join(h->notifier, NULL);
+        close(h->notify_pipe[0]);
+        close(h->notify_pipe[1]);
+        close(h->inotify_fd);
+    }
+    while (h->watches) {
+        struct tp_watch *w = h->watches;
+        h->watches = w->next;
+        free(w->prefix);
+        free(w);
+    }
+    pthread_mutex_destroy(&h->watch_lock);
+}
+
+/*
+ * Compiled image layout, all integers little-endian:
+ *
+ *   header: u32 magic  u32 version  u32 count  u32 table_off  u32 blob_off  u32 blob_len  u32 reserved[2]
+ *   table:  count x { u32 key_off  u32 key_len  u32 val_off  u32 val_len  u32 type  u32 vflags  f64 num }
+ *           sorted by case-folded key
+ *   blob:   NUL-terminated keys and string values, offsets are relative to blob_off
+ *
+ * Only string leaves carry a value in the blob, other leaves answer typed reads.
+ */
+#define TP_IMAGE_MAGIC 0x31425054u // "TPB1"
+#define TP_IMAGE_VERSION 1
+#define TP_IMAGE_HDR 32
+#define TP_IMAGE_ENTRY 32
+
+typedef struct tp_image_entry {
+    const char *key;    // Key inside the mapping
+    const char *value;  // String value inside the mapping, NULL for other leaves
+    int type;           // cJSON type of the leaf
+    int vflags;         // TP_VAL_* flags
+    double num;         // Native value, valid with TP_VAL_NUM
+} tp_image_entry_t;
+
+static uint32_t tp_image_u32(tp_handle_t *h, size_t off)
+{
+    return tp_get_u32(h->image + off);
+}
+
+/**
+ * @brief Return a NUL-terminated string inside the blob, or NULL if out of bounds
+ */
+static const char *tp_image_str(tp_handle_t *h, uint32_t off, uint32_t len)
+{
+    size_t blob = tp_image_u32(h, 16);
+    size_t blob_len = tp_image_u32(h, 20);
+    if ((size_t)off + len >= blob_len || h->image[blob + off + len] != '\0') {
+        return NULL;
+    }
+    return (const char *)h->image + blob + off;
+}
+
+/**
+ * @brief Decode table entry i of a mapped image
+ *
+ * @return int 0 on success, -1 if the entry is corrupt
+ */
+static int tp_image_decode(tp_handle_t *h, uint32_t i, tp_image_entry_t *out)
+{
+    size_t off = tp_image_u32(h, 12) + (size_t)i * TP_IMAGE_ENTRY;
+    out->key = tp_image_str(h, tp_image_u32(h, off), tp_image_u32(h, off + 4));
+    if (!out->key) {
+        return -1;
+    }
+
+    out->value = NULL;
+    out->type = (int)tp_image_u32(h, off + 16);
+    if (out->type == cJSON_String) {
+        out->value = tp_image_str(h, tp_image_u32(h, off + 8), tp_image_u32(h, off + 12));
+        if (!out->value) {
+            return -1;
+        }
+    }
+    out->vflags = (int)tp_image_u32(h, off + 20);
+
+    uint64_t bits = (uint64_t)tp_image_u32(h, off + 24) | ((uint64_t)tp_image_u32(h, off + 28) << 32);
+    memcpy(&out->num, &bits, sizeof(out->num));
+    return 0;
+}
+
+/**
+ * @brief Binary-search the key table of a mapped image
+ *
+ * @return long Table index, or -1 if not found
+ */
+static long tp_image_search(tp_handle_t *h, const char *key, tp_image_entry_t *out)
+{
+    uint32_t lo = 0;
+    uint32_t hi = tp_image_u32(h, 8);
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (tp_image_decode(h, mid, out) != 0) {
+            AML_LOGE("Corrupt entry %u in image %s\n", mid, h->filename);
+            return -1;
+        }
+        int cmp = strcasecmp(key, out->key);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Look a key up in the image key table, a miss is not logged
+ *
+ * @return long Table index, or -1 if not found
+ */
+static long tp_image_probe(tp_handle_t *h, const char *key, tp_image_entry_t *out)
+{
+    long i;
+
+    TP_STAT_TIMED(h, lookup, i = tp_image_search(h, key, out));
+    if (i < 0) {
+        TP_STAT_ADD(h, misses, 1);
+    }
+    return i;
+}
+
+/**
+ * @brief Look a key up in the image key table, see tp_image_search()
+ *
+ * @return long Table index, or -1 if not found
+ */
+static long tp_image_find(tp_handle_t *h, const char *key, tp_image_entry_t *out)
+{
+    long i = tp_image_probe(h, key, out);
+    if (i < 0) {
+        AML_LOGE("Key not found: %s\n", key);
+    }
+    return i;
+}
+
+/**
+ * @brief Build the miss filter of a mapped image from its key table
+ */
+static void tp_image_bloom(tp_handle_t *h)
+{
+    uint32_t count = tp_image_u32(h, 8);
+    struct tp_bloom *b = tp_bloom_create(count);
+    tp_image_entry_t ie;
+
+    for (uint32_t i = 0; b && i < count; i++) {
+        if (tp_image_decode(h, i, &ie) != 0) {
+            // A corrupt table must not hide keys that decode fine
+            free(b);
+            return;
+        }
+        tp_bloom_add(b, ie.key);
+    }
+    tp_bloom_publish(h, b);
+}
+
+/**
+ * @brief Map a compiled image if the file is one
+ *
+ * @param h Handle with filename set
+ * @return int 1 if an image was mapped, 0 if the file is not an image, -1 on failure
+ */
+static int tp_image_open(tp_handle_t *h)
+{
+    unsigned char magic[4];
+    struct stat st;
+
+    int fd = open(h->filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        AML_LOGE("Failed to open file %s: %s\n", h->filename, strerror(errno));
+        return -1;
+    }
+    if (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+        tp_get_u32(magic) != TP_IMAGE_MAGIC) {
+        close(fd);
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < TP_IMAGE_HDR) {
+        AML_LOGE("Image %s is truncated\n", h->filename);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        AML_LOGE("Failed to map image %s: %s\n", h->filename, strerror(errno));
+        return -1;
+    }
+    h->image = (const unsigned char *)map;
+    h->image_size = st.st_size;
+
+    // Check the section bounds once, entries are checked as they are read
+    size_t count = tp_image_u32(h, 8);
+    size_t table = tp_image_u32(h, 12);
+    size_t blob = tp_image_u32(h, 16);
+    size_t blob_len = tp_image_u32(h, 20);
+    if (tp_image_u32(h, 4) != TP_IMAGE_VERSION || table < TP_IMAGE_HDR ||
+        count > (h->image_size - table) / TP_IMAGE_ENTRY || blob > h->image_size ||
+        blob_len > h->image_size - blob) {
+        AML_LOGE("Image %s has an invalid header\n", h->filename);
+        munmap(map, h->image_size);
+        h->image = NULL;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Order index entries by case-folded path for the image key table
+ */
+static int tp_image_cmp(const void *a, const void *b)
+{
+    const tp_entry_t *x = *(const tp_entry_t * const *)a;
+    const tp_entry_t *y = *(const tp_entry_t * const *)b;
+    return strcasecmp(x->path, y->path);
+}
+
+/**
+ * @brief 64-bit FNV-1a hash of file content, to tell real edits from touches
+ */
+static uint64_t tp_content_hash(const unsigned char *p, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull;
+    while (len--) {
+        hash = (hash ^ *p++) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * @brief Record the size, mtime and content hash of a file the tree matches
+ */
+static void tp_file_state_set(tp_handle_t *h, const struct stat *st, const unsigned char *p, size_t len)
+{
+    h->file_mtime = st->st_mtim;
+    h->file_size = st->st_size;
+    h->file_dev = st->st_dev;
+    h->file_ino = st->st_ino;
+    h->file_hash = tp_content_hash(p, len);
+}
+
+/**
+ * @brief Check that a file is still the one the recorded state describes
+ *
+ * Compares identity, size and mtime only, the content is not read.
+ */
+static int tp_file_state_match(const tp_handle_t *h, const struct stat *st)
+{
+    return h->file_size >= 0 && st->st_size == h->file_size && st->st_dev == h->file_dev &&
+           st->st_ino == h->file_ino && st->st_mtim.tv_sec == h->file_mtime.tv_sec &&
+           st->st_mtim.tv_nsec == h->file_mtime.tv_nsec;
+}
+
+/*
+ * In-place value rewriting (TP_OPEN_INPLACE)
+ *
+ * The file text is scanned for the byte range of every leaf value, in the
+ * same document order the index is built in. A range is only kept when it
+ * holds exactly the JSON token of the node's current value. Every write
+ * first checks that the file still has the inode, size and mtime recorded
+ * when the spans were taken, and spans are dropped when another process
+ * writes through the shared store, so a file that changed under us can never
+ * direct a write to the wrong bytes.
+ */
+#define TP_INPLACE_MAX 256 // Longest value token rewritten in place
+
+struct tp_span {
+    size_t off;     // Offset of the value token
+    uint32_t len;   // Token plus trailing blanks
+    uint32_t tok;   // Token length
+};
+
+struct tp_spans {
+    struct tp_span *v;  // Spans in document order
+    size_t n;           // Number of spans
+    size_t cap;         // Capacity of v
+};
+
+static const char *tp_scan_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static const char *tp_scan_string(const char *p, const char *end)
+{
+    for (p = tp_find_quote(p + 1, end); p < end; p = tp_find_quote(p + 2, end)) {
+        if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Skip one JSON value without interpreting it
+ *
+ * @return const char* Position after the value, or NULL if it is malformed
+ */
+static const char *tp_scan_value(const char *p, const char *end)
+{
+    if (p >= end) {
+        return NULL;
+    }
+    if (*p == '"') {
+        return tp_scan_string(p, end);
+    }
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while ((p = tp_find_structural(p, end)) < end) {
+            if (*p == '"') {
+                if (!(p = tp_scan_string(p, end))) {
+                    return NULL;
+                }
+                continue;
+            }
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if ((*p == '}' || *p == ']') && --depth == 0) {
+                return p + 1;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    while (p < end && *p != ',' && *p != ']' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\n' &&
+           *p != '\r') {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * @brief Record the span of every leaf of an object, recursing like tp_index_add()
+ *
+ * @return const char* Position after the object, or NULL if it is malformed
+ */
+static const char *tp_scan_object(const char *text, const char *p, const char *end, struct tp_spans *s)
+{
+    for (p++;;) {
+        p = tp_scan_ws(p, end);
+        if (p < end && *p == '}') {
+            return p + 1;
+        }
+        if (p >= end || *p != '"' || !(p = tp_scan_string(p, end))) {
+            return NULL;
+        }
+        p = tp_scan_ws(p, end);
+        if (p >= end || *p != ':') {
+            return NULL;
+        }
+        p = tp_scan_ws(p + 1, end);
+
+        if (p < end && *p == '{') {
+            p = tp_scan_object(text, p, end, s);
+        } else {
+            const char *start = p;
+            if (!(p = tp_scan_value(p, end))) {
+                return NULL;
+            }
+            size_t tok = p - start;
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            if (s->n == s->cap) {
+                size_t cap = s->cap ? s->cap * 2 : 64;
+                struct tp_span *v = (struct tp_span *)realloc(s->v, cap * sizeof(struct tp_span));
+                if (!v) {
+                    return NULL;
+                }
+                s->v = v;
+                s->cap = cap;
+            }
+            s->v[s->n].off = start - text;
+            s->v[s->n].len = (uint32_t)(p - start);
+            s->v[s->n].tok = (uint32_t)tok;
+            s->n++;
+        }
+        if (!p) {
+            return NULL;
+        }
+
+        p = tp_scan_ws(p, end);
+        if (p < end && *p == ',') {
+            p++;
+        } else if (p < end && *p == '}') {
+            return p + 1;
+        } else {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Render the JSON token of a string, number or boolean leaf as cJSON prints it
+ *
+ * @return int Token length, or -1 if the leaf has no such token or it does not fit
+ */
+static int tp_value_token(cJSON *n, char *buf, size_t cap)
+{
+    size_t len = 0;
+
+    switch (n->type & 0xFF) {
+    case cJSON_String:
+        buf[len++] = '"';
+        for (const unsigned char *p = (const unsigned char *)n->valuestring; *p; p++) {
+            if (len + 7 > cap) {
+                return -1;
+            }
+            const char *esc = NULL;
+            switch (*p) {
+            case '"': esc = "\\\""; break;
+            case '\\': esc = "\\\\"; break;
+            case '\b': esc = "\\b"; break;
+            case '\f': esc = "\\f"; break;
+            case '\n': esc = "\\n"; break;
+            case '\r': esc = "\\r"; break;
+            case '\t': esc = "\\t"; break;
+            default: break;
+            }
+            if (esc) {
+                buf[len++] = esc[0];
+                buf[len++] = esc[1];
+            } else if (*p < 32) {
+                len += snprintf(buf + len, cap - len, "\\u%04x", *p);
+            } else {
+                buf[len++] = *p;
+            }
+        }
+        if (len + 1 > cap) {
+            return -1;
+        }
+        buf[len++] = '"';
+        return (int)len;
+    case cJSON_Number:
+        if (n->valuedouble != n->valuedouble || n->valuedouble - n->valuedouble != 0) {
+            return -1;
+        }
+        // cJSON prints integral values with "%d", which also turns -0 into 0
+        if (n->valuedouble == (double)n->valueint) {
+            return snprintf(buf, cap, "%d", n->valueint);
+        }
+        tp_format_num(n->valuedouble, buf);
+        return (int)strlen(buf);
+    case cJSON_True:
+        memcpy(buf, "true", 4);
+        return 4;
+    case cJSON_False:
+        memcpy(buf, "false", 5);
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief Locate every leaf value of the file text that matches the tree
+ *
+ * Must be called with h->io_lock held. Takes h->lock for reading to compare
+ * the spans against the current values.
+ *
+ * @param h Handle opened with TP_OPEN_INPLACE
+ * @param text File content
+ * @param len Length of text
+ */
+static void tp_inplace_map(tp_handle_t *h, const char *text, size_t len)
+{
+    struct tp_spans s = { 0 };
+    const char *end = text + len;
+    const char *p = text;
+    char tok[TP_INPLACE_MAX];
+
+    if (len >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) {
+        p += 3;
+    }
+    p = tp_scan_ws(p, end);
+    if (p >= end || *p != '{' || !tp_scan_object(text, p, end, &s)) {
+        s.n = 0;
+    }
+
+    pthread_rwlock_rdlock(&h->lock);
+    struct tp_index *idx = h->index;
+    if (s.n != idx->leaves) {
+        s.n = 0;
+    }
+    for (size_t i = 0; i <= idx->mask; i++) {
+        tp_entry_t *e = &idx->slots[i];
+        if (!e->path) {
+            continue;
+        }
+        e->slot_len = 0;
+        if (e->ord < s.n) {
+            struct tp_span *sp = &s.v[e->ord];
+            int n = tp_value_token(e->node, tok, sizeof(tok));
+            if (n > 0 && (uint32_t)n == sp->tok && memcmp(text + sp->off, tok, n) == 0) {
+                e->slot_off = sp->off;
+                e->slot_len = sp->len;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&h->lock);
+    free(s.v);
+}
+
+/**
+ * @brief Forget every span, so the next write rewrites the whole file
+ *
+ * Must be called with h->io_lock or, on a shared store, the segment lock held.
+ */
+static void tp_inplace_clear(tp_handle_t *h)
+{
+    struct tp_index *idx = h->index;
+
+    for (size_t i = 0; idx && i <= idx->mask; i++) {
+        idx->slots[i].slot_len = 0;
+    }
+}
+
+/**
+ * @brief Map the file and locate its leaf values, see tp_inplace_map()
+ *
+ * Must be called with h->io_lock held.
+ */
+static void tp_inplace_scan(tp_handle_t *h)
+{
+    struct stat st;
+    int fd = open(h->filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || !tp_file_state_match(h, &st)) {
+        // Not the file the tree was read from, offsets in it mean nothing
+        close(fd);
+        pthread_rwlock_rdlock(&h->lock);
+        tp_inplace_clear(h);
+        pthread_rwlock_unlock(&h->lock);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    tp_inplace_map(h, (const char *)map, st.st_size);
+    munmap(map, st.st_size);
+}
+
+/**
+ * @brief Persist a single changed leaf by overwriting its bytes in the file
+ *
+ * The current value is written over its old slot, padded with spaces, then
+ * synced with fdatasync().
+ *
+ * @param h Handle opened with TP_OPEN_INPLACE
+ * @param e Changed entry
+ * @param wseq Batch that changed it
+ * @return int 0 if written in place, 1 if the file must be rewritten instead
+ */
+static int tp_persist_inplace(tp_handle_t *h, tp_entry_t *e, unsigned long wseq)
+{
+    char tok[TP_INPLACE_MAX];
+    int ret = 1;
+
+    TP_STAT_TIMED(h, lock_wait, pthread_mutex_lock(&h->io_lock));
+    if (!e->slot_len || e->slot_len > sizeof(tok)) {
+        goto out;
+    }
+    pthread_rwlock_rdlock(&h->lock);
+    int n = tp_value_token(e->node, tok, sizeof(tok));
+    pthread_rwlock_unlock(&h->lock);
+    if (n < 0 || (uint32_t)n > e->slot_len) {
+        goto out;
+    }
+    memset(tok + n, ' ', e->slot_len - n);
+
+    int fd = open(h->filename, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        AML_LOGE("Failed to open %s for in-place write: %s\n", h->filename, strerror(errno));
+        goto out;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !tp_file_state_match(h, &st)) {
+        // Replaced or edited since the spans were taken, rewrite it whole
+        close(fd);
+        goto out;
+    }
+    TP_STAT_START(write_start);
+    if (pwrite(fd, tok, e->slot_len, (off_t)e->slot_off) != (ssize_t)e->slot_len || fdatasync(fd) != 0 ||
+        fstat(fd, &st) != 0) {
+        // The full rewrite that follows replaces whatever reached the file
+        AML_LOGE("Failed to write %s in place: %s\n", e->path, strerror(errno));
+        close(fd);
+        goto out;
+    }
+    close(fd);
+    TP_STAT_STOP(h, write, write_start);
+    TP_STAT_ADD(h, bytes_written, e->slot_len);
+    TP_STAT_ADD(h, persists, 1);
+
+    // Same size and a new mtime; the hash is unknown until the file is read again
+    h->file_mtime = st.st_mtim;
+    h->file_size = st.st_size;
+    h->file_dev = st.st_dev;
+    h->file_ino = st.st_ino;
+    h->file_hash = 0;
+    if (h->pseq + 1 == wseq) {
+        h->pseq = wseq;
+    }
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&h->io_lock);
+    return ret;
+}
+
+/**
+ * @brief Parse a JSON file straight from its mapped pages, unless it is unchanged
+ *
+ * The file is skipped when its size and mtime match the state recorded in h,
+ * or when only the mtime differs and the content hash still matches. The
+ * mapping is released before returning, so only the tree stays resident.
+ *
+ * @param file Path to the JSON file
+ * @param h Handle whose file state is compared and updated, or NULL to always parse
+ * @param root Receives the parsed tree
+ * @param arena Receives the arena backing the tree, or NULL to parse onto the heap
+ * @return int 1 if parsed, 0 if unchanged, -1 on failure
+ */
+static int tp_read_file(const char *file, tp_handle_t *h, cJSON **root, struct tp_arena **arena)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        AML_LOGE("Failed to open file %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    // Get file size
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        AML_LOGE("Failed to get file size for %s: %s\n", file, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        AML_LOGE("File %s is empty\n", file);
+        close(fd);
+        return -1;
+    }
+    if (h && (off_t)size == h->file_size && st.st_mtim.tv_sec == h->file_mtime.tv_sec &&
+        st.st_mtim.tv_nsec == h->file_mtime.tv_nsec) {
+        close(fd);
+        return 0;
+    }
+
+    // Map file content, the descriptor is not needed once mapped
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        AML_LOGE("Failed to map file %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    int ret = 1;
+    if (h) {
+        uint64_t hash = h->file_hash;
+        off_t old_size = h->file_size;
+        tp_file_state_set(h, &st, (const unsigned char *)map, size);
+        if ((off_t)size == old_size && h->file_hash == hash) {
+            ret = 0;
+        }
+    }
+
+    // Parse JSON content, the mapping is not NUL-terminated
+    if (ret) {
+        int parser = h ? h->parser : TP_PARSER_FAST;
+        *root = arena ? tp_arena_parse((const char *)map, size, parser, arena)
+                      : tp_json_parse((const char *)map, size, parser);
+        if (!*root) {
+            AML_LOGE("Failed to parse JSON content: %s\n", cJSON_GetErrorPtr());
+            if (h) {
+                h->file_size = -1;
+            }
+            ret = -1;
+        }
+    }
+
+    munmap(map, size);
+    return ret;
+}
+
+/*
+ * Mounted files (tp_mount)
+ */
+struct tp_mount {
+    char *prefix;           // Dotted prefix the file is mounted at
+    size_t len;             // Length of prefix
+    tp_handle_t *h;         // Handle of the mounted file
+    struct tp_mount *next;  // Next mount of the same handle
+};
+
+/**
+ * @brief Find the mount serving a key and strip its prefix
+ *
+ * @param h Handle to the JSON file
+ * @param key Dotted key, advanced past the mount prefix on a match
+ * @return struct tp_mount* Mount, or NULL if the handle serves the key itself
+ */
+static struct tp_mount *tp_route(tp_handle_t *h, const char **key)
+{
+    for (struct tp_mount *m = h->mounts; m; m = m->next) {
+        if (strncasecmp(*key, m->prefix, m->len) == 0 && (*key)[m->len] == '.') {
+            *key += m->len + 1;
+            return m;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Tell whether a dotted path is exactly a mount point of the handle
+ */
+static int tp_mount_point(tp_handle_t *h, const char *path)
+{
+    for (struct tp_mount *m = h->mounts; m; m = m->next) {
+        if (strcasecmp(path, m->prefix) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse a JSON file straight from its mapped pages
+ *
+ * @param file Path to the JSON file
+ * @param h Handle to record the file state and arena in, or NULL
+ * @return cJSON* Parsed tree, or NULL on failure
+ */
+static cJSON *tp_parse_file(const char *file, tp_handle_t *h)
+{
+    cJSON *root = NULL;
+
+    if (h) {
+        h->file_size = -1;
+    }
+    return tp_read_file(file, h, &root, h && (h->flags & TP_OPEN_ARENA) ? &h->arena : NULL) > 0 ? root : NULL;
+}
+
+/*
+ * Lazy parsing (TP_OPEN_LAZY)
+ *
+ * The file stays mapped and only the members of the root object are
+ * located at open, by skipping over their text. A lookup descends through
+ * the byte ranges along its key: objects larger than TP_LAZY_CHUNK get an
+ * empty node in the tree and have their own members located when first
+ * walked, everything else is parsed with cJSON and grafted into the tree.
+ * Walks are serialized by h->lazy_lock rather than h->lock, since readers
+ * only reach the tree through the index; h->lock is taken for writing just
+ * to add the grafted leaves to the index. Keys a walk found absent are
+ * remembered, so probing an optional key parses and scans nothing the
+ * second time. Anything that needs the whole tree parses the whole file
+ * first and leaves lazy mode.
+ */
+#define TP_LAZY_CHUNK 4096 // Objects up to this size are parsed whole when first touched
+#define TP_LAZY_MISSES 64  // Keys remembered as absent, direct-mapped by hash
+
+struct tp_lazy_member;
+
+struct tp_lazy {
+    const char *text;                // Opening brace of the object in the mapping
+    const char *end;                 // Byte after its closing brace
+    cJSON *node;                     // Object in the tree the members are grafted into
+    struct tp_lazy_member *members;  // Members in document order, NULL until scanned
+    size_t n;                        // Number of members
+    int scanned;                     // Members were located
+};
+
+struct tp_lazy_member {
+    char *name;             // Unescaped member name
+    const char *val;        // Value text in the mapping
+    const char *val_end;    // Byte after the value
+    struct tp_lazy *child;  // Large object located member by member instead of parsed
+    int loaded;             // Grafted into the tree
+};
+
+struct tp_lazy_file {
+    void *map;              // Mapped file
+    size_t size;            // Size of the mapping
+    struct tp_lazy root;    // Root object
+    char *misses[TP_LAZY_MISSES]; // Keys known to be absent, guarded by h->lazy_lock
+};
+
+struct tp_lazy_graft {
+    cJSON *node;            // Member just grafted into the tree
+    char *path;             // Its dotted path
+};
+
+struct tp_lazy_grafts {
+    struct tp_lazy_graft *v; // Members grafted by one walk, in graft order
+    size_t n;               // Number of members in v
+    size_t cap;             // Capacity of v
+    int failed;             // A member could not be grafted, the walk may have missed the key
+};
+
+/**
+ * @brief Copy the name of a member from its quoted token
+ */
+static char *tp_lazy_name(const char *p, const char *end)
+{
+    if (!memchr(p, '\\', end - p)) {
+        return strndup(p + 1, end - p - 2);
+    }
+    // Let cJSON undo the escapes
+    cJSON *str = cJSON_ParseWithLength(p, end - p);
+    char *name = str && cJSON_IsString(str) ? strdup(str->valuestring) : NULL;
+    cJSON_Delete(str);
+    return name;
+}
+
+/**
+ * @brief Locate the members of a lazy object
+ *
+ * @param l Object with text set
+ * @param limit End of the text the object must fit in
+ * @return int 0 on success with l->end set, -1 if the text is malformed
+ */
+static int tp_lazy_scan(struct tp_lazy *l, const char *limit)
+{
+    const char *p = l->text + 1;
+    size_t cap = 0;
+
+    for (;;) {
+        p = tp_scan_ws(p, limit);
+        if (p < limit && *p == '}' && !l->n) {
+            break;
+        }
+        const char *name = p;
+        if (p >= limit || *p != '"' || !(p = tp_scan_string(p, limit))) {
+            return -1;
+        }
+        const char *name_end = p;
+        p = tp_scan_ws(p, limit);
+        if (p >= limit || *p != ':') {
+            return -1;
+        }
+        const char *val = tp_scan_ws(p + 1, limit);
+        if (!(p = tp_scan_value(val, limit)) || p == val) {
+            return -1;
+        }
+
+        if (l->n == cap) {
+            cap = cap ? cap * 2 : 16;
+            struct tp_lazy_member *v =
+                (struct tp_lazy_member *)realloc(l->members, cap * sizeof(struct tp_lazy_member));
+            if (!v) {
+                return -1;
+            }
+            l->members = v;
+        }
+        struct tp_lazy_member *m = &l->members[l->n];
+        memset(m, 0, sizeof(*m));
+        m->val = val;
+        m->val_end = p;
+        if (!(m->name = tp_lazy_name(name, name_end))) {
+            return -1;
+        }
+        l->n++;
+
+        p = tp_scan_ws(p, limit);
+        if (p < limit && *p == ',') {
+            p++;
+        } else if (p < limit && *p == '}') {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    l->end = p + 1;
+    l->scanned = 1;
+    return 0;
+}
+
+/**
+ * @brief Release a lazy object and everything below it, not its tree nodes
+ */
+static void tp_lazy_free(struct tp_lazy *l)
+{
+    for (size_t i = 0; i < l->n; i++) {
+        free(l->members[i].name);
+        if (l->members[i].child) {
+            tp_lazy_free(l->members[i].child);
+            free(l->members[i].child);
+        }
+    }
+    free(l->members);
+}
+
+/**
+ * @brief Release the lazy state of a handle and unmap its file
+ */
+static void tp_lazy_close(struct tp_lazy_file *lf)
+{
+    if (lf) {
+        for (size_t i = 0; i < TP_LAZY_MISSES; i++) {
+            free(lf->misses[i]);
+        }
+        tp_lazy_free(&lf->root);
+        munmap(lf->map, lf->size);
+        free(lf);
+    }
+}
+
+/**
+ * @brief Graft one member of a lazy object into the tree
+ *
+ * @return cJSON* Grafted node, or NULL on failure
+ */
+static cJSON *tp_lazy_load(struct tp_lazy *l, struct tp_lazy_member *m, int parser)
+{
+    cJSON *node;
+
+    if (*m->val == '{' && (size_t)(m->val_end - m->val) > TP_LAZY_CHUNK) {
+        m->child = (struct tp_lazy *)calloc(1, sizeof(struct tp_lazy));
+        node = m->child ? cJSON_CreateObject() : NULL;
+        if (!node) {
+            free(m->child);
+            m->child = NULL;
+            return NULL;
+        }
+        m->child->text = m->val;
+        m->child->end = m->val_end;
+        m->child->node = node;
+    } else if (!(node = tp_json_parse(m->val, m->val_end - m->val, parser))) {
+        AML_LOGE("Failed to parse JSON content of %s: %s\n", m->name, cJSON_GetErrorPtr());
+        return NULL;
+    }
+    cJSON_AddItemToObject(l->node, m->name, node);
+    m->loaded = 1;
+    return node;
+}
+
+/**
+ * @brief Remember a member a walk grafted, for adding its leaves to the index
+ */
+static void tp_lazy_record(struct tp_lazy_grafts *g, cJSON *node, const char *path)
+{
+    if (g->n == g->cap) {
+        size_t cap = g->cap ? g->cap * 2 : 8;
+        struct tp_lazy_graft *v = (struct tp_lazy_graft *)realloc(g->v, cap * sizeof(struct tp_lazy_graft));
+        if (!v) {
+            g->failed = 1;
+            return;
+        }
+        g->v = v;
+        g->cap = cap;
+    }
+    if (!(g->v[g->n].path = strdup(path))) {
+        g->failed = 1;
+        return;
+    }
+    g->v[g->n].node = node;
+    g->n++;
+}
+
+/**
+ * @brief Graft every member along a key into the tree
+ *
+ * Member names may contain dots, so every member whose name is a segment
+ * prefix of key is followed. Must be called with h->lazy_lock held.
+ *
+ * @param l Lazy object key is relative to
+ * @param key Rest of the dotted key
+ * @param path Dotted path of l, "" for the root
+ * @param parser tp_parser_t values are parsed with
+ * @param g Receives the grafted members
+ */
+static void tp_lazy_walk(struct tp_lazy *l, const char *key, const char *path, int parser,
+                         struct tp_lazy_grafts *g)
+{
+    if (!l->scanned && tp_lazy_scan(l, l->end) != 0) {
+        // Treat it as empty from now on rather than scanning it again
+        AML_LOGE("Malformed JSON object %s\n", l->node->string ? l->node->string : "at the root");
+        tp_lazy_free(l);
+        l->members = NULL;
+        l->n = 0;
+        l->scanned = 1;
+        return;
+    }
+    for (size_t i = 0; i < l->n; i++) {
+        struct tp_lazy_member *m = &l->members[i];
+        size_t len = strlen(m->name);
+        if (strncasecmp(key, m->name, len) != 0 || (key[len] && key[len] != '.')) {
+            continue;
+        }
+        if (m->loaded && !(m->child && key[len] == '.')) {
+            continue;
+        }
+        size_t plen = strlen(path);
+        char *mpath = (char *)malloc(plen + len + 2);
+        if (!mpath) {
+            g->failed = 1;
+            continue;
+        }
+        snprintf(mpath, plen + len + 2, "%s%s%s", path, plen ? "." : "", m->name);
+        if (!m->loaded) {
+            cJSON *node = tp_lazy_load(l, m, parser);
+            if (node) {
+                tp_lazy_record(g, node, mpath);
+            } else {
+                g->failed = 1;
+            }
+        }
+        if (m->child && key[len] == '.') {
+            tp_lazy_walk(m->child, key + len + 1, mpath, parser, g);
+        }
+        free(mpath);
+    }
+}
+
+/**
+ * @brief Map a file and locate the members of its root object
+ *
+ * @param file Path to the JSON file
+ * @param h Handle that gets the lazy state and file state
+ * @return cJSON* Empty root object the members are grafted into, or NULL on failure
+ */
+static cJSON *tp_lazy_open(const char *file, tp_handle_t *h)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        AML_LOGE("Failed to open file %s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        AML_LOGE("File %s is empty or cannot be read\n", file);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        AML_LOGE("Failed to map file %s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    struct tp_lazy_file *lf = (struct tp_lazy_file *)calloc(1, sizeof(struct tp_lazy_file));
+    cJSON *root = lf ? cJSON_CreateObject() : NULL;
+    if (!root) {
+        AML_LOGE("Memory allocation failed for lazy state\n");
+        free(lf);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    lf->map = map;
+    lf->size = st.st_size;
+    lf->root.node = root;
+
+    const char *end = (const char *)map + st.st_size;
+    lf->root.text = tp_scan_ws((const char *)map, end);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    if (lf->root.text >= end || *lf->root.text != '{' || tp_lazy_scan(&lf->root, end) != 0 ||
+        tp_scan_ws(lf->root.end, end) != end) {
+        AML_LOGE("Failed to parse JSON content of %s: not an object or malformed\n", file);
+        tp_lazy_close(lf);
+        cJSON_Delete(root);
+        return NULL;
+    }
+    // The scan touched every page; drop them until a lookup needs them again
+    madvise(map, st.st_size, MADV_DONTNEED);
+
+    // Hashing the content would read the whole file again, leave it unknown
+    h->file_mtime = st.st_mtim;
+    h->file_size = st.st_size;
+    h->file_dev = st.st_dev;
+    h->file_ino = st.st_ino;
+    h->file_hash = 0;
+    h->lazy = lf;
+    return root;
+}
+
+/**
+ * @brief Add the leaves of a walk's grafts to the index
+ *
+ * Must be called with h->lock held for writing. The leaves are inserted in
+ * place, so resolved entries stay valid; only when the index would pass
+ * half full is it rebuilt over the whole tree at twice the size.
+ */
+static void tp_lazy_index(tp_handle_t *h, struct tp_lazy_grafts *g)
+{
+    struct tp_index *idx = h->index;
+    size_t leaves = 0;
+    for (size_t i = 0; i < g->n; i++) {
+        leaves += g->v[i].node->type == cJSON_Object ? tp_count_leaves(g->v[i].node) : 1;
+    }
+
+    int ok = (idx->count + leaves) * 2 <= idx->mask + 1;
+    char *path = NULL;
+    size_t cap = 0;
+    for (size_t i = 0; ok && i < g->n; i++) {
+        cJSON *c = g->v[i].node;
+        if (c->type != cJSON_Object) {
+            ok = tp_index_leaf(idx, c, g->v[i].path) == 0;
+            continue;
+        }
+        size_t len = strlen(g->v[i].path);
+        if (len + 1 > cap) {
+            char *p = (char *)realloc(path, len + 128);
+            if (!p) {
+                ok = 0;
+                break;
+            }
+            path = p;
+            cap = len + 128;
+        }
+        memcpy(path, g->v[i].path, len + 1);
+        ok = tp_index_add(idx, c, &path, &cap, len) == 0;
+    }
+    free(path);
+    if (ok) {
+        return;
+    }
+
+    // The tree holds every graft, so indexing it again covers a partial insert
+    idx = tp_index_build(h->root);
+    if (!idx) {
+        AML_LOGE("Failed to build key index\n");
+        return;
+    }
+    tp_index_free(h->index);
+    h->index = idx;
+    h->gen++;
+}
+
+/**
+ * @brief Make sure the tree holds a key, grafting it from the file if needed
+ *
+ * Takes h->lazy_lock only when the key is not in the index yet, and h->lock
+ * for writing only when the walk grafted something.
+ *
+ * @param h Handle to the JSON file
+ * @param key Dotted key about to be looked up
+ */
+static void tp_lazy_touch(tp_handle_t *h, const char *key)
+{
+    if (!__atomic_load_n(&h->lazy, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_rwlock_rdlock(&h->lock);
+    int found = tp_index_find(h->index, key) != NULL;
+    pthread_rwlock_unlock(&h->lock);
+    if (found) {
+        return;
+    }
+
+    pthread_mutex_lock(&h->lazy_lock);
+    struct tp_lazy_file *lf = h->lazy;
+    char **miss = lf ? &lf->misses[tp_hash(key) & (TP_LAZY_MISSES - 1)] : NULL;
+    if (!lf || (*miss && strcasecmp(*miss, key) == 0)) {
+        pthread_mutex_unlock(&h->lazy_lock);
+        return;
+    }
+    // Grafts reach the index under lazy_lock, so another walk may have added the key meanwhile
+    pthread_rwlock_rdlock(&h->lock);
+    found = tp_index_find(h->index, key) != NULL;
+    pthread_rwlock_unlock(&h->lock);
+    if (found) {
+        pthread_mutex_unlock(&h->lazy_lock);
+        return;
+    }
+
+    struct tp_lazy_grafts g = { 0 };
+    tp_lazy_walk(&lf->root, key, "", h->parser, &g);
+    if (g.n) {
+        pthread_rwlock_wrlock(&h->lock);
+        tp_lazy_index(h, &g);
+        pthread_rwlock_unlock(&h->lock);
+    } else if (!g.failed) {
+        // Everything along the key is in the tree already, so the key is absent
+        char *copy = strdup(key);
+        if (copy) {
+            free(*miss);
+            *miss = copy;
+        }
+    }
+    pthread_mutex_unlock(&h->lazy_lock);
+
+    for (size_t i = 0; i < g.n; i++) {
+        free(g.v[i].path);
+    }
+    free(g.v);
+}
+
+/**
+ * @brief Parse the rest of the file and leave lazy mode
+ *
+ * Needed before anything that writes, walks or borrows from the whole
+ * tree. Readers keep using the partial tree while the file is parsed.
+ *
+ * @param h Handle to the JSON file
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_lazy_load_all(tp_handle_t *h)
+{
+    if (!__atomic_load_n(&h->lazy, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&h->io_lock);
+    struct tp_lazy_file *lf = h->lazy;
+    if (!lf) {
+        pthread_mutex_unlock(&h->io_lock);
+        return 0;
+    }
+    madvise(lf->map, lf->size, MADV_SEQUENTIAL);
+    cJSON *root = tp_json_parse((const char *)lf->map, lf->size, h->parser);
+    struct tp_index *idx = root ? tp_index_build(root) : NULL;
+    if (!idx) {
+        AML_LOGE("Failed to parse JSON content of %s: %s\n", h->filename, root ? "out of memory" : cJSON_GetErrorPtr());
+        cJSON_Delete(root);
+        pthread_mutex_unlock(&h->io_lock);
+        return -1;
+    }
+
+    // Swap the children so h->root itself never changes, as tp_reload() does
+    pthread_mutex_lock(&h->lazy_lock);
+    pthread_rwlock_wrlock(&h->lock);
+    cJSON *child = h->root->child;
+    h->root->child = root->child;
+    root->child = child;
+    struct tp_index *old = h->index;
+    h->index = idx;
+    h->gen++;
+    __atomic_store_n(&h->lazy, NULL, __ATOMIC_RELEASE);
+    tp_bloom_publish(h, tp_bloom_build(h->index, h->bloom));
+    pthread_rwlock_unlock(&h->lock);
+    pthread_mutex_unlock(&h->lazy_lock);
+    pthread_mutex_unlock(&h->io_lock);
+
+    tp_index_free(old);
+    cJSON_Delete(root);
+    tp_lazy_close(lf);
+    return 0;
+}
+
+/**
+ * @brief Open and parse a JSON file
+ *
+ * @param file Path to the JSON file
+ * @return tp_handle_t* Handle for the opened file, or NULL on failure
+ */
+tp_handle_t *tp_open(char *file)
+{
+    return tp_open_ex(file, NULL);
+}
+
+/**
+ * @brief Open and parse a JSON file with options
+ *
+ * @param file Path to the JSON file
+ * @param opts Open options, NULL for defaults
+ * @return tp_handle_t* Handle for the opened file, or NULL on failure
+ */
+tp_handle_t *tp_open_ex(char *file, const tp_options_t *opts)
+{
+    tp_handle_t *handle = NULL;
+
+    // Check if file exists
+    if (access(file, F_OK) != 0) {
+        AML_LOGE("File %s does not exist\n", file);
+        return NULL;
+    }
+
+    // Allocate handle
+    handle = (tp_handle_t *)calloc(1, sizeof(tp_handle_t));
+    if (!handle) {
+        AML_LOGE("Memory allocation failed for handle\n");
+        return NULL;
+    }
+    if (opts) {
+        handle->flags = opts->flags;
+        handle->durability = opts->durability;
+        handle->flush_interval_ms = opts->flush_interval_ms;
+        handle->parser = opts->parser;
+        handle->history_cap = opts->history;
+    }
+    handle->journal_fd = -1;
+    if ((unsigned int)handle->parser > TP_PARSER_CJSON) {
+        AML_LOGE("Invalid parser %d\n", handle->parser);
+        free(handle);
+        return NULL;
+    }
+    if ((unsigned int)handle->durability > TP_DURABILITY_FULL ||
+        ((handle->flags & TP_OPEN_WRITE_BEHIND) && handle->durability != TP_DURABILITY_RENAME &&
+         handle->durability != TP_DURABILITY_ASYNC)) {
+        AML_LOGE("Invalid durability level %d\n", handle->durability);
+        free(handle);
+        return NULL;
+    }
+    if (handle->flags & TP_OPEN_WRITE_BEHIND) {
+        handle->durability = TP_DURABILITY_ASYNC;
+    } else if (handle->durability == TP_DURABILITY_ASYNC) {
+        handle->flags |= TP_OPEN_WRITE_BEHIND;
+    }
+    if ((handle->flags & TP_OPEN_JOURNAL) && (handle->flags & TP_OPEN_WRITE_BEHIND)) {
+        AML_LOGE("TP_OPEN_JOURNAL cannot be combined with TP_OPEN_WRITE_BEHIND\n");
+        free(handle);
+        return NULL;
+    }
+    if ((handle->flags & TP_OPEN_INPLACE) && (handle->flags & (TP_OPEN_JOURNAL | TP_OPEN_WRITE_BEHIND))) {
+        AML_LOGE("TP_OPEN_INPLACE cannot be combined with TP_OPEN_JOURNAL or TP_OPEN_WRITE_BEHIND\n");
+        free(handle);
+        return NULL;
+    }
+    if ((handle->flags & TP_OPEN_LAZY) &&
+        (handle->flags & (TP_OPEN_SNAPSHOT | TP_OPEN_JOURNAL | TP_OPEN_SHARED | TP_OPEN_ARENA | TP_OPEN_INPLACE))) {
+        AML_LOGE("TP_OPEN_LAZY cannot be combined with snapshots, journal, shared store, arena or in-place writes\n");
+        free(handle);
+        return NULL;
+    }
+    if ((handle->flags & TP_OPEN_SHARED) &&
+        (handle->flags & ~(TP_OPEN_SHARED | TP_OPEN_ARENA | TP_OPEN_INPLACE))) {
+        AML_LOGE("TP_OPEN_SHARED can only be combined with TP_OPEN_ARENA and TP_OPEN_INPLACE\n");
+        free(handle);
+        return NULL;
+    }
+
+    // Initialize locks. Writers are preferred so a steady read load cannot
+    // starve tp_set(); a thread therefore must not take the read lock twice.
+    pthread_rwlockattr_t rwattr;
+    pthread_rwlockattr_init(&rwattr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    int rwret = pthread_rwlock_init(&handle->lock, &rwattr);
+    pthread_rwlockattr_destroy(&rwattr);
+    if (rwret != 0) {
+        AML_LOGE("Rwlock initialization failed\n");
+        free(handle);
+        return NULL;
+    }
+    if (pthread_mutex_init(&handle->io_lock, NULL) != 0) {
+        AML_LOGE("Mutex initialization failed\n");
+        pthread_rwlock_destroy(&handle->lock);
+        free(handle);
+        return NULL;
+    }
+    // Recursive, so callbacks can set values and manage watches on the same handle
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    int err = pthread_mutex_init(&handle->watch_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (err != 0) {
+        AML_LOGE("Mutex initialization failed\n");
+        pthread_mutex_destroy(&handle->io_lock);
+        pthread_rwlock_destroy(&handle->lock);
+        free(handle);
+        return NULL;
+    }
+    err = pthread_mutex_init(&handle->async_lock, NULL);
+    if (err == 0 && (err = pthread_cond_init(&handle->async_cond, NULL)) != 0) {
+        pthread_mutex_destroy(&handle->async_lock);
+    }
+    if (err != 0) {
+        AML_LOGE("Mutex initialization failed\n");
+        pthread_mutex_destroy(&handle->watch_lock);
+        pthread_mutex_destroy(&handle->io_lock);
+        pthread_rwlock_destroy(&handle->lock);
+        free(handle);
+        return NULL;
+    }
+    handle->async_tail = &handle->async_head;
+    if (pthread_mutex_init(&handle->lazy_lock, NULL) != 0) {
+        AML_LOGE("Mutex initialization failed\n");
+        pthread_cond_destroy(&handle->async_cond);
+        pthread_mutex_destroy(&handle->async_lock);
+        pthread_mutex_destroy(&handle->watch_lock);
+        pthread_mutex_destroy(&handle->io_lock);
+        pthread_rwlock_destroy(&handle->lock);
+        free(handle);
+        return NULL;
+    }
+
+    // Save filename
+    handle->filename = strdup(file);
+    if (!handle->filename) {
+        AML_LOGE("Memory allocation failed for filename\n");
+        goto fail;
+    }
+#ifdef TP_ENABLE_STATS
+    handle->stats = (tp_stats_t *)calloc(1, sizeof(tp_stats_t));
+    if (!handle->stats) {
+        AML_LOGE("Memory allocation failed for statistics\n");
+        goto fail;
+    }
+#endif
+    if (handle->history_cap && tp_history_init(handle) != 0) {
+        goto fail;
+    }
+
+    // Compiled images are served straight from the mapping
+    int image = tp_image_open(handle);
+    if (image < 0) {
+        goto fail;
+    }
+    if (image) {
+        if (handle->flags) {
+            AML_LOGE("Image %s is read-only and takes no open flags\n", file);
+            goto fail;
+        }
+        tp_image_bloom(handle);
+        return handle;
+    }
+
+    // Values stored into an arena tree come from a pool
+    if ((handle->flags & TP_OPEN_ARENA) && !(handle->pool = tp_pool_create())) {
+        AML_LOGE("Memory allocation failed for value pool\n");
+        goto fail;
+    }
+
+    // Parse JSON content, or only locate it for lazy parsing
+    handle->root = (handle->flags & TP_OPEN_LAZY) ? tp_lazy_open(file, handle) : tp_parse_file(file, handle);
+    if (!handle->root) {
+        goto fail;
+    }
+
+    // Index every leaf by its full dotted path
+    handle->index = tp_index_build(handle->root);
+    if (!handle->index) {
+        AML_LOGE("Failed to build key index\n");
+        goto fail;
+    }
+    // Without a filter every lookup just goes to the index; a lazy tree does not know its keys yet
+    if (!handle->lazy) {
+        tp_bloom_publish(handle, tp_bloom_build(handle->index, handle->bloom));
+    }
+
+    // Serve values from the shared store, creating it if this is the first process
+    if ((handle->flags & TP_OPEN_SHARED) && tp_shm_open(handle, opts->shm_name) != 0) {
+        AML_LOGE("Failed to open shared store\n");
+        goto fail;
+    }
+
+    // Locate leaf values in the file for same-size rewrites
+    if (handle->flags & TP_OPEN_INPLACE) {
+        tp_inplace_scan(handle);
+    }
+
+    // Replay the change journal on top of the base file
+    if ((handle->flags & TP_OPEN_JOURNAL) && tp_journal_open(handle, opts->journal_limit) != 0) {
+        AML_LOGE("Failed to open journal\n");
+        goto fail;
+    }
+
+    // Per-thread read caches, validated against the handle version
+    if ((handle->flags & TP_OPEN_THREAD_CACHE) && tp_cache_init(handle) != 0) {
+        AML_LOGE("Failed to initialize thread caches\n");
+        goto fail;
+    }
+
+    // Publish the first version for lock-free snapshot readers
+    if ((handle->flags & TP_OPEN_SNAPSHOT) && tp_snapshot_init(handle) != 0) {
+        AML_LOGE("Failed to initialize snapshots\n");
+        if (handle->flags & TP_OPEN_THREAD_CACHE) {
+            tp_cache_fini(handle);
+        }
+        goto fail;
+    }
+
+    // Start write-behind persistence last, it needs a complete handle
+    if (handle->flags & TP_OPEN_WRITE_BEHIND) {
+        if (tp_flush_init(handle, handle->flush_interval_ms) != 0) {
+            AML_LOGE("Failed to start flusher thread\n");
+            if (handle->flags & TP_OPEN_SNAPSHOT) {
+                tp_snapshot_fini(handle);
+            }
+            if (handle->flags & TP_OPEN_THREAD_CACHE) {
+                tp_cache_fini(handle);
+            }
+            goto fail;
+        }
+        handle->flusher_running = 1;
+    }
+
+    return handle;
+
+fail:
+    if (handle) {
+        if (handle->image) munmap((void *)handle->image, handle->image_size);
+        if (handle->shm) munmap(handle->shm, handle->shm_size);
+        if (handle->journal_fd >= 0) close(handle->journal_fd);
+        tp_tree_free(handle, handle->root, handle->arena, handle->index);
+        tp_index_free(handle->index);
+        tp_pool_destroy(handle->pool);
+        if (handle->filename) free(handle->filename);
+        free(handle->print_buf);
+        free(handle->stats);
+        free(handle->history);
+        tp_bloom_free(handle);
+        tp_lazy_close(handle->lazy);
+        pthread_mutex_destroy(&handle->lazy_lock);
+        pthread_cond_destroy(&handle->async_cond);
+        pthread_mutex_destroy(&handle->async_lock);
+        pthread_mutex_destroy(&handle->watch_lock);
+        pthread_mutex_destroy(&handle->io_lock);
+        pthread_rwlock_destroy(&handle->lock);
+        free(handle);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Close the handle and release resources
+ *
+ * @param h Handle to the JSON file
+ */
+void tp_close(tp_handle_t *h)
+{
+    if (h) {
+        while (h->mounts) {
+            struct tp_mount *m = h->mounts;
+            h->mounts = m->next;
+            tp_close(m->h);
+            free(m->prefix);
+            free(m);
+        }
+        tp_async_fini(h);
+        tp_watch_fini(h);
+        if (h->flusher_running) {
+            tp_flush_fini(h);
+        }
+        if (h->journal_fd >= 0) {
+            close(h->journal_fd);
+        }
+        if (h->flags & TP_OPEN_SNAPSHOT) {
+            tp_snapshot_fini(h);
+        }
+        if (h->flags & TP_OPEN_THREAD_CACHE) {
+            tp_cache_fini(h);
+        }
+        if (h->image) {
+            munmap((void *)h->image, h->image_size);
+        }
+        if (h->shm) {
+            munmap(h->shm, h->shm_size);
+        }
+        tp_tree_free(h, h->root, h->arena, h->index);
+        tp_index_free(h->index);
+        tp_pool_destroy(h->pool);
+        if (h->filename) {
+            free(h->filename);
+        }
+        free(h->print_buf);
+        free(h->stats);
+        free(h->history);
+        tp_bloom_free(h);
+        tp_lazy_close(h->lazy);
+        pthread_mutex_destroy(&h->lazy_lock);
+        pthread_mutex_destroy(&h->io_lock);
+        pthread_rwlock_destroy(&h->lock);
+        free(h);
+    }
+}
+
+struct tp_key {
+    char *path;          // Dotted key the handle was resolved from
+    tp_handle_t *shard;  // Mounted handle the key belongs to, NULL for the handle itself
+    tp_entry_t *entry;   // Resolved index entry
+    long slot;           // Key table index when the handle serves a compiled image
+    unsigned long gen;   // Tree generation the entry was resolved against
+};
+
+/**
+ * @brief Find the index entry for a key, a miss is not logged
+ *
+ * Must be called with h->lock held, for reading or writing.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume" or single-level "volume"
+ * @return tp_entry_t* Entry, or NULL if not found
+ */
+static tp_entry_t *tp_lookup_probe(tp_handle_t *h, const char *key)
+{
+    tp_entry_t *e;
+
+    TP_STAT_TIMED(h, lookup, e = tp_index_find(h->index, key));
+    if (!e) {
+        TP_STAT_ADD(h, misses, 1);
+    }
+    return e;
+}
+
+/**
+ * @brief Find the index entry for a dotted or single-level key
+ *
+ * Must be called with h->lock held, for reading or writing.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume" or single-level "volume"
+ * @return tp_entry_t* Entry, or NULL if not found
+ */
+static tp_entry_t *tp_lookup_entry(tp_handle_t *h, const char *key)
+{
+    tp_entry_t *e = tp_lookup_probe(h, key);
+    if (!e) {
+        AML_LOGE("Key not found: %s\n", key);
+    }
+    return e;
+}
+
+/**
+ * @brief Find the leaf named by a dotted or single-level key
+ *
+ * Must be called with h->lock held, for reading or writing.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume" or single-level "volume"
+ * @return cJSON* Leaf node, or NULL if not found
+ */
+static cJSON *tp_lookup(tp_handle_t *h, const char *key)
+{
+    tp_entry_t *e = tp_lookup_entry(h, key);
+    return e ? e->node : NULL;
+}
+
+/**
+ * @brief Serialize the tree into h->print_buf
+ *
+ * Must be called with h->io_lock held and h->lock held for reading. The
+ * buffer keeps its size between writes, so after the first one a write
+ * normally allocates nothing.
+ *
+ * @param h Handle to the JSON file
+ * @return char* Serialized tree in h->print_buf, or NULL on failure
+ */
+static char *tp_print(tp_handle_t *h)
+{
+    cJSON_bool fmt = !(h->flags & TP_OPEN_COMPACT);
+
+    for (;;) {
+        // cJSON wants a few spare bytes beyond the output, and fails cleanly without them
+        if (h->print_buf && cJSON_PrintPreallocated(h->root, h->print_buf, (int)h->print_cap, fmt)) {
+            return h->print_buf;
+        }
+        size_t cap = h->print_cap ? h->print_cap * 2 : TP_PRINT_MIN;
+        if (h->print_cap == 0 && h->file_size > 0 && (size_t)h->file_size * 2 > cap) {
+            cap = (size_t)h->file_size * 2;
+        }
+        if (cap > INT_MAX) {
+            return NULL;
+        }
+        char *buf = (char *)realloc(h->print_buf, cap);
+        if (!buf) {
+            return NULL;
+        }
+        h->print_buf = buf;
+        h->print_cap = cap;
+    }
+}
+
+/**
+ * @brief Make a rename in the directory of a file durable
+ *
+ * @param file Path of the file
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_sync_dir(const char *file)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(file, '/');
+
+    if (!slash) {
+        snprintf(dir, sizeof(dir), ".");
+    } else if (slash == file) {
+        snprintf(dir, sizeof(dir), "/");
+    } else if ((size_t)(slash - file) >= sizeof(dir)) {
+        AML_LOGE("Directory of %s is too long\n", file);
+        return -1;
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - file), file);
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0) {
+        AML_LOGE("Failed to sync directory %s: %s\n", dir, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief Serialize the JSON tree and atomically replace the file with it
+ *
+ * Must be called with h->io_lock held. Takes h->lock for reading only while
+ * the tree is printed, so readers are never blocked by the file I/O.
+ *
+ * @param h Handle to the JSON file
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_persist_locked(tp_handle_t *h)
+{
+    int full = tp_durability(h) == TP_DURABILITY_FULL;
+
+    // Print JSON to the reused buffer, growing it until the tree fits
+    char *buf;
+    TP_STAT_TIMED(h, lock_wait, pthread_rwlock_rdlock(&h->lock));
+    TP_STAT_TIMED(h, serialize, buf = tp_print(h));
+    unsigned long wseq = h->wseq;
+    pthread_rwlock_unlock(&h->lock);
+    if (!buf) {
+        AML_LOGE("Failed to serialize JSON\n");
+        return -1;
+    }
+
+    // Write to temporary file
+    TP_STAT_START(write_start);
+    char temp_file[PATH_MAX];
+    int tn = snprintf(temp_file, sizeof(temp_file), "%s.tmp", h->filename);
+    if (tn < 0 || (size_t)tn >= sizeof(temp_file)) {
+        AML_LOGE("Temporary file name for %s is too long\n", h->filename);
+        return -1;
+    }
+    FILE *temp_fp = fopen(temp_file, "w");
+    if (!temp_fp) {
+        AML_LOGE("Failed to open temporary file %s: %s\n", temp_file, strerror(errno));
+        return -1;
+    }
+
+    size_t size = strlen(buf);
+    size_t len = fwrite(buf, 1, size, temp_fp);
+    if (len != size) {
+        AML_LOGE("Failed to write to temporary file %s, wrote %zu bytes, expected %zu: %s\n",
+                 temp_file, len, size, strerror(errno));
+        fclose(temp_fp);
+        return -1;
+    }
+
+    // Remember what was written, so tp_reload() can skip our own writes
+    struct stat st;
+    fflush(temp_fp);
+    if (full && fdatasync(fileno(temp_fp)) != 0) {
+        AML_LOGE("Failed to sync temporary file %s: %s\n", temp_file, strerror(errno));
+        fclose(temp_fp);
+        return -1;
+    }
+    int have_state = fstat(fileno(temp_fp), &st) == 0;
+    fclose(temp_fp);
+    TP_STAT_STOP(h, write, write_start);
+    TP_STAT_ADD(h, bytes_written, size);
+
+    // Replace original file with temporary file
+    TP_STAT_START(rename_start);
+    if (rename(temp_file, h->filename) != 0) {
+        AML_LOGE("Failed to rename %s to %s: %s\n", temp_file, h->filename, strerror(errno));
+        return -1;
+    }
+    // The rename itself is only durable once the directory entry is
+    int synced = !full || tp_sync_dir(h->filename) == 0;
+    TP_STAT_STOP(h, rename, rename_start);
+    if (have_state) {
+        tp_file_state_set(h, &st, (const unsigned char *)buf, size);
+    } else {
+        h->file_size = -1;
+    }
+    h->pseq = wseq;
+    if (h->flags & TP_OPEN_INPLACE) {
+        tp_inplace_map(h, buf, size);
+    }
+    if (!synced) {
+        return -1;
+    }
+    TP_STAT_ADD(h, persists, 1);
+    return 0;
+}
+
+/**
+ * @brief Serialize the JSON tree and atomically replace the file with it
+ *
+ * Takes h->io_lock to order writers, see tp_persist_locked().
+ *
+ * @param h Handle to the JSON file
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_persist(tp_handle_t *h)
+{
+    TP_STAT_TIMED(h, lock_wait, pthread_mutex_lock(&h->io_lock));
+    int ret = tp_persist_locked(h);
+    pthread_mutex_unlock(&h->io_lock);
+    return ret;
+}
+
+typedef struct tp_update {
+    const char *key;    // Dotted key, used when k is NULL
+    tp_key_t *k;        // Key handle, or NULL
+    tp_entry_t *e;      // Resolved leaf, filled in by tp_apply()
+    char *str;          // New value as text, owned by the update until swapped in
+    double num;         // New value for number and boolean nodes
+    char *old;          // String to free once done, the replaced one or str itself
+    int old_type;       // Node type before the swap
+    int old_in_arena;   // old lives in the tree's arena and is not freed
+    double old_num;     // Node number before the swap
+    unsigned long undo; // History entry this update rolls back, 0 for a new change
+} tp_update_t;
+
+/**
+ * @brief Check that an update fits the type of its node
+ *
+ * String nodes take any text. Number nodes need a number and boolean nodes
+ * "true", "false" or a number, keeping the file's native JSON types.
+ *
+ * @return int 0 if the value can be stored, -1 otherwise
+ */
+static int tp_value_prepare(tp_update_t *u)
+{
+    cJSON *n = u->e->node;
+    int b;
+
+    switch (n->type & 0xFF) {
+    case cJSON_String:
+        return 0;
+    case cJSON_Number:
+        if (tp_parse_num(u->str, &u->num)) {
+            return 0;
+        }
+        break;
+    case cJSON_True:
+    case cJSON_False:
+        if (tp_parse_bool(u->str, &b)) {
+            u->num = b;
+            return 0;
+        }
+        if (tp_parse_num(u->str, &u->num)) {
+            u->num = u->num != 0;
+            return 0;
+        }
+        break;
+    default:
+        break;
+    }
+    AML_LOGE("Value %s does not fit the type of %s\n", u->str, u->e->path);
+    return -1;
+}
+
+/**
+ * @brief Store a prepared update into its node, remembering the old value
+ *
+ * Must be called with h->lock held for writing.
+ */
+static void tp_value_swap(tp_update_t *u)
+{
+    cJSON *n = u->e->node;
+
+    u->old_type = n->type;
+    u->old_num = n->valuedouble;
+    switch (n->type & 0xFF) {
+    case cJSON_String:
+        u->old = n->valuestring;
+        n->valuestring = u->str;
+        break;
+    case cJSON_Number:
+        u->old = u->str;
+        cJSON_SetNumberHelper(n, u->num);
+        break;
+    default:
+        u->old = u->str;
+        n->type = (n->type & ~0xFF) | (u->num != 0 ? cJSON_True : cJSON_False);
+        break;
+    }
+    tp_entry_cache(u->e);
+}
+
+/**
+ * @brief Undo tp_value_swap()
+ *
+ * Must be called with h->lock held for writing.
+ */
+static void tp_value_restore(tp_update_t *u)
+{
+    cJSON *n = u->e->node;
+
+    n->type = u->old_type;
+    switch (n->type & 0xFF) {
+    case cJSON_String:
+        n->valuestring = u->old;
+        u->old = u->str;
+        break;
+    case cJSON_Number:
+        cJSON_SetNumberHelper(n, u->old_num);
+        break;
+    default:
+        break;
+    }
+    tp_entry_cache(u->e);
+}
+
+/*
+ * Change history (opts->history)
+ *
+ * A ring of fixed-size slots allocated at open, written by tp_apply() under
+ * the exclusive h->lock. Change number seq lives in slot (seq - 1) % cap
+ * until it is overwritten; a slot whose seq does not match was reused or
+ * dropped. tp_rollback() applies the old values as one batch whose updates
+ * mark the undone entries instead of adding new ones.
+ */
+struct tp_history_slot {
+    tp_history_t c;     // Recorded change
+    unsigned long seq;  // Change number, 0 when the slot is empty
+    int undone;         // Rolled back, skipped by tp_history() and tp_rollback()
+};
+
+/**
+ * @brief Allocate the ring of h->history_cap slots
+ *
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_history_init(tp_handle_t *h)
+{
+    h->history = (struct tp_history_slot *)calloc(h->history_cap, sizeof(struct tp_history_slot));
+    if (!h->history) {
+        AML_LOGE("Memory allocation failed for history\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the slot of a change that is still recorded
+ *
+ * @return struct tp_history_slot* Slot, or NULL if it was overwritten
+ */
+static struct tp_history_slot *tp_history_slot(tp_handle_t *h, unsigned long seq)
+{
+    if (!seq || seq > h->history_seq) {
+        return NULL;
+    }
+    struct tp_history_slot *s = &h->history[(seq - 1) % h->history_cap];
+    return s->seq == seq ? s : NULL;
+}
+
+/**
+ * @brief Copy text into a fixed buffer
+ *
+ * @return int 1 if it had to be cut, 0 otherwise
+ */
+static int tp_history_copy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+    if (len >= size) {
+        memcpy(dst, src, size - 1);
+        dst[size - 1] = '\0';
+        return 1;
+    }
+    memcpy(dst, src, len + 1);
+    return 0;
+}
+
+/**
+ * @brief Record a swapped batch, or mark the changes a rollback undid
+ *
+ * Must be called with h->lock held for writing.
+ */
+static void tp_history_record(tp_handle_t *h, const tp_update_t *u, size_t n)
+{
+    struct timespec now;
+    char buf[32];
+
+    if (!h->history) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (size_t i = 0; i < n; i++) {
+        if (u[i].undo) {
+            tp_history_slot(h, u[i].undo)->undone = 1;
+            continue;
+        }
+        cJSON *node = u[i].e->node;
+        struct tp_history_slot *s = &h->history[h->history_seq++ % h->history_cap];
+        s->seq = h->history_seq;
+        s->undone = 0;
+        s->c.time = now;
+        s->c.truncated = tp_history_copy(s->c.key, u[i].e->path, sizeof(s->c.key));
+        s->c.truncated |= tp_history_copy(s->c.old_value,
+                                          tp_leaf_text(u[i].old_type & 0xFF, u[i].old, u[i].old_num, buf),
+                                          sizeof(s->c.old_value));
+        tp_history_copy(s->c.new_value, tp_leaf_text(node->type & 0xFF, node->valuestring, node->valuedouble, buf),
+                        sizeof(s->c.new_value));
+    }
+}
+
+/**
+ * @brief Take back tp_history_record() of a batch that was reverted
+ *
+ * Must be called with h->lock held for writing, before any other batch was
+ * applied, so the batch's own entries are the newest. Entries the batch
+ * overwrote stay lost.
+ */
+static void tp_history_revert(tp_handle_t *h, const tp_update_t *u, size_t n)
+{
+    if (!h->history) {
+        return;
+    }
+    for (size_t i = n; i-- > 0;) {
+        if (u[i].undo) {
+            tp_history_slot(h, u[i].undo)->undone = 0;
+        } else {
+            h->history[--h->history_seq % h->history_cap].seq = 0;
+        }
+    }
+}
+
+/*
+ * Journal record layout, all integers little-endian:
+ *
+ *   u32 magic  u32 count  u32 payload_len
+ *   payload: count x { u16 key_len  u32 value_len  key  value }
+ *   u32 crc32 over payload
+ *
+ * One record holds one tp_apply() batch and is replayed all or nothing.
+ */
+#define TP_JOURNAL_MAGIC 0x314a5054u // "TPJ1"
+#define TP_JOURNAL_HDR 12
+#define TP_JOURNAL_LIMIT (64 * 1024) // Default compaction threshold in bytes
+
+/**
+ * @brief Standard CRC-32 (IEEE 802.3)
+ */
+static uint32_t tp_crc32(const unsigned char *p, size_t len)
+{
+    uint32_t crc = 0xffffffffu;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Path of the journal sidecar for a parameter file
+ *
+ * @return int 0 on success, -1 if the path does not fit
+ */
+static int tp_journal_path(tp_handle_t *h, char *path, size_t len)
+{
+    int n = snprintf(path, len, "%s.journal", h->filename);
+    if (n < 0 || (size_t)n >= len) {
+        AML_LOGE("Journal path for %s is too long\n", h->filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Encode a batch of updates as one journal record
+ *
+ * @param u Updates, keys taken from u[i].key or the key handle path
+ * @param n Number of updates
+ * @param out Receives the malloc'd record
+ * @return size_t Record size, 0 on failure
+ */
+static size_t tp_journal_encode(const tp_update_t *u, size_t n, unsigned char **out)
+{
+    size_t payload = 0;
+    for (size_t i = 0; i < n; i++) {
+        const char *key = u[i].k ? u[i].k->path : u[i].key;
+        size_t klen = strlen(key);
+        if (klen > UINT16_MAX) {
+            AML_LOGE("Key too long for journal: %s\n", key);
+            return 0;
+        }
+        payload += 6 + klen + strlen(u[i].str);
+    }
+
+    unsigned char *rec = (unsigned char *)malloc(TP_JOURNAL_HDR + payload + 4);
+    if (!rec) {
+        AML_LOGE("Memory allocation failed for journal record\n");
+        return 0;
+    }
+    tp_put_u32(rec, TP_JOURNAL_MAGIC);
+    tp_put_u32(rec + 4, (uint32_t)n);
+    tp_put_u32(rec + 8, (uint32_t)payload);
+
+    unsigned char *p = rec + TP_JOURNAL_HDR;
+    for (size_t i = 0; i < n; i++) {
+        const char *key = u[i].k ? u[i].k->path : u[i].key;
+        size_t klen = strlen(key);
+        size_t vlen = strlen(u[i].str);
+        tp_put_u16(p, (uint16_t)klen);
+        tp_put_u32(p + 2, (uint32_t)vlen);
+        memcpy(p + 6, key, klen);
+        memcpy(p + 6 + klen, u[i].str, vlen);
+        p += 6 + klen + vlen;
+    }
+    tp_put_u32(p, tp_crc32(rec + TP_JOURNAL_HDR, payload));
+
+    *out = rec;
+    return TP_JOURNAL_HDR + payload + 4;
+}
+
+/**
+ * @brief Fold the journal into a fresh base file and empty it
+ *
+ * Must be called with h->io_lock held. A crash between the rename and the
+ * truncate only replays records the new base already contains.
+ *
+ * @param h Handle opened with TP_OPEN_JOURNAL
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_journal_compact(tp_handle_t *h)
+{
+    if (tp_persist_locked(h) != 0) {
+        return -1;
+    }
+    if (ftruncate(h->journal_fd, 0) != 0) {
+        AML_LOGE("Failed to truncate journal: %s\n", strerror(errno));
+        return -1;
+    }
+    h->journal_size = 0;
+    return 0;
+}
+
+/**
+ * @brief Append an encoded record, compacting once the journal is too large
+ *
+ * Must be called with h->io_lock held.
+ *
+ * @param h Handle opened with TP_OPEN_JOURNAL
+ * @param rec Encoded record
+ * @param len Record size
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_journal_append(tp_handle_t *h, const unsigned char *rec, size_t len)
+{
+    TP_STAT_START(write_start);
+    ssize_t n = write(h->journal_fd, rec, len);
+    if (n != (ssize_t)len) {
+        AML_LOGE("Failed to append to journal, wrote %zd bytes, expected %zu: %s\n",
+                 n, len, strerror(errno));
+        // Drop a torn tail so later records stay reachable on replay
+        if (n > 0 && ftruncate(h->journal_fd, (off_t)h->journal_size) != 0) {
+            AML_LOGE("Failed to truncate journal: %s\n", strerror(errno));
+        }
+        return -1;
+    }
+    if (tp_durability(h) == TP_DURABILITY_FULL && fdatasync(h->journal_fd) != 0) {
+        AML_LOGE("Failed to sync journal: %s\n", strerror(errno));
+        // The caller undoes the change, so the record must not replay either
+        if (ftruncate(h->journal_fd, (off_t)h->journal_size) != 0) {
+            AML_LOGE("Failed to truncate journal: %s\n", strerror(errno));
+        }
+        return -1;
+    }
+    TP_STAT_STOP(h, write, write_start);
+    TP_STAT_ADD(h, bytes_written, len);
+    TP_STAT_ADD(h, persists, 1);
+    h->journal_size += len;
+
+    if (h->journal_size > h->journal_limit && tp_journal_compact(h) != 0) {
+        // The record is safely in the journal, compaction is retried next time
+        AML_LOGE("Journal compaction failed, keeping %zu bytes of journal\n", h->journal_size);
+    }
+    return 0;
+}
+
+/**
+ * @brief Replace a leaf value while replaying, before the handle is shared
+ */
+static int tp_journal_apply(tp_handle_t *h, const char *key, const char *value)
+{
+    tp_entry_t *e = tp_index_find(h->index, key);
+    if (!e) {
+        AML_LOGE("Journal key not found, skipping: %s\n", key);
+        return 0;
+    }
+    tp_update_t u = { .e = e };
+    u.str = tp_value_dup(h, value);
+    if (!u.str) {
+        return -1;
+    }
+    if (tp_value_prepare(&u) != 0) {
+        tp_value_free(h, u.str);
+        return 0;
+    }
+    tp_value_swap(&u);
+    tp_value_release(h, u.old);
+    return 0;
+}
+
+/**
+ * @brief Open the journal and replay it on top of the parsed base file
+ *
+ * Replay stops at the first truncated or corrupt record, which is cut off so
+ * that new records follow the last good one.
+ *
+ * @param h Handle with a parsed tree and index
+ * @param limit Compaction threshold in bytes, 0 for the default
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_journal_open(tp_handle_t *h, size_t limit)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    h->journal_limit = limit ? limit : TP_JOURNAL_LIMIT;
+    if (tp_journal_path(h, path, sizeof(path)) != 0) {
+        return -1;
+    }
+    h->journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (h->journal_fd < 0) {
+        AML_LOGE("Failed to open journal %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(h->journal_fd, &st) != 0) {
+        AML_LOGE("Failed to get journal size for %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    size_t size = (size_t)st.st_size;
+    unsigned char *buf = size ? (unsigned char *)malloc(size) : NULL;
+    if (size && !buf) {
+        AML_LOGE("Memory allocation failed for journal\n");
+        goto fail;
+    }
+    if (size && pread(h->journal_fd, buf, size, 0) != (ssize_t)size) {
+        AML_LOGE("Failed to read journal %s: %s\n", path, strerror(errno));
+        free(buf);
+        goto fail;
+    }
+
+    size_t off = 0;
+    while (off + TP_JOURNAL_HDR + 4 <= size) {
+        const unsigned char *rec = buf + off;
+        uint32_t count = tp_get_u32(rec + 4);
+        size_t payload = tp_get_u32(rec + 8);
+        if (tp_get_u32(rec) != TP_JOURNAL_MAGIC || payload > size - off - TP_JOURNAL_HDR - 4 ||
+            tp_crc32(rec + TP_JOURNAL_HDR, payload) != tp_get_u32(rec + TP_JOURNAL_HDR + payload)) {
+            break;
+        }
+
+        // Decode into NUL-terminated copies; the CRC already vouches for the lengths
+        const unsigned char *p = rec + TP_JOURNAL_HDR;
+        const unsigned char *end = p + payload;
+        for (uint32_t i = 0; i < count && p + 6 <= end; i++) {
+            size_t klen = tp_get_u16(p);
+            size_t vlen = tp_get_u32(p + 2);
+            if (klen + vlen > (size_t)(end - p - 6)) {
+                break;
+            }
+            char *key = strndup((const char *)p + 6, klen);
+            char *value = strndup((const char *)p + 6 + klen, vlen);
+            int ret = (key && value) ? tp_journal_apply(h, key, value) : -1;
+            free(key);
+            free(value);
+            if (ret != 0) {
+                AML_LOGE("Memory allocation failed replaying journal\n");
+                free(buf);
+                goto fail;
+            }
+            p += 6 + klen + vlen;
+        }
+        off += TP_JOURNAL_HDR + payload + 4;
+    }
+    free(buf);
+
+    if (off != size) {
+        AML_LOGE("Discarding %zu bytes of torn or corrupt journal %s\n", size - off, path);
+        if (ftruncate(h->journal_fd, (off_t)off) != 0) {
+            AML_LOGE("Failed to truncate journal %s: %s\n", path, strerror(errno));
+            goto fail;
+        }
+    }
+    h->journal_size = off;
+
+    if (h->journal_size > h->journal_limit) {
+        pthread_mutex_lock(&h->io_lock);
+        tp_journal_compact(h);
+        pthread_mutex_unlock(&h->io_lock);
+    }
+    return 0;
+
+fail:
+    close(h->journal_fd);
+    h->journal_fd = -1;
+    return -1;
+}
+
+/**
+ * @brief Re-resolve a key handle if the tree changed since it was resolved
+ *
+ * Must be called with h->lock held. Concurrent callers sharing one key handle
+ * all resolve to the same entry, so the published pair stays consistent.
+ *
+ * @param h Handle to the JSON file
+ * @param k Key handle
+ * @return tp_entry_t* Entry, or NULL if the key no longer exists
+ */
+static tp_entry_t *tp_key_entry(tp_handle_t *h, tp_key_t *k)
+{
+    if (__atomic_load_n(&k->gen, __ATOMIC_ACQUIRE) != h->gen) {
+        __atomic_store_n(&k->entry, tp_lookup_entry(h, k->path), __ATOMIC_RELAXED);
+        __atomic_store_n(&k->gen, h->gen, __ATOMIC_RELEASE);
+    }
+    return __atomic_load_n(&k->entry, __ATOMIC_RELAXED);
+}
+
+struct tp_txn {
+    tp_handle_t *base;  // Handle the transaction was started on
+    tp_handle_t *h;     // Handle the transaction applies to, a mounted one once a key routed there
+    tp_update_t *ups;   // Staged updates, keys and values owned by the transaction
+    size_t count;       // Number of staged updates
+    size_t cap;         // Capacity of ups
+};
+
+/**
+ * @brief Replace a batch of leaf values in memory, then write the tree once
+ *
+ * All keys are resolved and swapped under one exclusive h->lock, so readers
+ * see either none or all of the batch. The new values become visible before
+ * any file I/O. If persisting fails the previous values are restored, unless
+ * another batch was applied in the meantime. In write-behind mode only the
+ * in-memory update happens here; in journal mode one record is appended
+ * instead of rewriting the file. With a shared store the batch is published to
+ * the segment once it is on disk, and the segment lock is held throughout so
+ * the file always reflects the writes of every process.
+ *
+ * Values keep the JSON type of their node: number and boolean nodes are
+ * updated natively and reject text that does not convert. Every u[i].str is
+ * consumed, whether the call succeeds or not; it must come from tp_value_dup().
+ *
+ * @param h Handle to the JSON file
+ * @param u Updates to apply, in order
+ * @param n Number of updates
+ * @param level tp_durability_t to persist with, normally tp_durability(h)
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_apply(tp_handle_t *h, tp_update_t *u, size_t n, int level)
+{
+    unsigned char *rec = NULL;
+    size_t rec_len = 0;
+    size_t i;
+    int journal = (h->flags & TP_OPEN_JOURNAL) && level != TP_DURABILITY_NONE;
+    int watched = tp_watched(h);
+    struct tp_changes changes = { 0 };
+
+    if (h->image || tp_lazy_load_all(h) != 0) {
+        if (h->image) {
+            AML_LOGE("Image %s is read-only\n", h->filename);
+        }
+        for (i = 0; i < n; i++) {
+            tp_value_free(h, u[i].str);
+        }
+        return -1;
+    }
+
+    // Other processes' writes must be in the tree before it is written out
+    if (h->shm) {
+        tp_shm_lock(h);
+        if (tp_shm_pull(h, watched ? &changes : NULL) != 0) {
+            tp_shm_unlock(h);
+            tp_watch_notify(h, &changes);
+            for (i = 0; i < n; i++) {
+                tp_value_free(h, u[i].str);
+            }
+            return -1;
+        }
+    }
+
+    // The journal must list batches in the order they hit memory
+    if (journal) {
+        rec_len = tp_journal_encode(u, n, &rec);
+        if (!rec_len) {
+            for (i = 0; i < n; i++) {
+                tp_value_free(h, u[i].str);
+            }
+            return -1;
+        }
+        TP_STAT_TIMED(h, lock_wait, pthread_mutex_lock(&h->io_lock));
+    }
+
+    // Update JSON nodes, all or nothing
+    TP_STAT_TIMED(h, lock_wait, pthread_rwlock_wrlock(&h->lock));
+    for (i = 0; i < n; i++) {
+        u[i].e = u[i].k ? tp_key_entry(h, u[i].k) : tp_lookup_entry(h, u[i].key);
+        int bad = !u[i].e || tp_value_prepare(&u[i]) != 0;
+        if (!bad && u[i].undo && (!tp_history_slot(h, u[i].undo) || tp_history_slot(h, u[i].undo)->undone)) {
+            AML_LOGE("Change of %s was already rolled back\n", u[i].e->path);
+            bad = 1;
+        }
+        if (!bad && h->shm && !u[i].e->shm_slot) {
+            AML_LOGE("Key %s is not in the shared store, other processes would not see it\n", u[i].e->path);
+            bad = 1;
+        }
+        if (!bad && u[i].e->shm_slot && strlen(u[i].str) >= TP_SHM_VALUE) {
+            AML_LOGE("Value of %s is too long for the shared store\n", u[i].e->path);
+            bad = 1;
+        }
+        if (bad) {
+            pthread_rwlock_unlock(&h->lock);
+            if (journal) {
+                pthread_mutex_unlock(&h->io_lock);
+                free(rec);
+            }
+            if (h->shm) {
+                tp_shm_unlock(h);
+            }
+            tp_watch_notify(h, &changes);
+            for (i = 0; i < n; i++) {
+                tp_value_free(h, u[i].str);
+            }
+            return -1;
+        }
+    }
+    unsigned long wseq = ++h->wseq;
+    size_t pulled = changes.n;
+    TP_STAT_ADD(h, sets, n);
+    for (i = 0; i < n; i++) {
+        tp_value_swap(&u[i]);
+        u[i].old_in_arena = h->arena && tp_arena_owns(h->arena, u[i].old);
+        tp_version_touch(h, u[i].e);
+        if (watched) {
+            tp_changes_add(&changes, u[i].e->path, u[i].e->node);
+        }
+    }
+    tp_history_record(h, u, n);
+    tp_cache_invalidate(h);
+    pthread_rwlock_unlock(&h->lock);
+
+    int ret = 0;
+    if (journal) {
+        ret = tp_journal_append(h, rec, rec_len);
+        pthread_mutex_unlock(&h->io_lock);
+        free(rec);
+    } else if (level == TP_DURABILITY_NONE) {
+        // Memory only
+    } else if (level == TP_DURABILITY_ASYNC) {
+        // Write-behind leaves persistence to the flusher
+        tp_mark_dirty(h);
+    } else if (!(h->flags & TP_OPEN_INPLACE) || n != 1 || tp_persist_inplace(h, u[0].e, wseq) != 0) {
+        ret = tp_persist(h);
+    }
+
+    // Undo only if no other batch was applied since; otherwise its write already covers ours
+    if (ret != 0) {
+        int reverted = 0;
+        pthread_rwlock_wrlock(&h->lock);
+        if (h->wseq == wseq) {
+            for (i = n; i-- > 0;) {
+                tp_value_restore(&u[i]);
+                u[i].old_in_arena = 0;
+                tp_version_touch(h, u[i].e);
+            }
+            tp_history_revert(h, u, n);
+            tp_cache_invalidate(h);
+            reverted = 1;
+        }
+        pthread_rwlock_unlock(&h->lock);
+        // A concurrent writer's version may have picked the change up, replace it
+        if (reverted) {
+            tp_snapshot_publish(h);
+        }
+        tp_changes_truncate(&changes, pulled);
+    } else {
+        // Snapshots only show what reached the level the write asked for
+        tp_snapshot_publish(h);
+    }
+    if (ret == 0 && h->shm) {
+        for (i = 0; i < n; i++) {
+            if (u[i].e->shm_slot) {
+                tp_shm_write(h->shm, u[i].e);
+            }
+        }
+        h->shm_wseq = ++h->shm->wseq;
+    }
+    if (h->shm) {
+        tp_shm_unlock(h);
+    }
+    tp_watch_notify(h, &changes);
+
+    // No reader can still see a replaced value once it was swapped out under the lock
+    for (i = 0; i < n; i++) {
+        if (!u[i].old_in_arena) {
+            tp_value_free(h, u[i].old);
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Replace a single leaf value, see tp_apply()
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume", used when k is NULL
+ * @param k Key handle, or NULL
+ * @param value Value to set
+ * @return int 0 on success, -1 on failure
+ */
+static int tp_store(tp_handle_t *h, const char *key, tp_key_t *k, const char *value)
+{
+    tp_update_t u = { .key = key, .k = k };
+
+    u.str = tp_value_dup(h, value);
+    if (!u.str) {
+        AML_LOGE("Memory allocation failed for value\n");
+        return -1;
+    }
+    return tp_apply(h, &u, 1, tp_durability(h));
+}
+
+/**
+ * @brief Duplicate the string value of a leaf node
+ *
+ * @param cur Leaf node, may be NULL
+ * @param key Key used for error reporting
+ * @return char* Newly allocated copy of the value, or NULL on failure
+ */
+static char *tp_dup_value(cJSON *cur, const char *key)
+{
+    if (!cur || !cur->valuestring) {
+        AML_LOGE("Key not found or invalid: %s\n", key);
+        return NULL;
+    }
+
+    char *result = strdup(cur->valuestring);
+    if (!result) {
+        AML_LOGE("Memory allocation failed for result\n");
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * @brief Duplicate the string value of an entry, from the shared store if it has a slot
+ *
+ * Must be called with h->lock held.
+ *
+ * @param h Handle to the JSON file
+ * @param e Entry, may be NULL
+ * @param key Key used for error reporting
+ * @return char* Newly allocated copy of the value, or NULL on failure
+ */
+static char *tp_dup_entry(tp_handle_t *h, tp_entry_t *e, const char *key)
+{
+    struct tp_shm_value v;
+
+    if (!tp_shm_get(h, e, &v)) {
+        return tp_dup_value(e ? e->node : NULL, key);
+    }
+    if (v.type != cJSON_String) {
+        AML_LOGE("Key not found or invalid: %s\n", key);
+        return NULL;
+    }
+    char *result = strdup(v.str);
+    if (!result) {
+        AML_LOGE("Memory allocation failed for result\n");
+    }
+    return result;
+}
+
+/**
+ * @brief Get a value from the JSON tree using a dotted key or single-level key
+ *
+ * Readers only share h->lock and run in parallel with each other.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume" or single-level "volume"
+ * @return char* Value corresponding to the key, or NULL if not found
+ */
+char* tp_get(tp_handle_t *h, char *key)
+{
+    if (!h || !key) {
+        AML_LOGE("Invalid handle or key\n");
+        return NULL;
+    }
+    struct tp_mount *m = tp_route(h, (const char **)&key);
+    if (m) {
+        return tp_get(m->h, key);
+    }
+    TP_STAT_ADD(h, gets, 1);
+    if (tp_bloom_reject(h, key)) {
+        AML_LOGE("Key not found: %s\n", key);
+        return NULL;
+    }
+    struct tp_cache_entry *ce = tp_cache_hit(h, key);
+    if (ce && ce->has_str) {
+        return strdup(ce->value);
+    }
+    if (h->image) {
+        tp_image_entry_t ie;
+        if (tp_image_find(h, key, &ie) < 0) {
+            return NULL;
+        }
+        if (!ie.value) {
+            AML_LOGE("Key not found or invalid: %s\n", key);
+            return NULL;
+        }
+        return strdup(ie.value);
+    }
+    if (!h->root) {
+        AML_LOGE("JSON root is empty\n");
+        return NULL;
+    }
+
+    tp_lazy_touch(h, key);
+    TP_STAT_TIMED(h, lock_wait, pthread_rwlock_rdlock(&h->lock));
+    tp_entry_t *e = tp_lookup_entry(h, key);
+    char *result = e ? tp_dup_entry(h, e, key) : NULL;
+    if (e) {
+        tp_cache_fill(h, key, e);
+    }
+    pthread_rwlock_unlock(&h->lock);
+
+    return result;
+}
+
+/**
+ * @brief Copy a string value into a buffer with snprintf() semantics
+ *
+ * @return int Length of the value, or -1 if there is none
+ */
+static int tp_copy_value(const char *value, const char *key, char *buf, size_t len)
+{
+    if (!value) {
+        AML_LOGE("Key not found or invalid: %s\n", key);
+        return -1;
+    }
+
+    size_t n = strlen(value);
+    if (len) {
+        size_t copy = n < len ? n : len - 1;
+        memcpy(buf, value, copy);
+        buf[copy] = '\0';
+    }
+    return (int)n;
+}
+
+/**
+ * @brief Copy a value into a caller-provided buffer, without heap allocation
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param buf Destination buffer, always NUL-terminated when len > 0
+ * @param len Size of buf
+ * @return int Length of the value, truncated if >= len, or -1 if not found
+ */
+int tp_get_into(tp_handle_t *h, const char *key, char *buf, size_t len)
+{
+    if (!h || !key || (!buf && len)) {
+        AML_LOGE("Invalid handle, key, or buffer\n");
+        return -1;
+    }
+    struct tp_mount *m = tp_route(h, &key);
+    if (m) {
+        return tp_get_into(m->h, key, buf, len);
+    }
+    if (h->image) {
+        return tp_copy_value(tp_get_ref(h, key), key, buf, len);
+    }
+    if (!h->root) {
+        AML_LOGE("JSON root is empty\n");
+        return -1;
+    }
+    TP_STAT_ADD(h, gets, 1);
+    if (tp_bloom_reject(h, key)) {
+        AML_LOGE("Key not found: %s\n", key);
+        return -1;
+    }
+    struct tp_cache_entry *ce = tp_cache_hit(h, key);
+    if (ce && ce->has_str) {
+        return tp_copy_value(ce->value, key, buf, len);
+    }
+
+    struct tp_shm_value v;
+    int ret = -1;
+    tp_lazy_touch(h, key);
+    TP_STAT_TIMED(h, lock_wait, pthread_rwlock_rdlock(&h->lock));
+    tp_entry_t *e = tp_lookup_entry(h, key);
+    if (tp_shm_get(h, e, &v)) {
+        ret = tp_copy_value(v.type == cJSON_String ? v.str : NULL, key, buf, len);
+    } else if (e) {
+        ret = tp_copy_value(e->node->valuestring, key, buf, len);
+        tp_cache_fill(h, key, e);
+    }
+    pthread_rwlock_unlock(&h->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Tell whether a key exists, without logging a miss
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @return int 1 if the key exists, 0 if not
+ */
+int tp_has(tp_handle_t *h, const char *key)
+{
+    if (!h || !key) {
+        AML_LOGE("Invalid handle or key\n");
+        return 0;
+    }
+    struct tp_mount *m = tp_route(h, &key);
+    if (m) {
+        return tp_has(m->h, key);
+    }
+    if (tp_bloom_reject(h, key)) {
+        return 0;
+    }
+    if (h->image) {
+        tp_image_entry_t ie;
+        return tp_image_probe(h, key, &ie) >= 0;
+    }
+    if (!h->root) {
+        return 0;
+    }
+
+    tp_lazy_touch(h, key);
+    TP_STAT_TIMED(h, lock_wait, pthread_rwlock_rdlock(&h->lock));
+    int found = tp_lookup_probe(h, key) != NULL;
+    pthread_rwlock_unlock(&h->lock);
+    return found;
+}
+
+/**
+ * @brief Copy the default of an optional value
+ */
+static char *tp_opt_default(const char *def)
+{
+    char *result = def ? strdup(def) : NULL;
+    if (def && !result) {
+        AML_LOGE("Memory allocation failed for result\n");
+    }
+    return result;
+}
+
+/**
+ * @brief Get an optional value, returning a copy of def when the key is absent
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param def Value to return when the key does not exist, may be NULL
+ * @return char* Newly allocated value or copy of def, NULL if def is NULL or on failure
+ */
+char *tp_get_opt(tp_handle_t *h, const char *key, const char *def)
+{
+    if (!h || !key) {
+        AML_LOGE("Invalid handle or key\n");
+        return NULL;
+    }
+    struct tp_mount *m = tp_route(h, &key);
+    if (m) {
+        return tp_get_opt(m->h, key, def);
+    }
+    TP_STAT_ADD(h, gets, 1);
+    if (tp_bloom_reject(h, key)) {
+        return tp_opt_default(def);
+    }
+    struct tp_cache_entry *ce = tp_cache_hit(h, key);
+    if (ce && ce->has_str) {
+        return strdup(ce->value);
+    }
+    if (h->image) {
+        tp_image_entry_t ie;
+        if (tp_image_probe(h, key, &ie) < 0) {
+            return tp_opt_default(def);
+        }
+        if (!ie.value) {
+            AML_LOGE("Key not found or invalid: %s\n", key);
+            return NULL;
+        }
+        return strdup(ie.value);
+    }
+    if (!h->root) {
+        AML_LOGE("JSON root is empty\n");
+        return NULL;
+    }
+
+    tp_lazy_touch(h, key);
+    TP_STAT_TIMED(h, lock_wait, pthread_rwlock_rdlock(&h->lock));
+    tp_entry_t *e = tp_lookup_probe(h, key);
+    char *result = e ? tp_dup_entry(h, e, key) : NULL;
+    if (e) {
+        tp_cache_fill(h, key, e);
+    }
+    pthread_rwlock_unlock(&h->lock);
+
+    return e ? result : tp_opt_default(def);
+}
+
+/**
+ * @brief Take h->lock for reading so borrowed values stay valid
+ *
+ * Mounted files are guarded too, in mount order, since tp_get_ref()
+ * borrows their values from their own trees.
+ *
+ * @param h Handle to the JSON file
+ */
+void tp_read_lock(tp_handle_t *h)
+{
+    if (h) {
+        // Borrowed values must not need a write lock to appear
+        tp_lazy_load_all(h);
+        for (struct tp_mount *m = h->mounts; m; m = m->next) {
+            tp_read_lock(m->h);
+        }
+        pthread_rwlock_rdlock(&h->lock);
+    }
+}
+
+/**
+ * @brief Release a read guard taken with tp_read_lock()
+ *
+ * @param h Handle to the JSON file
+ */
+void tp_read_unlock(tp_handle_t *h)
+{
+    if (h) {
+        pthread_rwlock_unlock(&h->lock);
+        for (struct tp_mount *m = h->mounts; m; m = m->next) {
+            tp_read_unlock(m->h);
+        }
+    }
+}
+
+/**
+ * @brief Borrow a value under a read guard
+ *
+ * Must be called between tp_read_lock() and tp_read_unlock().
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @return const char* Value owned by the tree, or NULL if not found
+ */
+const char *tp_get_ref(tp_handle_t *h, const char *key)
+{
+    struct tp_mount *m = h && key ? tp_route(h, &key) : NULL;
+    if (m) {
+        return tp_get_ref(m->h, key);
+    }
+    if (h && key && h->image) {
+        tp_image_entry_t ie;
+        TP_STAT_ADD(h, gets, 1);
+        if (tp_bloom_reject(h, key)) {
+            AML_LOGE("Key not found: %s\n", key);
+            return NULL;
+        }
+        return tp_image_find(h, key, &ie) < 0 ? NULL : ie.value;
+    }
+    if (!h || !key || !h->root) {
+        AML_LOGE("Invalid handle or key\n");
+        return NULL;
+    }
+    TP_STAT_ADD(h, gets, 1);
+    if (h->shm) {
+        AML_LOGE("Borrowed values are not available with TP_OPEN_SHARED\n");
+        return NULL;
+    }
+    if (tp_bloom_reject(h, key)) {
+        AML_LOGE("Key not found: %s\n", key);
+        return NULL;
+    }
+
+    cJSON *cur = tp_lookup(h, key);
+    return cur ? cur->valuestring : NULL;
+}
+
+/**
+ * @brief Append a path segment to a key being built
+ *
+ * @param dot Put a dot before the segment
+ * @return int Length added, or -1 if the buffer is too small
+ */
+static int tp_key_append(char *key, size_t cap, size_t len, const char *seg, int dot)
+{
+    int n = snprintf(key + len, cap - len, "%s%s", dot ? "." : "", seg);
+    if (n < 0 || (size_t)n >= cap - len) {
+        key[len] = '\0';
+        AML_LOGE("Key buffer too small for %s below %s\n", seg, key);
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief Visit the leaves of a compiled image under a prefix
+ *
+ * Keys are sorted by case-folded key, so the subtree is one run of the table.
+ *
+ * @return int 1 if the walk was stopped, 0 when done, -1 on failure
+ */
+static int tp_image_subtree(tp_handle_t *h, const char *prefix, char *key, size_t cap, size_t base,
+                            tp_visit_cb visit, void *ctx, int *count, int *found)
+{
+    size_t plen = strlen(prefix);
+    uint32_t total = tp_image_u32(h, 8);
+    if (!plen) {
+        *found = 1;
+    }
+    uint32_t lo = 0;
+    uint32_t hi = total;
+    tp_image_entry_t ie;
+    char buf[32];
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (tp_image_decode(h, mid, &ie) != 0) {
+            AML_LOGE("Corrupt entry %u in image %s\n", mid, h->filename);
+            return -1;
+        }
+        if (strcasecmp(ie.key, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < total; lo++) {
+        if (tp_image_decode(h, lo, &ie) != 0) {
+            AML_LOGE("Corrupt entry %u in image %s\n", lo, h->filename);
+            return -1;
+        }
+        if (strncasecmp(ie.key, prefix, plen) != 0) {
+            break;
+        }
+        const char *rest = ie.key;
+        if ((plen && ie.key[plen] != '\0' && ie.key[plen] != '.') || tp_route(h, &rest)) {
+            continue;
+        }
+        if (tp_key_append(key, cap, base, ie.key, 0) < 0) {
+            return -1;
+        }
+        *found = 1;
+        (*count)++;
+        int stop = visit(h, key, tp_leaf_text(ie.type, ie.value, ie.num, buf), ctx);
+        key[base] = '\0';
+        if (stop) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Visit one leaf, skipping duplicates shadowed in the index
+ *
+ * Must be called with h->lock held for reading.
+ *
+ * @param key Full key, the part from base on is the path within h
+ * @return int 1 to stop the walk, 0 to go on
+ */
+static int tp_subtree_leaf(tp_handle_t *h, cJSON *n, const char *key, size_t base, tp_visit_cb visit,
+                           void *ctx, int *count)
+{
+    struct tp_shm_value v;
+    char buf[32];
+    tp_entry_t *e = tp_index_find(h->index, key + base);
+
+    if (!e || e->node != n) {
+        return 0;
+    }
+    (*count)++;
+    if (tp_shm_get(h, e, &v)) {
+        return visit(h, key, tp_leaf_text(v.type, v.str, v.num, buf), ctx) != 0;
+    }
+    return visit(h, key, tp_leaf_text(n->type & 0xFF, n->valuestring, n->valuedouble, buf), ctx) != 0;
+}
+
+/**
+ * @brief Visit the leaves below an object, extending the key in place
+ *
+ * Must be called with h->lock held for reading. Objects at a mount point
+ * are skipped, the mounted file answers for them.
+ *
+ * @return int 1 if the walk was stopped, 0 when done, -1 if a key does not fit
+ */
+static int tp_subtree_walk(tp_handle_t *h, cJSON *node, char *key, size_t cap, size_t base, size_t len,
+                           tp_visit_cb visit, void *ctx, int *count)
+{
+    for (cJSON *c = node->child; c; c = c->next) {
+        if (!c->string) {
+            continue;
+        }
+        int n = tp_key_append(key, cap, len, c->string, len > base);
+        if (n < 0) {
+            return -1;
+        }
+        int ret = 0;
+        if (c->type != cJSON_Object) {
+            ret = tp_subtree_leaf(h, c, key, base, visit, ctx, count);
+        } else if (!h->mounts || !tp_mount_point(h, key + base)) {
+            ret = tp_subtree_walk(h, c, key, cap, base, len + n, visit, ctx, count);
+        }
+        key[len] = '\0';
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Visit the own leaves of a handle under a prefix
+ *
+ * @return int 1 if the walk was stopped, 0 when done, -1 on failure
+ */
+static int tp_tree_subtree(tp_handle_t *h, const char *prefix, char *key, size_t cap, size_t base,
+                           tp_visit_cb visit, void *ctx, int *count, int *found)
+{
+    int ret = 0;
+    size_t len = base;
+
+    if (tp_lazy_load_all(h) != 0) {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&h->lock);
+
+    // Descend to the prefix node, building the key from the names in the file
+    cJSON *node = h->root;
+    const char *p = prefix;
+    while (*p) {
+        const char *dot = strchr(p, '.');
+        size_t seg = dot ? (size_t)(dot - p) : strlen(p);
+        cJSON *c = NULL;
+        if (node->type == cJSON_Object) {
+            for (c = node->child; c; c = c->next) {
+                if (c->string && strlen(c->string) == seg && strncasecmp(c->string, p, seg) == 0) {
+                    break;
+                }
+            }
+        }
+        if (!c) {
+            goto out;
+        }
+        int n = tp_key_append(key, cap, len, c->string, len > base);
+        if (n < 0) {
+            ret = -1;
+            goto out;
+        }
+        len += n;
+        node = c;
+        p += seg;
+        if (*p == '.') {
+            p++;
+        }
+    }
+
+    *found = 1;
+    if (node->type == cJSON_Object) {
+        ret = tp_subtree_walk(h, node, key, cap, base, len, visit, ctx, count);
+    } else {
+        ret = tp_subtree_leaf(h, node, key, base, visit, ctx, count);
+    }
+
+out:
+    pthread_rwlock_unlock(&h->lock);
+    key[base] = '\0';
+    return ret;
+}
+
+static int tp_subtree(tp_handle_t *h, const char *prefix, char *key, size_t cap, size_t base,
+                      tp_visit_cb visit, void *ctx, int *count, int *found);
+
+/**
+ * @brief Visit a prefix of a mounted file, with the mount prefix leading its keys
+ */
+static int tp_subtree_mount(struct tp_mount *m, const char *prefix, char *key, size_t cap, size_t base,
+                            tp_visit_cb visit, void *ctx, int *count, int *found)
+{
+    int n = tp_key_append(key, cap, base, m->prefix, 0);
+    if (n < 0 || base + n + 1 >= cap) {
+        AML_LOGE("Key buffer too small for %s\n", m->prefix);
+        key[base] = '\0';
+        return -1;
+    }
+    key[base + n] = '.';
+    key[base + n + 1] = '\0';
+    int ret = tp_subtree(m->h, prefix, key, cap, base + n + 1, visit, ctx, count, found);
+    key[base] = '\0';
+    return ret;
+}
+
+/**
+ * @brief Visit every leaf under a prefix of a handle and of the files mounted below it
+ *
+ * @param key Buffer holding the first base bytes of every key
+ * @return int 1 if the walk was stopped, 0 when done, -1 on failure
+ */
+static int tp_subtree(tp_handle_t *h, const char *prefix, char *key, size_t cap, size_t base,
+                      tp_visit_cb visit, void *ctx, int *count, int *found)
+{
+    const char *rest = prefix;
+    struct tp_mount *m = tp_route(h, &rest);
+    for (struct tp_mount *p = h->mounts; p && !m; p = p->next) {
+        if (strcasecmp(prefix, p->prefix) == 0) {
+            m = p;
+            rest = "";
+        }
+    }
+    if (m) {
+        return tp_subtree_mount(m, rest, key, cap, base, visit, ctx, count, found);
+    }
+
+    int ret;
+    if (h->image) {
+        ret = tp_image_subtree(h, prefix, key, cap, base, visit, ctx, count, found);
+    } else if (h->root) {
+        ret = tp_tree_subtree(h, prefix, key, cap, base, visit, ctx, count, found);
+    } else {
+        AML_LOGE("JSON root is empty\n");
+        return -1;
+    }
+
+    // Mounts at or below the prefix contribute their whole tree
+    size_t plen = strlen(prefix);
+    for (m = h->mounts; m && ret == 0; m = m->next) {
+        if (plen && (strncasecmp(m->prefix, prefix, plen) != 0 || m->prefix[plen] != '.')) {
+            continue;
+        }
+        ret = tp_subtree_mount(m, "", key, cap, base, visit, ctx, count, found);
+    }
+    return ret;
+}
+
+/**
+ * @brief Visit every leaf under a prefix in one read-locked pass
+ *
+ * @param h Handle to the JSON file
+ * @param prefix Dotted path of an object or leaf, NULL or "" for the whole tree
+ * @param key Buffer to build keys in
+ * @param key_len Size of key
+ * @param visit Called for each leaf
+ * @param ctx Passed to visit
+ * @return int Number of leaves visited, or -1 if the prefix is not found or a key does not fit
+ */
+int tp_get_subtree(tp_handle_t *h, const char *prefix, char *key, size_t key_len, tp_visit_cb visit,
+                   void *ctx)
+{
+    if (!h || !key || !key_len || !visit) {
+        AML_LOGE("Invalid handle, key buffer or visitor\n");
+        return -1;
+    }
+
+    int count = 0;
+    int found = 0;
+    key[0] = '\0';
+    if (tp_subtree(h, prefix ? prefix : "", key, key_len, 0, visit, ctx, &count, &found) < 0) {
+        return -1;
+    }
+    if (!found) {
+        AML_LOGE("Key not found: %s\n", prefix);
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * @brief Set a value in the JSON tree using a dotted key or single-level key and write to file
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume" or single-level "volume"
+ * @param value Value to set
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set(tp_handle_t *h, char *key, char *value)
+{
+    if (!h || !key || !value || !h->filename) {
+        AML_LOGE("Invalid handle, key, value, or filename\n");
+        return -1;
+    }
+    struct tp_mount *m = tp_route(h, (const char **)&key);
+    if (m) {
+        return tp_set(m->h, key, value);
+    }
+    if (!h->root) {
+        AML_LOGE("JSON root is empty\n");
+        return -1;
+    }
+
+    return tp_store(h, key, NULL, value);
+}
+
+/**
+ * @brief Resolve a dotted key once into a reusable key handle
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume" or single-level "volume"
+ * @return tp_key_t* Key handle, or NULL if the key does not exist
+ */
+tp_key_t *tp_key_resolve(tp_handle_t *h, const char *key)
+{
+    if (!h || !key) {
+        AML_LOGE("Invalid handle or key\n");
+        return NULL;
+    }
+    struct tp_mount *m = tp_route(h, &key);
+    if (m) {
+        tp_key_t *k = tp_key_resolve(m->h, key);
+        if (k) {
+            k->shard = m->h;
+        }
+        return k;
+    }
+    if (!h->root && !h->image) {
+        AML_LOGE("JSON root is empty\n");
+        return NULL;
+    }
+
+    tp_key_t *k = (tp_key_t *)calloc(1, sizeof(tp_key_t));
+    if (!k) {
+        AML_LOGE("Memory allocation failed for key handle\n");
+        return NULL;
+    }
+    k->path = strdup(key);
+    if (!k->path) {
+        AML_LOGE("Memory allocation failed for key\n");
+        free(k);
+        return NULL;
+    }
+
+    if (h->image) {
+        tp_image_entry_t ie;
+        k->slot = tp_image_find(h, key, &ie);
+        if (k->slot < 0) {
+            tp_key_free(k);
+            return NULL;
+        }
+        return k;
+    }
+
+    tp_lazy_touch(h, key);
+    pthread_rwlock_rdlock(&h->lock);
+    k->entry = tp_lookup_entry(h, key);
+    k->gen = h->gen;
+    pthread_rwlock_unlock(&h->lock);
+
+    if (!k->entry) {
+        tp_key_free(k);
+        return NULL;
+    }
+    return k;
+}
+
+/**
+ * @brief Release a key handle
+ *
+ * @param k Key handle, may be NULL
+ */
+void tp_key_free(tp_key_t *k)
+{
+    if (k) {
+        free(k->path);
+        free(k);
+    }
+}
+
+/**
+ * @brief Get a value through a resolved key handle
+ *
+ * @param h Handle to the JSON file
+ * @param k Key handle from tp_key_resolve()
+ * @return char* Value corresponding to the key, or NULL if not found
+ */
+char *tp_get_h(tp_handle_t *h, tp_key_t *k)
+{
+    if (!h || !k) {
+        AML_LOGE("Invalid handle or key handle\n");
+        return NULL;
+    }
+    if (k->shard) {
+        h = k->shard;
+    }
+    TP_STAT_ADD(h, gets, 1);
+    if (h->image) {
+        tp_image_entry_t ie;
+        if (tp_image_decode(h, (uint32_t)k->slot, &ie) != 0 || !ie.value) {
+            AML_LOGE("Key not found or invalid: %s\n", k->path);
+            return NULL;
+        }
+        return strdup(ie.value);
+    }
+
+    TP_STAT_TIMED(h, lock_wait, pthread_rwlock_rdlock(&h->lock));
+    tp_entry_t *e = tp_key_entry(h, k);
+    char *result = tp_dup_entry(h, e, k->path);
+    pthread_rwlock_unlock(&h->lock);
+
+    return result;
+}
+
+/**
+ * @brief Set a value through a resolved key handle and write to file
+ *
+ * @param h Handle to the JSON file
+ * @param k Key handle from tp_key_resolve()
+ * @param value Value to set
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_h(tp_handle_t *h, tp_key_t *k, const char *value)
+{
+    if (!h || !k || !value || !h->filename) {
+        AML_LOGE("Invalid handle, key handle, value, or filename\n");
+        return -1;
+    }
+
+    return tp_store(k->shard ? k->shard : h, NULL, k, value);
+}
+
+/*
+ * Background writes (tp_set_async)
+ *
+ * The update is applied in memory with TP_DURABILITY_NONE and a completion
+ * request queued for the handle's I/O worker. The worker takes the whole
+ * queue at once, writes the tree if anything is still unwritten and
+ * reports the result of that one write to every request it took, all of
+ * which were already in the tree when it was serialized.
+ */
+struct tp_async {
+    tp_handle_t *h;         // Handle passed to tp_set_async(), reported to cb
+    char *key;              // Key passed to tp_set_async()
+    tp_done_cb cb;          // Completion callback, or NULL
+    void *ctx;              // Passed to cb
+    struct tp_async *next;  // Next request in queue order
+};
+
+/**
+ * @brief Write what tp_set_async() left in memory, as tp_set() would at the handle's level
+ *
+ * @return int 0 on success or nothing to write, -1 on failure
+ */
+static int tp_async_write(tp_handle_t *h)
+{
+    if (tp_durability(h) == TP_DURABILITY_NONE) {
+        return 0;
+    }
+
+    TP_STAT_TIMED(h, lock_wait, pthread_mutex_lock(&h->io_lock));
+    pthread_rwlock_rdlock(&h->lock);
+    int pending = h->wseq != h->pseq;
+    pthread_rwlock_unlock(&h->lock);
+    int ret = 0;
+    if (h->flags & TP_OPEN_JOURNAL) {
+        // The journal has no record of the change, so it has to go into the base file
+        ret = tp_journal_compact(h);
+    } else if (pending) {
+        ret = tp_persist_locked(h);
+    }
+    pthread_mutex_unlock(&h->io_lock);
+    return ret;
+}
+
+static void *tp_async_worker(void *arg)
+{
+    tp_handle_t *h = (tp_handle_t *)arg;
+
+    pthread_mutex_lock(&h->async_lock);
+    for (;;) {
+        while (!h->async_head && !h->async_stop) {
+            pthread_cond_wait(&h->async_cond, &h->async_lock);
+        }
+        struct tp_async *a = h->async_head;
+        if (!a) {
+            break;
+        }
+        h->async_head = NULL;
+        h->async_tail = &h->async_head;
+        pthread_mutex_unlock(&h->async_lock);
+
+        int ret = tp_async_write(h);
+        while (a) {
+            struct tp_async *next = a->next;
+            if (a->cb) {
+                a->cb(a->h, a->key, ret, a->ctx);
+            }
+            free(a->key);
+            free(a);
+            a = next;
+        }
+        pthread_mutex_lock(&h->async_lock);
+    }
+    pthread_mutex_unlock(&h->async_lock);
+    return NULL;
+}
+
+/**
+ * @brief Stop the I/O worker after it wrote every queued request
+ */
+static void tp_async_fini(tp_handle_t *h)
+{
+    pthread_mutex_lock(&h->async_lock);
+    int running = h->async_running;
+    h->async_stop = 1;
+    pthread_cond_signal(&h->async_cond);
+    pthread_mutex_unlock(&h->async_lock);
+    if (running) {
+        pthread_join(h->async_worker, NULL);
+    }
+    pthread_cond_destroy(&h->async_cond);
+    pthread_mutex_destroy(&h->async_lock);
+}
+
+/**
+ * @brief Set a value in memory and queue writing it to file
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume" or single-level "volume"
+ * @param value Value to set
+ * @param cb Completion callback, may be NULL
+ * @param ctx Passed to cb
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_async(tp_handle_t *h, const char *key, const char *value, tp_done_cb cb, void *ctx)
+{
+    if (!h || !key || !value || !h->filename) {
+        AML_LOGE("Invalid handle, key, value, or filename\n");
+        return -1;
+    }
+    // The write is queued on the handle serving the key, the callback gets what the caller passed
+    tp_handle_t *t = h;
+    const char *rest = key;
+    for (struct tp_mount *m; (m = tp_route(t, &rest));) {
+        t = m->h;
+    }
+    if (!t->root) {
+        AML_LOGE("JSON root is empty\n");
+        return -1;
+    }
+
+    struct tp_async *a = (struct tp_async *)calloc(1, sizeof(struct tp_async));
+    if (!a || !(a->key = strdup(key))) {
+        AML_LOGE("Memory allocation failed for write request\n");
+        free(a);
+        return -1;
+    }
+    a->h = h;
+    a->cb = cb;
+    a->ctx = ctx;
+
+    // Start the worker before touching the tree, so a failure changes nothing
+    pthread_mutex_lock(&t->async_lock);
+    if (!t->async_running) {
+        if (t->async_stop || pthread_create(&t->async_worker, NULL, tp_async_worker, t) != 0) {
+            pthread_mutex_unlock(&t->async_lock);
+            AML_LOGE("Failed to start I/O worker thread\n");
+            free(a->key);
+            free(a);
+            return -1;
+        }
+        t->async_running = 1;
+    }
+    pthread_mutex_unlock(&t->async_lock);
+
+    tp_update_t u = { .key = rest };
+    u.str = tp_value_dup(t, value);
+    if (!u.str) {
+        AML_LOGE("Memory allocation failed for value\n");
+        free(a->key);
+        free(a);
+        return -1;
+    }
+    if (tp_apply(t, &u, 1, TP_DURABILITY_NONE) != 0) {
+        free(a->key);
+        free(a);
+        return -1;
+    }
+
+    pthread_mutex_lock(&t->async_lock);
+    *t->async_tail = a;
+    t->async_tail = &a->next;
+    pthread_cond_signal(&t->async_cond);
+    pthread_mutex_unlock(&t->async_lock);
+    return 0;
+}
+
+/**
+ * @brief Pin the latest published version of the tree for lock-free reads
+ *
+ * Only a store to the calling thread's own slot is made; the first call on a
+ * thread registers that slot. Acquires nest, each needs a matching release.
+ *
+ * @param h Handle opened with TP_OPEN_SNAPSHOT
+ * @return tp_snapshot_t* Snapshot, or NULL on failure
+ */
+tp_snapshot_t *tp_snapshot_acquire(tp_handle_t *h)
+{
+    if (!h || !(h->flags & TP_OPEN_SNAPSHOT)) {
+        AML_LOGE("Invalid handle or snapshots not enabled\n");
+        return NULL;
+    }
+
+    struct tp_snapshot *s = (struct tp_snapshot *)pthread_getspecific(h->snap_key);
+    if (!s) {
+        // Reuse a slot left by an exited thread, or register a new one
+        pthread_mutex_lock(&h->snap_lock);
+        for (s = h->readers; s; s = s->next) {
+            if (!__atomic_load_n(&s->in_use, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+        }
+        if (!s) {
+            if (posix_memalign((void **)&s, TP_CACHELINE, sizeof(*s)) != 0) {
+                AML_LOGE("Memory allocation failed for snapshot slot\n");
+                pthread_mutex_unlock(&h->snap_lock);
+                return NULL;
+            }
+            memset(s, 0, sizeof(*s));
+            s->next = h->readers;
+            h->readers = s;
+        }
+        s->in_use = 1;
+        pthread_mutex_unlock(&h->snap_lock);
+        pthread_setspecific(h->snap_key, s);
+    }
+
+    if (s->depth++ > 0) {
+        return s;
+    }
+
+    // Announce the version, then confirm it was not retired in between
+    struct tp_version *v = __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+    for (;;) {
+        __atomic_store_n(&s->hp, v, __ATOMIC_SEQ_CST);
+        struct tp_version *cur = __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+        if (cur == v) {
+            break;
+        }
+        v = cur;
+    }
+    return s;
+}
+
+/**
+ * @brief Get a value from a snapshot
+ *
+ * @param s Snapshot from tp_snapshot_acquire()
+ * @param key Key in format "system.audio.volume"
+ * @return char* Value corresponding to the key, or NULL if not found
+ */
+char *tp_snapshot_get(tp_snapshot_t *s, const char *key)
+{
+    if (!s || !key || !s->hp) {
+        AML_LOGE("Invalid snapshot or key\n");
+        return NULL;
+    }
+
+    return tp_dup_value(tp_version_find(s->hp, key), key);
+}
+
+/**
+ * @brief Borrow a value from a snapshot
+ *
+ * @param s Snapshot from tp_snapshot_acquire()
+ * @param key Key in format "system.audio.volume"
+ * @return const char* Value owned by the snapshot, valid until it is released, or NULL
+ */
+const char *tp_snapshot_peek(tp_snapshot_t *s, const char *key)
+{
+    if (!s || !key || !s->hp) {
+        AML_LOGE("Invalid snapshot or key\n");
+        return NULL;
+    }
+
+    cJSON *n = tp_version_find(s->hp, key);
+    return n ? n->valuestring : NULL;
+}
+
+/**
+ * @brief Release a snapshot, letting its version be reclaimed
+ *
+ * @param s Snapshot from tp_snapshot_acquire(), may be NULL
+ */
+void tp_snapshot_release(tp_snapshot_t *s)
+{
+    if (s && s->depth > 0 && --s->depth == 0) {
+        __atomic_store_n(&s->hp, NULL, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Write pending write-behind changes to file now
+ *
+ * @param h Handle to the JSON file
+ * @return int 0 on success or nothing pending, -1 on failure
+ */
+int tp_flush(tp_handle_t *h)
+{
+    if (!h) {
+        AML_LOGE("Invalid handle\n");
+        return -1;
+    }
+    int ret = 0;
+    for (struct tp_mount *m = h->mounts; m; m = m->next) {
+        if (tp_flush(m->h) != 0) {
+            ret = -1;
+        }
+    }
+    if (!__atomic_load_n(&h->flusher_running, __ATOMIC_ACQUIRE)) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&h->flush_lock);
+    int dirty = h->dirty;
+    h->dirty = 0;
+    pthread_mutex_unlock(&h->flush_lock);
+    if (!dirty) {
+        return ret;
+    }
+
+    if (tp_persist(h) != 0) {
+        tp_mark_dirty(h);
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Change how tp_set() persists on this handle
+ *
+ * @param h Handle to the JSON file
+ * @param level New durability level
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_durability(tp_handle_t *h, tp_durability_t level)
+{
+    if (!h || (unsigned int)level > TP_DURABILITY_FULL) {
+        AML_LOGE("Invalid handle or durability level\n");
+        return -1;
+    }
+    if (level == TP_DURABILITY_ASYNC && (h->flags & TP_OPEN_JOURNAL)) {
+        AML_LOGE("TP_DURABILITY_ASYNC is not available with TP_OPEN_JOURNAL\n");
+        return -1;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&h->io_lock);
+    if (level == TP_DURABILITY_ASYNC && !h->flusher_running) {
+        if (tp_flush_init(h, h->flush_interval_ms) != 0) {
+            AML_LOGE("Failed to start flusher thread\n");
+            pthread_mutex_unlock(&h->io_lock);
+            return -1;
+        }
+        __atomic_store_n(&h->flusher_running, 1, __ATOMIC_RELEASE);
+    }
+    int prev = __atomic_exchange_n(&h->durability, (int)level, __ATOMIC_RELAXED);
+
+    // Catch up on what the weaker level left unwritten
+    if (level == TP_DURABILITY_RENAME || level == TP_DURABILITY_FULL) {
+        if (h->flags & TP_OPEN_JOURNAL) {
+            if (prev == TP_DURABILITY_NONE) {
+                ret = tp_journal_compact(h);
+            }
+        } else if (prev == TP_DURABILITY_NONE || prev == TP_DURABILITY_ASYNC) {
+            pthread_rwlock_rdlock(&h->lock);
+            int pending = h->wseq != h->pseq;
+            pthread_rwlock_unlock(&h->lock);
+            if (pending) {
+                ret = tp_persist_locked(h);
+            }
+        }
+    }
+    pthread_mutex_unlock(&h->io_lock);
+    return ret;
+}
+
+/**
+ * @brief Start a batch of updates that is applied atomically
+ *
+ * @param h Handle to the JSON file
+ * @return tp_txn_t* Transaction, or NULL on failure
+ */
+tp_txn_t *tp_txn_begin(tp_handle_t *h)
+{
+    if (!h || !h->root) {
+        AML_LOGE("Invalid handle or JSON root is empty\n");
+        return NULL;
+    }
+
+    tp_txn_t *t = (tp_txn_t *)calloc(1, sizeof(tp_txn_t));
+    if (!t) {
+        AML_LOGE("Memory allocation failed for transaction\n");
+        return NULL;
+    }
+    t->base = h;
+    t->h = h;
+    return t;
+}
+
+/**
+ * @brief Stage a value in a transaction
+ *
+ * Nothing is visible to readers until tp_txn_commit().
+ *
+ * @param t Transaction from tp_txn_begin()
+ * @param key Key in format "system.audio.volume"
+ * @param value Value to set
+ * @return int 0 on success, -1 on failure
+ */
+int tp_txn_set(tp_txn_t *t, const char *key, const char *value)
+{
+    if (!t || !key || !value) {
+        AML_LOGE("Invalid transaction, key, or value\n");
+        return -1;
+    }
+
+    // A batch is atomic within one file only
+    struct tp_mount *m = tp_route(t->base, &key);
+    tp_handle_t *target = m ? m->h : t->base;
+    if (t->count && target != t->h) {
+        AML_LOGE("Key %s is in another file than the rest of the transaction\n", key);
+        return -1;
+    }
+    t->h = target;
+
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 16;
+        tp_update_t *ups = (tp_update_t *)realloc(t->ups, cap * sizeof(tp_update_t));
+        if (!ups) {
+            AML_LOGE("Memory allocation failed for transaction\n");
+            return -1;
+        }
+        t->ups = ups;
+        t->cap = cap;
+    }
+
+    tp_update_t *u = &t->ups[t->count];
+    memset(u, 0, sizeof(*u));
+    u->key = strdup(key);
+    u->str = tp_value_dup(t->h, value);
+    if (!u->key || !u->str) {
+        AML_LOGE("Memory allocation failed for key or value\n");
+        free((char *)u->key);
+        tp_value_free(t->h, u->str);
+        return -1;
+    }
+    t->count++;
+    return 0;
+}
+
+/**
+ * @brief Release a transaction and its staged keys
+ *
+ * @param t Transaction, its values must already be consumed or freed
+ */
+static void tp_txn_free(tp_txn_t *t)
+{
+    for (size_t i = 0; i < t->count; i++) {
+        free((char *)t->ups[i].key);
+    }
+    free(t->ups);
+    free(t);
+}
+
+/**
+ * @brief Apply all staged values under one lock and persist once
+ *
+ * Fails without changing anything if any key does not exist. The
+ * transaction is released either way.
+ *
+ * @param t Transaction from tp_txn_begin()
+ * @return int 0 on success, -1 on failure
+ */
+int tp_txn_commit(tp_txn_t *t)
+{
+    if (!t) {
+        AML_LOGE("Invalid transaction\n");
+        return -1;
+    }
+
+    int ret = t->count ? tp_apply(t->h, t->ups, t->count, tp_durability(t->h)) : 0;
+    tp_txn_free(t);
+    return ret;
+}
+
+/**
+ * @brief Discard a transaction without applying it
+ *
+ * @param t Transaction from tp_txn_begin(), may be NULL
+ */
+void tp_txn_abort(tp_txn_t *t)
+{
+    if (t) {
+        for (size_t i = 0; i < t->count; i++) {
+            tp_value_free(t->h, t->ups[i].str);
+        }
+        tp_txn_free(t);
+    }
+}
+
+/**
+ * @brief Copy the most recent recorded changes, newest first
+ *
+ * @param h Handle to the JSON file
+ * @param out Receives up to max entries
+ * @param max Capacity of out
+ * @return int Number of entries copied, -1 on failure
+ */
+int tp_history(tp_handle_t *h, tp_history_t *out, size_t max)
+{
+    if (!h || (!out && max)) {
+        AML_LOGE("Invalid handle or output\n");
+        return -1;
+    }
+    if (!h->history) {
+        AML_LOGE("History is not enabled for %s\n", h->filename);
+        return -1;
+    }
+
+    size_t count = 0;
+    pthread_rwlock_rdlock(&h->lock);
+    for (unsigned long seq = h->history_seq; count < max && count < INT_MAX; seq--) {
+        struct tp_history_slot *s = tp_history_slot(h, seq);
+        if (!s) {
+            break;
+        }
+        if (!s->undone) {
+            out[count++] = s->c;
+        }
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return (int)count;
+}
+
+/**
+ * @brief Apply the old values of the last n recorded changes as one batch
+ *
+ * @param h Handle to the JSON file
+ * @param n Number of changes to undo
+ * @return int Number of changes undone, -1 on failure
+ */
+int tp_rollback(tp_handle_t *h, size_t n)
+{
+    if (!h || !h->filename) {
+        AML_LOGE("Invalid handle or filename\n");
+        return -1;
+    }
+    if (!h->history) {
+        AML_LOGE("History is not enabled for %s\n", h->filename);
+        return -1;
+    }
+    if (n > h->history_cap) {
+        n = h->history_cap;
+    }
+    if (!n) {
+        return 0;
+    }
+    tp_update_t *u = (tp_update_t *)calloc(n, sizeof(tp_update_t));
+    if (!u) {
+        AML_LOGE("Memory allocation failed for rollback\n");
+        return -1;
+    }
+
+    // Newest first, so a key changed several times ends at its oldest value
+    size_t count = 0;
+    int ret = 0;
+    pthread_rwlock_rdlock(&h->lock);
+    for (unsigned long seq = h->history_seq; count < n; seq--) {
+        struct tp_history_slot *s = tp_history_slot(h, seq);
+        if (!s || s->c.truncated) {
+            break;
+        }
+        if (s->undone) {
+            continue;
+        }
+        u[count].key = strdup(s->c.key);
+        u[count].str = tp_value_dup(h, s->c.old_value);
+        u[count].undo = seq;
+        if (!u[count].key || !u[count].str) {
+            AML_LOGE("Memory allocation failed for rollback\n");
+            free((char *)u[count].key);
+            tp_value_free(h, u[count].str);
+            ret = -1;
+            break;
+        }
+        count++;
+    }
+    pthread_rwlock_unlock(&h->lock);
+
+    if (ret == 0 && count) {
+        ret = tp_apply(h, u, count, tp_durability(h));
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            tp_value_free(h, u[i].str);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        free((char *)u[i].key);
+    }
+    free(u);
+    return ret == 0 ? (int)count : -1;
+}
+
+/**
+ * @brief Read the cached native value of a leaf under the read lock
+ *
+ * @return int 0 on success, -1 if missing or not convertible
+ */
+static int tp_get_native(tp_handle_t *h, const char *key, int flag, double *num, int *bval)
+{
+    struct tp_mount *m = h && key ? tp_route(h, &key) : NULL;
+    if (m) {
+        return tp_get_native(m->h, key, flag, num, bval);
+    }
+    if (h && key && h->image) {
+        tp_image_entry_t ie;
+        TP_STAT_ADD(h, gets, 1);
+        if (tp_bloom_reject(h, key)) {
+            AML_LOGE("Key not found: %s\n", key);
+            return -1;
+        }
+        if (tp_image_find(h, key, &ie) < 0) {
+            return -1;
+        }
+        if (!(ie.vflags & flag)) {
+            AML_LOGE("Value of %s is not a %s\n", key, flag == TP_VAL_NUM ? "number" : "boolean");
+            return -1;
+        }
+        *num = ie.num;
+        *bval = ie.num != 0;
+        return 0;
+    }
+    if (!h || !key || !h->root) {
+        AML_LOGE("Invalid handle or key\n");
+        return -1;
+    }
+
+    TP_STAT_ADD(h, gets, 1);
+    if (tp_bloom_reject(h, key)) {
+        AML_LOGE("Key not found: %s\n", key);
+        return -1;
+    }
+    struct tp_cache_entry *ce = tp_cache_hit(h, key);
+    if (ce && (ce->vflags & flag)) {
+        *num = ce->num;
+        *bval = ce->bval;
+        return 0;
+    }
+
+    int ret = -1;
+    tp_lazy_touch(h, key);
+    TP_STAT_TIMED(h, lock_wait, pthread_rwlock_rdlock(&h->lock));
+    tp_entry_t *e = tp_lookup_entry(h, key);
+    struct tp_shm_value v;
+    if (tp_shm_get(h, e, &v)) {
+        if (v.vflags & flag) {
+            *num = v.num;
+            *bval = v.bval;
+            ret = 0;
+        } else {
+            AML_LOGE("Value of %s is not a %s\n", key, flag == TP_VAL_NUM ? "number" : "boolean");
+        }
+    } else if (e && (e->vflags & flag)) {
+        *num = e->num;
+        *bval = e->bval;
+        tp_cache_fill(h, key, e);
+        ret = 0;
+    } else if (e) {
+        AML_LOGE("Value of %s is not a %s\n", key, flag == TP_VAL_NUM ? "number" : "boolean");
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return ret;
+}
+
+/**
+ * @brief Get a value as an integer
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param out Receives the value, truncated toward zero and clamped to int
+ * @return int 0 on success, -1 on failure
+ */
+int tp_get_int(tp_handle_t *h, const char *key, int *out)
+{
+    double num;
+    int bval;
+
+    if (!out || tp_get_native(h, key, TP_VAL_NUM, &num, &bval) != 0) {
+        return -1;
+    }
+    *out = num >= INT_MAX ? INT_MAX : num <= INT_MIN ? INT_MIN : (int)num;
+    return 0;
+}
+
+/**
+ * @brief Get a value as a double
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param out Receives the value
+ * @return int 0 on success, -1 on failure
+ */
+int tp_get_double(tp_handle_t *h, const char *key, double *out)
+{
+    int bval;
+
+    if (!out || tp_get_native(h, key, TP_VAL_NUM, out, &bval) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get a value as a boolean
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.mute"
+ * @param out Receives 1 or 0
+ * @return int 0 on success, -1 on failure
+ */
+int tp_get_bool(tp_handle_t *h, const char *key, int *out)
+{
+    double num;
+
+    if (!out || tp_get_native(h, key, TP_VAL_BOOL, &num, out) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Set an integer value
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param value Value to set
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_int(tp_handle_t *h, const char *key, int value)
+{
+    char buf[16];
+
+    snprintf(buf, sizeof(buf), "%d", value);
+    return tp_set(h, (char *)key, buf);
+}
+
+/**
+ * @brief Set a double value
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.gain"
+ * @param value Value to set, must be finite
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_double(tp_handle_t *h, const char *key, double value)
+{
+    char buf[32];
+
+    tp_format_num(value, buf);
+    return tp_set(h, (char *)key, buf);
+}
+
+/**
+ * @brief Set a boolean value
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.mute"
+ * @param value Nonzero for true
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_bool(tp_handle_t *h, const char *key, int value)
+{
+    return tp_set(h, (char *)key, value ? "true" : "false");
+}
+
+/**
+ * @brief Compile a JSON parameter file into a binary image
+ *
+ * The image is written to a temporary file and renamed into place.
+ *
+ * @param json_file Path to the JSON file
+ * @param image_file Path of the image to write
+ * @return int 0 on success, -1 on failure
+ */
+int tp_compile(const char *json_file, const char *image_file)
+{
+    if (!json_file || !image_file) {
+        AML_LOGE("Invalid file name\n");
+        return -1;
+    }
+
+    cJSON *root = tp_parse_file(json_file, NULL);
+    if (!root) {
+        return -1;
+    }
+    struct tp_index *idx = tp_index_build(root);
+    tp_entry_t **sorted = idx ? (tp_entry_t **)malloc((idx->count + 1) * sizeof(tp_entry_t *)) : NULL;
+    unsigned char *img = NULL;
+    int ret = -1;
+    if (!sorted) {
+        AML_LOGE("Memory allocation failed for image\n");
+        goto out;
+    }
+
+    // Lay out the key table in search order and size the blob
+    size_t n = 0;
+    size_t blob_len = 0;
+    for (size_t i = 0; i <= idx->mask; i++) {
+        tp_entry_t *e = &idx->slots[i];
+        if (e->path) {
+            sorted[n++] = e;
+            blob_len += strlen(e->path) + 1;
+            if ((e->node->type & 0xFF) == cJSON_String) {
+                blob_len += strlen(e->node->valuestring) + 1;
+            }
+        }
+    }
+    qsort(sorted, n, sizeof(tp_entry_t *), tp_image_cmp);
+
+    size_t table = TP_IMAGE_HDR;
+    size_t blob = table + n * TP_IMAGE_ENTRY;
+    size_t size = blob + blob_len;
+    if (size > UINT32_MAX) {
+        AML_LOGE("Parameter file %s too large for an image\n", json_file);
+        goto out;
+    }
+    img = (unsigned char *)calloc(1, size);
+    if (!img) {
+        AML_LOGE("Memory allocation failed for image\n");
+        goto out;
+    }
+    tp_put_u32(img, TP_IMAGE_MAGIC);
+    tp_put_u32(img + 4, TP_IMAGE_VERSION);
+    tp_put_u32(img + 8, (uint32_t)n);
+    tp_put_u32(img + 12, (uint32_t)table);
+    tp_put_u32(img + 16, (uint32_t)blob);
+    tp_put_u32(img + 20, (uint32_t)blob_len);
+
+    size_t pos = 0;
+    for (size_t i = 0; i < n; i++) {
+        tp_entry_t *e = sorted[i];
+        unsigned char *p = img + table + i * TP_IMAGE_ENTRY;
+        size_t klen = strlen(e->path);
+        tp_put_u32(p, (uint32_t)pos);
+        tp_put_u32(p + 4, (uint32_t)klen);
+        memcpy(img + blob + pos, e->path, klen + 1);
+        pos += klen + 1;
+
+        int type = e->node->type & 0xFF;
+        if (type == cJSON_String) {
+            size_t vlen = strlen(e->node->valuestring);
+            tp_put_u32(p + 8, (uint32_t)pos);
+            tp_put_u32(p + 12, (uint32_t)vlen);
+            memcpy(img + blob + pos, e->node->valuestring, vlen + 1);
+            pos += vlen + 1;
+        }
+        tp_put_u32(p + 16, (uint32_t)type);
+        tp_put_u32(p + 20, (uint32_t)e->vflags);
+
+        uint64_t bits;
+        memcpy(&bits, &e->num, sizeof(bits));
+        tp_put_u32(p + 24, (uint32_t)bits);
+        tp_put_u32(p + 28, (uint32_t)(bits >> 32));
+    }
+
+    // Write to temporary file, then replace the target
+    char temp_file[PATH_MAX];
+    int tn = snprintf(temp_file, sizeof(temp_file), "%s.tmp", image_file);
+    if (tn < 0 || (size_t)tn >= sizeof(temp_file)) {
+        AML_LOGE("Temporary file name for %s is too long\n", image_file);
+        goto out;
+    }
+    FILE *fp = fopen(temp_file, "w");
     if (!fp) {
-        AML_LOGE("Failed to open file %s: %s\n", file, strerror(errno));
-        pthread_mutex_destroy(&handle->lock);
-        free(handle->filename);
-        free(handle);
-        return NULL;
+        AML_LOGE("Failed to open temporary file %s: %s\n", temp_file, strerror(errno));
+        goto out;
     }
-    handle->fp = fp;
-
-    // Get file size
-    struct stat st;
-    if (stat(file, &st) != 0) {
-        AML_LOGE("Failed to get file size for %s: %s\n", file, strerror(errno));
-        goto fail;
+    size_t len = fwrite(img, 1, size, fp);
+    if (fclose(fp) != 0 || len != size) {
+        AML_LOGE("Failed to write image %s: %s\n", temp_file, strerror(errno));
+        unlink(temp_file);
+        goto out;
     }
-    size_t size = st.st_size;
-
-    // Allocate buffer for file content
-    buf = (char *)malloc(size + 1);
-    if (!buf) {
-        AML_LOGE("Memory allocation failed for buffer\n");
-        goto fail;
+    if (rename(temp_file, image_file) != 0) {
+        AML_LOGE("Failed to rename %s to %s: %s\n", temp_file, image_file, strerror(errno));
+        unlink(temp_file);
+        goto out;
     }
+    ret = 0;
 
-    // Read file content
-    size_t n = fread(buf, 1, size, handle->fp);
-    buf[size] = '\0'; // Ensure null-terminated string
-    if (n != size) {
-        AML_LOGE("Failed to read file %s, read %zu bytes, expected %zu\n", file, n, size);
-        goto fail;
+out:
+    free(img);
+    free(sorted);
+    tp_index_free(idx);
+    cJSON_Delete(root);
+    return ret;
+}
+
+/**
+ * @brief Kind of a leaf for in-place reloads, booleans of either value are one kind
+ */
+static int tp_value_kind(cJSON *n)
+{
+    int type = n->type & 0xFF;
+    return type == cJSON_False ? cJSON_True : type;
+}
+
+/**
+ * @brief Compare two leaves by JSON value
+ */
+static int tp_value_equal(cJSON *a, cJSON *b)
+{
+    if ((a->type & 0xFF) != (b->type & 0xFF)) {
+        return 0;
+    }
+    switch (a->type & 0xFF) {
+    case cJSON_String:
+        return strcmp(a->valuestring, b->valuestring) == 0;
+    case cJSON_Number:
+        return a->valuedouble == b->valuedouble;
+    default:
+        return cJSON_Compare(a, b, 1);
     }
+}
 
-    // Parse JSON content
-    handle->root = cJSON_Parse(buf);
-    if (!handle->root) {
-        AML_LOGE("Failed to parse JSON content: %s\n", cJSON_GetErrorPtr());
-        goto fail;
+/**
+ * @brief Move the value of a reloaded leaf into the live node of the same kind
+ *
+ * Heap strings are exchanged; with an arena the string is copied into the
+ * pool, since the reloaded arena is released as a whole.
+ *
+ * @return int 0 on success, -1 if the value could not be copied
+ */
+static int tp_value_take(tp_handle_t *h, cJSON *dst, cJSON *src)
+{
+    switch (src->type & 0xFF) {
+    case cJSON_String: {
+        if (h->arena) {
+            char *s = tp_value_dup(h, src->valuestring);
+            if (!s) {
+                AML_LOGE("Memory allocation failed for value\n");
+                return -1;
+            }
+            tp_value_release(h, dst->valuestring);
+            dst->valuestring = s;
+            break;
+        }
+        char *s = dst->valuestring;
+        dst->valuestring = src->valuestring;
+        src->valuestring = s;
+        break;
+    }
+    case cJSON_Number:
+        cJSON_SetNumberHelper(dst, src->valuedouble);
+        break;
+    default:
+        dst->type = (dst->type & ~0xFF) | (src->type & 0xFF);
+        break;
     }
+    return 0;
+}
 
-    free(buf);
-    return handle;
+/**
+ * @brief Check that a reloaded tree has the same leaves as the live one
+ *
+ * Leaves may change value but not kind; arrays and nulls must be unchanged.
+ * Only then can the reload update values in place and keep key handles.
+ */
+static int tp_reload_same_shape(struct tp_index *cur, struct tp_index *idx)
+{
+    if (cur->count != idx->count) {
+        return 0;
+    }
+    for (size_t i = 0; i <= cur->mask; i++) {
+        tp_entry_t *e = &cur->slots[i];
+        if (!e->path) {
+            continue;
+        }
+        tp_entry_t *ne = tp_index_find(idx, e->path);
+        if (!ne || tp_value_kind(e->node) != tp_value_kind(ne->node)) {
+            return 0;
+        }
+        int kind = tp_value_kind(e->node);
+        if (kind != cJSON_String && kind != cJSON_Number && kind != cJSON_True &&
+            !tp_value_equal(e->node, ne->node)) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-fail:
-    if (buf) free(buf);
-    if (handle) {
-        if (handle->fp) fclose(handle->fp);
-        if (handle->filename) free(handle->filename);
-        pthread_mutex_destroy(&handle->lock);
-        free(handle);
+/**
+ * @brief Publish a changed leaf of a reload to the shared store and the watchers
+ */
+static void tp_reload_changed(tp_handle_t *h, tp_entry_t *e, struct tp_changes *c)
+{
+    if (e->shm_slot) {
+        tp_shm_write(h->shm, e);
+    }
+    if (c) {
+        tp_changes_add(c, e->path, e->node);
     }
-    return NULL;
 }
 
 /**
- * @brief Close the handle and release resources
+ * @brief Bring the live tree in line with a reloaded one
  *
- * @param h Handle to the JSON file
+ * Must be called with h->lock held for writing. When only values changed
+ * they are moved into the live nodes; otherwise the reloaded leaves replace
+ * the live ones and key handles re-resolve. Either way *root, *idx and
+ * *arena are left holding what the caller must free.
+ *
+ * @return int Number of changed keys
  */
-void tp_close(tp_handle_t *h)
+static int tp_reload_apply(tp_handle_t *h, cJSON **root, struct tp_index **idx, struct tp_arena **arena,
+                           struct tp_changes *c)
 {
-    if (h) {
-        if (h->fp) {
-            fclose(h->fp);
+    struct tp_index *cur = h->index;
+    int changed = 0;
+
+    if (tp_reload_same_shape(cur, *idx)) {
+        for (size_t i = 0; i <= cur->mask; i++) {
+            tp_entry_t *e = &cur->slots[i];
+            if (!e->path) {
+                continue;
+            }
+            tp_entry_t *ne = tp_index_find(*idx, e->path);
+            if (!tp_value_equal(e->node, ne->node) && tp_value_take(h, e->node, ne->node) == 0) {
+                tp_entry_cache(e);
+                tp_version_touch(h, e);
+                tp_reload_changed(h, e, c);
+                changed++;
+            }
         }
-        if (h->root) {
-            cJSON_Delete(h->root);
+    } else {
+        for (size_t i = 0; i <= (*idx)->mask; i++) {
+            tp_entry_t *e = &(*idx)->slots[i];
+            if (!e->path) {
+                continue;
+            }
+            tp_entry_t *old = tp_index_find(cur, e->path);
+            if (h->shm) {
+                e->shm_slot = tp_shm_find(h->shm, h->shm_size, e->path, e->hash);
+                e->shm_seq = e->shm_slot ? tp_shm_slots(h->shm)[e->shm_slot - 1].seq : 0;
+                if (!e->shm_slot) {
+                    AML_LOGE("Key %s is not in the shared store of %s, it stays private and cannot be set\n",
+                             e->path, h->filename);
+                }
+            }
+            if (!old || !tp_value_equal(old->node, e->node)) {
+                tp_reload_changed(h, e, c);
+                changed++;
+            }
         }
-        if (h->filename) {
-            free(h->filename);
+        for (size_t i = 0; i <= cur->mask; i++) {
+            tp_entry_t *e = &cur->slots[i];
+            if (e->path && !tp_index_find(*idx, e->path)) {
+                if (c) {
+                    tp_changes_add(c, e->path, NULL);
+                }
+                changed++;
+            }
         }
-        pthread_mutex_destroy(&h->lock);
-        free(h);
+
+        // Swap the children so h->root itself, checked without the lock, never changes
+        cJSON *child = h->root->child;
+        int type = h->root->type;
+        h->root->child = (*root)->child;
+        h->root->type = (*root)->type;
+        (*root)->child = child;
+        (*root)->type = type;
+        h->index = *idx;
+        *idx = cur;
+        tp_bloom_publish(h, tp_bloom_build(h->index, h->bloom));
+        struct tp_arena *a = h->arena;
+        h->arena = *arena;
+        *arena = a;
+        h->gen++;
+    }
+
+    if (changed && h->shm) {
+        h->shm_wseq = ++h->shm->wseq;
     }
+    if (changed) {
+        tp_cache_invalidate(h);
+    }
+    return changed;
 }
 
 /**
- * @brief Get a value from the JSON tree using a dotted key or single-level key
+ * @brief Re-read the file if it changed on disk and apply the differences
+ *
+ * Skips the work when the size and mtime are unchanged, or when only the
+ * mtime moved and the content hash matches. The file is parsed without
+ * h->lock, so readers keep using the current tree until the diff is
+ * applied. Changes still only in memory are written out first, as their own
+ * persist would do. Watchers are told about every changed key, with a NULL
+ * value for removed keys.
  *
  * @param h Handle to the JSON file
- * @param key Key in format "system.audio.volume" or single-level "volume"
- * @return char* Value corresponding to the key, or NULL if not found
+ * @return int 1 if the file changed and was reloaded, 0 if unchanged, -1 on failure
  */
-char* tp_get(tp_handle_t *h, char *key)
+static int tp_reload_file(tp_handle_t *h)
 {
-    if (!h || !key) {
-        AML_LOGE("Invalid handle or key\n");
-        return NULL;
+    if (!h || !h->root) {
+        AML_LOGE("Invalid handle or JSON root is empty\n");
+        return -1;
     }
-    if (!h->root) {
-        AML_LOGE("JSON root is empty\n");
-        return NULL;
+    if (h->flags & TP_OPEN_JOURNAL) {
+        AML_LOGE("Reloading is not supported with TP_OPEN_JOURNAL\n");
+        return -1;
     }
-
-    // Duplicate key to avoid modifying the original
-    char *str = strdup(key);
-    if (!str) {
-        AML_LOGE("Memory allocation failed for key\n");
-        return NULL;
+    if (tp_lazy_load_all(h) != 0) {
+        return -1;
     }
 
-    cJSON *cur = h->root;
-    char *ptr = NULL;
-    char *p = NULL;
+    struct tp_changes changes = { 0 };
+    struct tp_changes *c = tp_watched(h) ? &changes : NULL;
+    cJSON *root = NULL;
+    struct tp_index *idx = NULL;
+    struct tp_arena *arena = NULL;
+    int ret;
 
-    pthread_mutex_lock(&h->lock);
+    if (h->shm) {
+        tp_shm_lock(h);
+        tp_shm_pull(h, c);
+    }
+    pthread_mutex_lock(&h->io_lock);
+    for (;;) {
+        // Memory-only changes are not written first, the file wins over them
+        int none = tp_durability(h) == TP_DURABILITY_NONE;
+        pthread_rwlock_rdlock(&h->lock);
+        int pending = h->wseq != h->pseq;
+        unsigned long seen = h->wseq;
+        pthread_rwlock_unlock(&h->lock);
+        if (pending && !none && tp_persist_locked(h) != 0) {
+            ret = -1;
+            break;
+        }
 
-    // Check if key is single-level (no dots)
-    if (strchr(str, '.') == NULL) {
-        cur = cJSON_GetObjectItem(h->root, str);
-        if (!cur || !cur->valuestring) {
-            AML_LOGE("Single-level key not found or invalid: %s\n", str);
-            free(str);
-            pthread_mutex_unlock(&h->lock);
-            return NULL;
+        ret = tp_read_file(h->filename, h, &root, h->arena ? &arena : NULL);
+        if (ret <= 0) {
+            break;
         }
-        char *result = strdup(cur->valuestring);
-        free(str);
-        pthread_mutex_unlock(&h->lock);
-        if (!result) {
-            AML_LOGE("Memory allocation failed for result\n");
-            return NULL;
+        idx = tp_index_build(root);
+        if (!idx) {
+            AML_LOGE("Failed to build key index\n");
+            h->file_size = -1;
+            ret = -1;
+            break;
+        }
+
+        pthread_rwlock_wrlock(&h->lock);
+        if (h->wseq != (none ? seen : h->pseq)) {
+            // A set landed while parsing, write it out and look again
+            pthread_rwlock_unlock(&h->lock);
+            tp_tree_free(h, root, arena, idx);
+            tp_index_free(idx);
+            idx = NULL;
+            root = NULL;
+            arena = NULL;
+            continue;
+        }
+        // A reload counts as a batch, so a failed set racing with it is not undone on swapped-out entries
+        if (tp_reload_apply(h, &root, &idx, &arena, c)) {
+            h->pseq = ++h->wseq;
         }
-        return result;
+        pthread_rwlock_unlock(&h->lock);
+        if (h->flags & TP_OPEN_INPLACE) {
+            tp_inplace_scan(h);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&h->io_lock);
+    if (h->shm) {
+        tp_shm_unlock(h);
     }
 
-    // Handle multi-level key
-    ptr = strtok_r(str, ".", &p);
-    if (!ptr) {
-        AML_LOGE("Invalid key format: %s\n", key);
-        free(str);
-        pthread_mutex_unlock(&h->lock);
-        return NULL;
+    if (ret > 0) {
+        tp_snapshot_publish(h);
     }
+    tp_watch_notify(h, &changes);
+    tp_tree_free(h, root, arena, idx);
+    tp_index_free(idx);
+    return ret;
+}
 
-    cur = cJSON_GetObjectItem(h->root, ptr);
-    while (cur && cur->type == cJSON_Object) {
-        ptr = strtok_r(NULL, ".", &p);
-        if (!ptr) {
-            AML_LOGE("Incomplete key path: %s\n", key);
-            free(str);
-            pthread_mutex_unlock(&h->lock);
-            return NULL;
+/**
+ * @brief Reload the file and every mounted file, see tp_reload_file()
+ *
+ * @param h Handle to the JSON file
+ * @return int 1 if any file changed and was reloaded, 0 if none changed, -1 on failure
+ */
+int tp_reload(tp_handle_t *h)
+{
+    int ret = tp_reload_file(h);
+    if (!h) {
+        return ret;
+    }
+    for (struct tp_mount *m = h->mounts; m; m = m->next) {
+        int r = tp_reload(m->h);
+        if (r < 0) {
+            ret = -1;
+        } else if (r > 0 && ret == 0) {
+            ret = 1;
         }
-        cur = cJSON_GetObjectItem(cur, ptr);
     }
+    return ret;
+}
 
-    free(str);
-    if (!cur || !cur->valuestring) {
-        AML_LOGE("Key not found or invalid: %s\n", key);
-        pthread_mutex_unlock(&h->lock);
+/**
+ * @brief Register a callback for changes to a key or to every key below a prefix
+ *
+ * @param h Handle to the JSON file
+ * @param prefix Key such as "system.audio.volume", prefix such as "system.audio", or "" for all keys
+ * @param cb Callback, run without any handle lock held
+ * @param ctx Caller context passed to cb
+ * @return tp_watch_t* Watch to pass to tp_unwatch(), or NULL on failure
+ */
+tp_watch_t *tp_watch(tp_handle_t *h, const char *prefix, tp_watch_cb cb, void *ctx)
+{
+    if (!h || !prefix || !cb) {
+        AML_LOGE("Invalid handle, prefix, or callback\n");
         return NULL;
     }
 
-    char *result = strdup(cur->valuestring);
-    pthread_mutex_unlock(&h->lock);
-    if (!result) {
-        AML_LOGE("Memory allocation failed for result\n");
+    tp_watch_t *w = (tp_watch_t *)calloc(1, sizeof(tp_watch_t));
+    if (!w || !(w->prefix = strdup(prefix))) {
+        AML_LOGE("Memory allocation failed for watch\n");
+        free(w);
         return NULL;
     }
+    w->len = strlen(prefix);
+    w->cb = cb;
+    w->ctx = ctx;
 
-    return result;
+    pthread_mutex_lock(&h->watch_lock);
+    // Writes from other processes arrive through the shared store or by reloading the file
+    if (h->root && !(h->flags & TP_OPEN_JOURNAL) && !h->notifier_running && tp_notifier_init(h) != 0) {
+        pthread_mutex_unlock(&h->watch_lock);
+        free(w->prefix);
+        free(w);
+        return NULL;
+    }
+    w->next = h->watches;
+    __atomic_store_n(&h->watches, w, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&h->watch_lock);
+    return w;
 }
 
 /**
- * @brief Set a value in the JSON tree using a dotted key or single-level key and write to file
+ * @brief Remove a watch
  *
- * @param h Handle to the JSON file
- * @param key Key in format "system.audio.volume" or single-level "volume"
- * @param value Value to set
+ * May be called from a callback. Once it returns outside a callback, cb is
+ * no longer running and will not be called again.
+ *
+ * @param h Handle the watch was registered on
+ * @param w Watch from tp_watch(), may be NULL
+ */
+void tp_unwatch(tp_handle_t *h, tp_watch_t *w)
+{
+    if (!h || !w) {
+        return;
+    }
+
+    pthread_mutex_lock(&h->watch_lock);
+    if (h->watch_depth) {
+        // A dispatch is walking the list, let it unlink the watch
+        w->cb = NULL;
+    } else {
+        for (struct tp_watch **pp = &h->watches; *pp; pp = &(*pp)->next) {
+            if (*pp == w) {
+                __atomic_store_n(pp, w->next, __ATOMIC_RELEASE);
+                free(w->prefix);
+                free(w);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&h->watch_lock);
+}
+
+/**
+ * @brief Serve every key below a prefix from a separate file
+ *
+ * @param h Handle to mount on
+ * @param prefix Dotted prefix such as "system.audio"
+ * @param file JSON file or compiled image to mount
+ * @param opts Open options for the mounted file, NULL behaves like tp_open()
  * @return int 0 on success, -1 on failure
  */
-int tp_set(tp_handle_t *h, char *key, char *value)
+int tp_mount(tp_handle_t *h, const char *prefix, char *file, const tp_options_t *opts)
 {
-    if (!h || !key || !value || !h->filename) {
-        AML_LOGE("Invalid handle, key, value, or filename\n");
+    if (!h || !prefix || !*prefix || !file) {
+        AML_LOGE("Invalid handle, prefix or file\n");
         return -1;
     }
-    if (!h->root) {
-        AML_LOGE("JSON root is empty\n");
+    size_t len = strlen(prefix);
+    if (prefix[0] == '.' || prefix[len - 1] == '.') {
+        AML_LOGE("Invalid mount prefix %s\n", prefix);
         return -1;
     }
 
-    // Duplicate key to avoid modifying the original
-    char *str = strdup(key);
-    if (!str) {
-        AML_LOGE("Memory allocation failed for key\n");
+    // One mount per key, so a prefix may not contain or extend another
+    for (struct tp_mount *m = h->mounts; m; m = m->next) {
+        size_t n = len < m->len ? len : m->len;
+        const char *longer = len < m->len ? m->prefix : prefix;
+        if (strncasecmp(prefix, m->prefix, n) == 0 && (longer[n] == '\0' || longer[n] == '.')) {
+            AML_LOGE("Mount prefix %s overlaps %s\n", prefix, m->prefix);
+            return -1;
+        }
+    }
+
+    struct tp_mount *m = (struct tp_mount *)calloc(1, sizeof(struct tp_mount));
+    if (!m) {
+        AML_LOGE("Memory allocation failed for mount\n");
+        return -1;
+    }
+    m->prefix = strdup(prefix);
+    m->len = len;
+    m->h = m->prefix ? tp_open_ex(file, opts) : NULL;
+    if (!m->h) {
+        AML_LOGE("Failed to mount %s at %s\n", file, prefix);
+        free(m->prefix);
+        free(m);
         return -1;
     }
 
-    cJSON *cur = h->root;
-    char *ptr = NULL;
-    char *p = NULL;
+    struct tp_mount **tail = &h->mounts;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = m;
+    return 0;
+}
 
-    pthread_mutex_lock(&h->lock);
+struct tp_bind_watch {
+    struct tp_bind *b;      // Binding the watch feeds
+    tp_handle_t *h;         // Handle watched, the bound one or a mounted one
+    const char *prefix;     // Mount prefix of h, NULL for the bound handle
+    size_t len;             // Length of prefix
+    tp_watch_t *w;          // Registered watch
+};
 
-    // Handle single-level key
-    if (strchr(str, '.') == NULL) {
-        cur = cJSON_GetObjectItem(h->root, str);
-        if (!cur) {
-            AML_LOGE("Single-level key not found: %s\n", str);
-            free(str);
-            pthread_mutex_unlock(&h->lock);
-            return -1;
-        }
+struct tp_bind {
+    const tp_bind_desc_t *desc; // Field table
+    size_t n;                   // Number of fields
+    void *base;                 // Struct the fields live in
+    struct tp_bind_watch *watches; // One watch per handle serving the fields
+    size_t nwatch;              // Number of watches
+};
 
-        // Update JSON node
-        free(cur->valuestring);
-        cur->valuestring = strdup(value);
-        if (!cur->valuestring) {
-            AML_LOGE("Memory allocation failed for value\n");
-            free(str);
-            pthread_mutex_unlock(&h->lock);
-            return -1;
+/**
+ * @brief Convert a value to the type of a bound field and store it
+ *
+ * @return int 0 on success, -1 if the value does not convert
+ */
+static int tp_bind_store(struct tp_bind *b, const tp_bind_desc_t *d, const char *value)
+{
+    char *p = (char *)b->base + d->offset;
+    double num;
+    int bval;
+
+    switch (d->type) {
+    case TP_BIND_STRING:
+        snprintf(p, d->size, "%s", value);
+        return 0;
+    case TP_BIND_INT:
+        if (!tp_parse_num(value, &num)) {
+            if (!tp_parse_bool(value, &bval)) {
+                break;
+            }
+            num = bval;
         }
-    } else {
-        // Handle multi-level key
-        ptr = strtok_r(str, ".", &p);
-        if (!ptr) {
-            AML_LOGE("Invalid key format: %s\n", key);
-            free(str);
-            pthread_mutex_unlock(&h->lock);
-            return -1;
+        __atomic_store_n((int *)p, num >= INT_MAX ? INT_MAX : num <= INT_MIN ? INT_MIN : (int)num,
+                         __ATOMIC_RELAXED);
+        return 0;
+    case TP_BIND_DOUBLE:
+        if (!tp_parse_num(value, &num)) {
+            break;
         }
-
-        cur = cJSON_GetObjectItem(h->root, ptr);
-        while (cur && cur->type == cJSON_Object) {
-            ptr = strtok_r(NULL, ".", &p);
-            if (!ptr) {
-                AML_LOGE("Incomplete key path: %s\n", key);
-                free(str);
-                pthread_mutex_unlock(&h->lock);
-                return -1;
+        __atomic_store((double *)p, &num, __ATOMIC_RELAXED);
+        return 0;
+    case TP_BIND_BOOL:
+        if (!tp_parse_bool(value, &bval)) {
+            if (!tp_parse_num(value, &num)) {
+                break;
             }
-            cur = cJSON_GetObjectItem(cur, ptr);
+            bval = num != 0;
         }
+        __atomic_store_n((int *)p, bval, __ATOMIC_RELAXED);
+        return 0;
+    }
+    AML_LOGE("Value \"%s\" of %s does not fit its bound field\n", value, d->key);
+    return -1;
+}
 
-        if (!cur) {
-            AML_LOGE("Key not found: %s\n", key);
-            free(str);
-            pthread_mutex_unlock(&h->lock);
-            return -1;
-        }
+/**
+ * @brief Watch callback updating the field of a changed key
+ */
+static void tp_bind_changed(tp_handle_t *h, const char *key, const char *value, void *ctx)
+{
+    struct tp_bind_watch *bw = (struct tp_bind_watch *)ctx;
+    struct tp_bind *b = bw->b;
 
-        // Update JSON node
-        free(cur->valuestring);
-        cur->valuestring = strdup(value);
-        if (!cur->valuestring) {
-            AML_LOGE("Memory allocation failed for value\n");
-            free(str);
-            pthread_mutex_unlock(&h->lock);
-            return -1;
+    (void)h;
+    if (!value) {
+        return;
+    }
+    for (size_t i = 0; i < b->n; i++) {
+        const char *k = b->desc[i].key;
+        if (bw->prefix) {
+            if (strncasecmp(k, bw->prefix, bw->len) != 0 || k[bw->len] != '.') {
+                continue;
+            }
+            k += bw->len + 1;
+        } else {
+            const char *rest = k;
+            if (tp_route(bw->h, &rest)) {
+                continue;
+            }
+        }
+        if (strcasecmp(k, key) == 0) {
+            tp_bind_store(b, &b->desc[i], value);
         }
     }
+}
 
-    // Write to temporary file
-    char temp_file[256];
-    snprintf(temp_file, sizeof(temp_file), "%s.tmp", h->filename);
-    FILE *temp_fp = fopen(temp_file, "w");
-    if (!temp_fp) {
-        AML_LOGE("Failed to open temporary file %s: %s\n", temp_file, strerror(errno));
-        free(cur->valuestring);
-        cur->valuestring = NULL;
-        free(str);
-        pthread_mutex_unlock(&h->lock);
-        return -1;
+/**
+ * @brief Mirror parameters into the fields of a plain struct
+ *
+ * @param h Handle to the JSON file
+ * @param desc Field table, must stay valid until tp_unbind()
+ * @param n Number of fields
+ * @param base Struct to fill
+ * @return tp_bind_t* Binding, or NULL if a key is missing or cannot be converted
+ */
+tp_bind_t *tp_bind(tp_handle_t *h, const tp_bind_desc_t *desc, size_t n, void *base)
+{
+    if (!h || (!desc && n) || !base) {
+        AML_LOGE("Invalid handle, field table or struct\n");
+        return NULL;
     }
 
-    // Print JSON to buffer and write to temporary file
-    char *buf = cJSON_Print(h->root);
-    if (!buf) {
-        AML_LOGE("Failed to serialize JSON\n");
-        fclose(temp_fp);
-        free(cur->valuestring);
-        cur->valuestring = NULL;
-        free(str);
-        pthread_mutex_unlock(&h->lock);
-        return -1;
+    struct tp_bind *b = (struct tp_bind *)calloc(1, sizeof(struct tp_bind));
+    size_t nwatch = 1;
+    for (struct tp_mount *m = h->mounts; m; m = m->next) {
+        nwatch++;
+    }
+    if (b) {
+        b->watches = (struct tp_bind_watch *)calloc(nwatch, sizeof(struct tp_bind_watch));
+    }
+    if (!b || !b->watches) {
+        AML_LOGE("Memory allocation failed for binding\n");
+        free(b);
+        return NULL;
     }
+    b->desc = desc;
+    b->n = n;
+    b->base = base;
 
-    size_t len = fwrite(buf, 1, strlen(buf), temp_fp);
-    if (len != strlen(buf)) {
-        AML_LOGE("Failed to write to temporary file %s, wrote %zu bytes, expected %zu: %s\n",
-                 temp_file, len, strlen(buf), strerror(errno));
-        fclose(temp_fp);
-        free(buf);
-        free(cur->valuestring);
-        cur->valuestring = NULL;
-        free(str);
-        pthread_mutex_unlock(&h->lock);
-        return -1;
+    // Watch before filling, so no change slips in between
+    struct tp_mount *m = NULL;
+    for (size_t i = 0; i < nwatch; i++) {
+        struct tp_bind_watch *bw = &b->watches[i];
+        if (i) {
+            m = i == 1 ? h->mounts : m->next;
+        }
+        bw->b = b;
+        bw->h = m ? m->h : h;
+        bw->prefix = m ? m->prefix : NULL;
+        bw->len = m ? m->len : 0;
+        if (!bw->h->image) {
+            bw->w = tp_watch(bw->h, "", tp_bind_changed, bw);
+            if (!bw->w) {
+                goto fail;
+            }
+        }
+        b->nwatch = i + 1;
     }
 
-    fclose(temp_fp);
-    free(buf);
+    for (size_t i = 0; i < n; i++) {
+        const tp_bind_desc_t *d = &desc[i];
+        char *p = (char *)base + d->offset;
+        int ret = -1;
+        int iv;
+        double dv;
+        if (d->type == TP_BIND_STRING) {
+            char *value = tp_get(h, (char *)d->key);
+            ret = value ? tp_bind_store(b, d, value) : -1;
+            free(value);
+        } else if (d->type == TP_BIND_DOUBLE) {
+            if ((ret = tp_get_double(h, d->key, &dv)) == 0) {
+                __atomic_store((double *)p, &dv, __ATOMIC_RELAXED);
+            }
+        } else {
+            ret = d->type == TP_BIND_INT ? tp_get_int(h, d->key, &iv) : tp_get_bool(h, d->key, &iv);
+            if (ret == 0) {
+                __atomic_store_n((int *)p, iv, __ATOMIC_RELAXED);
+            }
+        }
+        if (ret != 0) {
+            AML_LOGE("Failed to fill bound field of %s\n", d->key);
+            goto fail;
+        }
+    }
+    return b;
 
-    // Replace original file with temporary file
-    if (rename(temp_file, h->filename) != 0) {
-        AML_LOGE("Failed to rename %s to %s: %s\n", temp_file, h->filename, strerror(errno));
-        free(cur->valuestring);
-        cur->valuestring = NULL;
-        free(str);
-        pthread_mutex_unlock(&h->lock);
-        return -1;
+fail:
+    tp_unbind(b);
+    return NULL;
+}
+
+/**
+ * @brief Stop updating a struct bound with tp_bind()
+ *
+ * @param b Binding, may be NULL
+ */
+void tp_unbind(tp_bind_t *b)
+{
+    if (b) {
+        for (size_t i = 0; i < b->nwatch; i++) {
+            tp_unwatch(b->watches[i].h, b->watches[i].w);
+        }
+        free(b->watches);
+        free(b);
+    }
+}
+
+#ifdef TP_ENABLE_STATS
+/**
+ * @brief Add a live histogram into a result
+ */
+static void tp_histogram_add(tp_histogram_t *dst, tp_histogram_t *src)
+{
+    uint64_t max = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->total_ns += __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+    if (max > dst->max_ns) {
+        dst->max_ns = max;
     }
+    for (int i = 0; i < TP_STATS_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Add the live counters of a handle into a result
+ */
+static void tp_stats_add(tp_stats_t *dst, tp_stats_t *src)
+{
+    dst->gets += __atomic_load_n(&src->gets, __ATOMIC_RELAXED);
+    dst->sets += __atomic_load_n(&src->sets, __ATOMIC_RELAXED);
+    dst->misses += __atomic_load_n(&src->misses, __ATOMIC_RELAXED);
+    dst->bytes_written += __atomic_load_n(&src->bytes_written, __ATOMIC_RELAXED);
+    dst->persists += __atomic_load_n(&src->persists, __ATOMIC_RELAXED);
+    tp_histogram_add(&dst->lock_wait, &src->lock_wait);
+    tp_histogram_add(&dst->lookup, &src->lookup);
+    tp_histogram_add(&dst->serialize, &src->serialize);
+    tp_histogram_add(&dst->write, &src->write);
+    tp_histogram_add(&dst->rename, &src->rename);
+}
+#endif
 
-    // Reopen original file to keep handle->fp valid
-    fclose(h->fp);
-    h->fp = fopen(h->filename, "r+");
-    if (!h->fp) {
-        AML_LOGE("Failed to reopen original file %s: %s\n", h->filename, strerror(errno));
-        free(cur->valuestring);
-        cur->valuestring = NULL;
-        free(str);
-        pthread_mutex_unlock(&h->lock);
+/**
+ * @brief Read the counters and latency histograms of a handle
+ *
+ * @param h Handle to the JSON file
+ * @param out Receives the counters, zeroed when statistics are not compiled in
+ * @return int 0 on success, -1 if statistics are not compiled in
+ */
+int tp_stats(tp_handle_t *h, tp_stats_t *out)
+{
+    if (!h || !out) {
+        AML_LOGE("Invalid handle or output\n");
         return -1;
     }
+    memset(out, 0, sizeof(*out));
 
-    free(str);
-    pthread_mutex_unlock(&h->lock);
+#ifdef TP_ENABLE_STATS
+    tp_stats_add(out, h->stats);
+    for (struct tp_mount *m = h->mounts; m; m = m->next) {
+        tp_stats_t sub;
+        if (tp_stats(m->h, &sub) == 0) {
+            tp_stats_add(out, &sub);
+        }
+    }
     return 0;
+#else
+    AML_LOGE("Statistics are not compiled in, build with TP_ENABLE_STATS\n");
+    return -1;
+#endif
 }
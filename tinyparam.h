@@ -3,16 +3,231 @@
 #define __TINYPARAM_H__
 
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 #include <pthread.h>
 #include <cjson/cJSON.h>
 
 typedef struct tp_handle {
-    FILE *fp;           // File pointer for the opened JSON file
-    pthread_mutex_t lock; // Mutex to prevent concurrent writes
+    pthread_rwlock_t lock; // Guards the tree: shared by readers, exclusive for in-memory updates
+    pthread_mutex_t io_lock; // Serializes persistence, never held by readers
     cJSON *root;        // Parsed JSON tree
+    struct tp_index *index; // Hash index from full dotted path to leaf node
     char *filename;     // Path to the JSON file
+    unsigned long gen;  // Bumped whenever tree nodes are replaced, invalidates key handles
+    unsigned int flags; // TP_OPEN_* flags the handle was opened with
+    struct tp_version *current;  // Latest published snapshot version
+    struct tp_version *retired;  // Old versions waiting for their readers to drain
+    struct tp_snapshot *readers; // Per-thread snapshot slots
+    pthread_mutex_t snap_lock;   // Orders version publication and slot registration
+    pthread_key_t snap_key;      // Thread-specific snapshot slot
+    uint64_t *snap_dirty;        // Bitmap of index pages changed since the last version, guarded by lock
+    size_t snap_pages;           // Index pages covered by snap_dirty
+    pthread_t flusher;           // Write-behind flusher thread
+    pthread_mutex_t flush_lock;  // Guards dirty and flush_stop
+    pthread_cond_t flush_cond;   // Wakes the flusher on new changes or close
+    int dirty;                   // Tree has changes not yet written to file
+    int flush_stop;              // Flusher should write pending changes and exit
+    unsigned int flush_interval_ms; // Minimum time between write-behind writes
+    int flusher_running;         // Flusher thread was started, read atomically
+    int durability;              // tp_durability_t of tp_set(), read atomically
+    char *print_buf;             // Reused serialization buffer, guarded by io_lock
+    size_t print_cap;            // Capacity of print_buf
+    struct tp_mount *mounts;     // Files mounted under key prefixes, see tp_mount()
+    struct tp_stats *stats;      // Counters, NULL unless built with TP_ENABLE_STATS
+    struct tp_bloom *bloom;      // Filter over every key, probed without locks to reject misses
+    struct tp_bloom *bloom_retired; // Filters outgrown by tp_reload(), freed by tp_close()
+    unsigned long version;       // Bumped under lock on every value change, read atomically by thread caches
+    struct tp_cache *caches;     // Per-thread read caches, TP_OPEN_THREAD_CACHE only
+    pthread_mutex_t cache_lock;  // Guards registration of caches
+    pthread_key_t cache_key;     // Thread-specific read cache
+    struct tp_lazy_file *lazy;   // Mapped file still being parsed on demand, NULL once fully parsed
+    pthread_mutex_t lazy_lock;   // Serializes grafting from lazy, taken after io_lock and before lock
+    int parser;                  // tp_parser_t the file is parsed with
+    struct tp_async *async_head; // Writes queued by tp_set_async(), oldest first
+    struct tp_async **async_tail; // Link the next queued write goes into
+    pthread_mutex_t async_lock;  // Guards the queue, async_running and async_stop
+    pthread_cond_t async_cond;   // Wakes the I/O worker
+    pthread_t async_worker;      // I/O worker thread writing for tp_set_async()
+    int async_running;           // Worker was started
+    int async_stop;              // Worker should drain the queue and exit
+    struct tp_history_slot *history; // Ring of recent changes, NULL unless opts->history was set
+    size_t history_cap;          // Slots in history
+    unsigned long history_seq;   // Changes recorded so far, guarded by lock
+    unsigned long wseq;          // Count of applied update batches, guarded by lock
+    unsigned long pseq;          // Last batch included in the file, guarded by io_lock
+    struct timespec file_mtime;  // Modification time of the file the tree matches
+    off_t file_size;             // Size of that file, -1 if unknown
+    uint64_t file_hash;          // Content hash of that file
+    dev_t file_dev;              // Device of that file
+    ino_t file_ino;              // Inode of that file, a rename over it changes this
+    struct tp_arena *arena;      // Arena backing the tree, NULL unless TP_OPEN_ARENA
+    struct tp_pool *pool;        // Pool for values stored into an arena tree
+    int journal_fd;              // Append-only change journal, -1 when not journaling
+    size_t journal_size;         // Bytes of valid records in the journal
+    size_t journal_limit;        // Journal size that triggers compaction
+    const unsigned char *image;  // Mapped compiled image, NULL for JSON files
+    size_t image_size;           // Size of the mapped image
+    struct tp_shm *shm;          // Mapped shared-memory store, NULL unless TP_OPEN_SHARED
+    size_t shm_size;             // Size of the mapped store
+    uint32_t shm_wseq;           // Store write count the tree was last synced to
+    struct tp_watch *watches;    // Registered change callbacks
+    pthread_mutex_t watch_lock;  // Recursive, guards watches and serializes callbacks
+    int watch_depth;             // Nesting of callback dispatches in progress
+    pthread_t notifier;          // Thread delivering changes made by other processes
+    int notifier_running;        // Notifier thread was started
+    int inotify_fd;              // Watches the file's directory for replacements
+    int notify_pipe[2];          // Wakes the notifier thread on close
 } tp_handle_t;
 
+/**
+ * Open flags for tp_open_ex()
+ */
+#define TP_OPEN_SNAPSHOT     (1u << 0) // Maintain immutable versions for tp_snapshot_acquire()
+#define TP_OPEN_WRITE_BEHIND (1u << 1) // tp_set only updates memory, a flusher thread persists
+#define TP_OPEN_JOURNAL      (1u << 2) // tp_set appends to <file>.journal instead of rewriting <file>
+#define TP_OPEN_SHARED       (1u << 3) // Values live in a shared-memory store seen by every process
+#define TP_OPEN_ARENA        (1u << 4) // Tree lives in a per-handle arena, new values in a block pool
+#define TP_OPEN_INPLACE      (1u << 5) // tp_set overwrites a value's bytes in the file when it fits
+#define TP_OPEN_COMPACT      (1u << 6) // Write the file without indentation or line breaks
+#define TP_OPEN_THREAD_CACHE (1u << 7) // Each thread caches values it read, revalidated by a version counter
+#define TP_OPEN_LAZY         (1u << 8) // Parse parts of the file only when a key in them is first read
+
+/**
+ * How far tp_set() goes to make a change survive a crash, see tp_set_durability()
+ */
+typedef enum tp_durability {
+    TP_DURABILITY_RENAME = 0, // Write a temporary file and rename() it over the file, no sync (default)
+    TP_DURABILITY_NONE,       // Keep changes in memory only
+    TP_DURABILITY_ASYNC,      // Leave the write to the write-behind flusher
+    TP_DURABILITY_FULL,       // As RENAME, plus fdatasync() of the file and fsync() of its directory
+} tp_durability_t;
+
+/**
+ * JSON parser used by tp_open_ex() and tp_reload(), see tp_options_t
+ */
+typedef enum tp_parser {
+    TP_PARSER_FAST = 0, // Vectorized parser, cJSON for anything it does not handle (default)
+    TP_PARSER_CJSON,    // cJSON only
+} tp_parser_t;
+
+typedef struct tp_options {
+    unsigned int flags;             // TP_OPEN_* flags
+    tp_durability_t durability;     // Initial durability, TP_OPEN_WRITE_BEHIND implies TP_DURABILITY_ASYNC
+    unsigned int flush_interval_ms; // Write-behind interval, 0 for the default of one second
+    size_t journal_limit;           // Journal size that triggers compaction, 0 for the default of 64 KiB
+    const char *shm_name;           // Shared store name for shm_open(), NULL derives one from the file path
+    tp_parser_t parser;             // JSON parser, TP_PARSER_FAST by default
+    size_t history;                 // Changes kept for tp_history() and tp_rollback(), 0 keeps none
+} tp_options_t;
+
+/**
+ * Opaque pre-resolved key, see tp_key_resolve()
+ */
+typedef struct tp_key tp_key_t;
+
+/**
+ * Opaque pinned view of the tree, see tp_snapshot_acquire()
+ */
+typedef struct tp_snapshot tp_snapshot_t;
+
+/**
+ * Opaque batch of updates, see tp_txn_begin()
+ */
+typedef struct tp_txn tp_txn_t;
+
+/**
+ * Opaque registered change callback, see tp_watch()
+ */
+typedef struct tp_watch tp_watch_t;
+
+/**
+ * Change callback: key is the full dotted path and value the new value as
+ * text, or NULL when tp_reload() found the key removed
+ */
+typedef void (*tp_watch_cb)(tp_handle_t *h, const char *key, const char *value, void *ctx);
+
+/**
+ * Completion callback of tp_set_async(): h and key as passed to it, status
+ * 0 once the change is in the file or -1 if writing it failed
+ */
+typedef void (*tp_done_cb)(tp_handle_t *h, const char *key, int status, void *ctx);
+
+#define TP_HISTORY_KEY 96   // Longest recorded key including the NUL
+#define TP_HISTORY_VALUE 64 // Longest recorded value including the NUL
+
+/**
+ * One recorded change, see tp_history()
+ */
+typedef struct tp_history {
+    char key[TP_HISTORY_KEY];           // Full dotted key, cut if longer
+    char old_value[TP_HISTORY_VALUE];   // Value before the change as text, cut if longer
+    char new_value[TP_HISTORY_VALUE];   // Value after the change as text, cut if longer
+    struct timespec time;               // CLOCK_REALTIME when it was applied
+    int truncated;                      // key or old_value was cut, tp_rollback() stops before it
+} tp_history_t;
+
+/**
+ * Field types of a struct bound with tp_bind()
+ */
+typedef enum tp_bind_type {
+    TP_BIND_STRING,     // char array of size bytes, values are truncated to fit
+    TP_BIND_INT,        // int, as tp_get_int() reads it
+    TP_BIND_DOUBLE,     // double
+    TP_BIND_BOOL,       // int holding 1 or 0
+} tp_bind_type_t;
+
+/**
+ * One field of a bound struct, usually emitted by tools/tp_gen
+ */
+typedef struct tp_bind_desc {
+    const char *key;        // Dotted key the field mirrors
+    tp_bind_type_t type;    // Field type
+    size_t offset;          // Offset of the field in the struct
+    size_t size;            // Size of the field
+} tp_bind_desc_t;
+
+/**
+ * Opaque binding of a struct to a handle, see tp_bind()
+ */
+typedef struct tp_bind tp_bind_t;
+
+/**
+ * Subtree visitor: key is the full dotted path and value the value as text,
+ * both valid only during the call; return non-zero to stop the walk
+ */
+typedef int (*tp_visit_cb)(tp_handle_t *h, const char *key, const char *value, void *ctx);
+
+#define TP_STATS_BUCKETS 32 // Buckets of a tp_histogram_t
+
+/**
+ * Latency histogram: buckets[0] counts samples under 1 ns, buckets[i] the
+ * ones from 2^(i-1) up to 2^i ns, and the last bucket everything longer
+ */
+typedef struct tp_histogram {
+    uint64_t count;     // Samples recorded
+    uint64_t total_ns;  // Sum of all samples
+    uint64_t max_ns;    // Longest sample
+    uint64_t buckets[TP_STATS_BUCKETS];
+} tp_histogram_t;
+
+/**
+ * Counters of a handle and the files mounted on it, see tp_stats()
+ */
+typedef struct tp_stats {
+    uint64_t gets;          // tp_get*() calls, typed and key handle reads included
+    uint64_t sets;          // Values updated, each key of a transaction counts
+    uint64_t misses;        // Lookups of keys that do not exist
+    uint64_t bytes_written; // Bytes written to the file and the journal
+    uint64_t persists;      // Successful writes: rewrites, in-place writes and journal appends
+    tp_histogram_t lock_wait;   // Waiting for the tree lock or the I/O lock
+    tp_histogram_t lookup;      // Finding a key in the index or image
+    tp_histogram_t serialize;   // Printing the tree for a rewrite
+    tp_histogram_t write;       // Writing and syncing file or journal data
+    tp_histogram_t rename;      // Replacing the file, with the directory sync under TP_DURABILITY_FULL
+} tp_stats_t;
+
 /**
  * @brief Open a JSON file
  *
@@ -21,6 +236,87 @@ typedef struct tp_handle {
  */
 tp_handle_t *tp_open(char *file);
 
+/**
+ * @brief Open a JSON file with options
+ *
+ * A file written by tp_compile() is detected by its magic number and served
+ * read-only from the mapping without parsing; it takes no open flags.
+ *
+ * With TP_OPEN_JOURNAL each tp_set() appends one CRC-protected record to
+ * <file>.journal. Opening replays the journal over the base file, dropping a
+ * torn tail, and the journal is folded into a fresh base file once it grows
+ * past journal_limit.
+ *
+ * With TP_OPEN_SHARED the first process to open the file creates a POSIX
+ * shared-memory segment holding every leaf value; later processes attach to
+ * it. The segment takes the permission bits of the file. Reads copy a slot
+ * under a sequence counter without taking any lock shared with other
+ * processes, and a tp_set() from any process is visible to all of them once
+ * it has been written to the file. The key set is fixed when the segment is
+ * created: opening a file with a key the segment lacks fails, and a key added
+ * by tp_reload() is private to the process and refused by tp_set(). String
+ * values must be shorter than 256 bytes and tp_get_ref() is not available.
+ * The segment outlives the processes; remove it with shm_unlink() after
+ * changing the file by other means.
+ *
+ * With TP_OPEN_ARENA the parsed tree is bump-allocated from one arena per
+ * handle and released at once by tp_close() or a tp_reload() that replaces
+ * the tree, instead of node by node. Values stored later come from a free
+ * list pool of small size classes. The arena works through cJSON_InitHooks(),
+ * which is installed process-wide on first use and then passes other cJSON
+ * allocations straight to malloc(); the application must not install its own
+ * hooks afterwards.
+ *
+ * With TP_OPEN_INPLACE the byte range of every leaf value in the file is
+ * recorded, along with the spaces and tabs that follow it. A tp_set() of a
+ * single key whose new JSON token fits that range overwrites only those
+ * bytes with pwrite(), pads with spaces, and calls fdatasync() before
+ * returning; everything else, including transactions, still rewrites the
+ * file through a temporary file and rename(). Crash safety is weaker for
+ * in-place writes: a crash mid-write can leave that one value torn, mixing
+ * old and new bytes, which may make the file unparsable; other keys are
+ * never touched. Another process reading the file meanwhile can see the
+ * partial value too. A full rewrite is all-or-nothing.
+ *
+ * Full rewrites serialize into a buffer kept by the handle and reused by
+ * the next write. TP_OPEN_COMPACT writes the file without indentation or
+ * line breaks, which makes it noticeably smaller and faster to write.
+ *
+ * With TP_OPEN_THREAD_CACHE tp_get(), tp_get_into(), tp_get_opt() and the
+ * typed getters remember what each thread read in a small thread-local
+ * table. Every change to a value bumps one version counter of the handle,
+ * so while nothing changes a repeated read costs a thread-local hash probe
+ * and one atomic load, without taking the lock. Keys and string values of
+ * 64 bytes or more are not cached. It cannot be combined with
+ * TP_OPEN_SHARED.
+ *
+ * With TP_OPEN_LAZY the file stays mapped and tp_open_ex() only skims it to
+ * find the members of the root object, without building any nodes. The
+ * first read of a key parses just the part of the file holding it: objects
+ * over 4 KiB are skimmed the same way one level at a time, smaller ones
+ * and other values are parsed whole. Open time is one pass over the text
+ * and memory grows with the keys read rather than the file size. A syntax
+ * error inside a part not read yet is only reported when it is reached.
+ * The first write, tp_reload(), tp_get_subtree() or tp_read_lock() parses
+ * the rest of the file and the handle then behaves as if opened without
+ * the flag. Keys are not known up front, so misses are not filtered until
+ * then; instead a key found absent once is remembered, and other readers
+ * only wait while a first read adds its keys to the index. It cannot be
+ * combined with TP_OPEN_SNAPSHOT, TP_OPEN_JOURNAL, TP_OPEN_SHARED,
+ * TP_OPEN_ARENA or TP_OPEN_INPLACE.
+ *
+ * Files are parsed by a built-in parser that scans whitespace and strings
+ * 16 bytes at a time with SSE2 or NEON where available. It builds the same
+ * tree cJSON would and hands anything it does not handle itself, including
+ * every malformed file, to cJSON, so results and error messages do not
+ * change. opts->parser = TP_PARSER_CJSON parses with cJSON only.
+ *
+ * @param file Path to the JSON file
+ * @param opts Open options, NULL behaves like tp_open()
+ * @return tp_handle_t* Handle for the opened file, or NULL on failure
+ */
+tp_handle_t *tp_open_ex(char *file, const tp_options_t *opts);
+
 /**
  * @brief Get a parameter value
  *
@@ -30,6 +326,144 @@ tp_handle_t *tp_open(char *file);
  */
 char* tp_get(tp_handle_t *h, char *key);
 
+/**
+ * @brief Copy a parameter value into a caller-provided buffer
+ *
+ * Does no heap allocation. Works like snprintf(): the result is always
+ * NUL-terminated and was truncated if the return value is >= len.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param buf Destination buffer
+ * @param len Size of buf
+ * @return int Length of the value, or -1 if not found
+ */
+int tp_get_into(tp_handle_t *h, const char *key, char *buf, size_t len);
+
+/**
+ * @brief Tell whether a key exists
+ *
+ * Absent keys are normally rejected by a filter over every key without
+ * taking the lock or logging, so probing optional keys is cheap.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @return int 1 if the key exists, 0 if not
+ */
+int tp_has(tp_handle_t *h, const char *key);
+
+/**
+ * @brief Get an optional parameter value, a missing key is not an error
+ *
+ * Like tp_get(), but an absent key returns a copy of def and is not
+ * logged. A key that exists without a string value still fails as in
+ * tp_get().
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param def Value to return when the key does not exist, may be NULL
+ * @return char* Newly allocated value or copy of def, NULL if def is NULL or on failure
+ */
+char *tp_get_opt(tp_handle_t *h, const char *key, const char *def);
+
+/**
+ * @brief Get a parameter as an integer
+ *
+ * Works on JSON numbers and booleans and on strings such as "50" or "true".
+ * The native value is cached when the tree is loaded or updated, so no
+ * string conversion happens on read.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param out Receives the value
+ * @return int 0 on success, -1 if missing or not numeric
+ */
+int tp_get_int(tp_handle_t *h, const char *key, int *out);
+
+/**
+ * @brief Get a parameter as a double, see tp_get_int()
+ */
+int tp_get_double(tp_handle_t *h, const char *key, double *out);
+
+/**
+ * @brief Get a parameter as a boolean, see tp_get_int()
+ *
+ * @param out Receives 1 or 0
+ */
+int tp_get_bool(tp_handle_t *h, const char *key, int *out);
+
+/**
+ * @brief Set an integer parameter
+ *
+ * Number and boolean nodes are updated natively; string nodes store the
+ * decimal text, keeping the file's existing value types.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param value Value to set
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_int(tp_handle_t *h, const char *key, int value);
+
+/**
+ * @brief Set a double parameter, see tp_set_int()
+ */
+int tp_set_double(tp_handle_t *h, const char *key, double value);
+
+/**
+ * @brief Set a boolean parameter, see tp_set_int()
+ */
+int tp_set_bool(tp_handle_t *h, const char *key, int value);
+
+/**
+ * @brief Take a read guard on the handle
+ *
+ * Pointers from tp_get_ref() stay valid until tp_read_unlock(). The guard
+ * also covers mounted files. Writers wait while the guard is held, so keep
+ * it short, and do not call tp_get() or other accessors of the same handle
+ * inside it: new readers queue behind a waiting writer, so taking the lock
+ * again would deadlock. tp_get_ref() is the only accessor to use.
+ *
+ * @param h Handle to the JSON file
+ */
+void tp_read_lock(tp_handle_t *h);
+
+/**
+ * @brief Release a read guard
+ *
+ * @param h Handle to the JSON file
+ */
+void tp_read_unlock(tp_handle_t *h);
+
+/**
+ * @brief Borrow a parameter value under a read guard
+ *
+ * @param h Handle held with tp_read_lock()
+ * @param key Key in format "system.audio.volume"
+ * @return const char* Borrowed value, or NULL if not found
+ */
+const char *tp_get_ref(tp_handle_t *h, const char *key);
+
+/**
+ * @brief Visit every leaf under a prefix in one read-locked pass
+ *
+ * Leaves are visited in file order, or in key order for a compiled image.
+ * Keys are built in the caller's buffer instead of being allocated. The read
+ * lock is held throughout, so the visitor sees one consistent tree and must
+ * not call tp_set() or other writers on the same handle, nor tp_get() and
+ * other readers, which would queue behind a waiting writer.
+ *
+ * @param h Handle to the JSON file
+ * @param prefix Dotted path of an object or leaf, NULL or "" for the whole tree
+ * @param key Buffer to build keys in
+ * @param key_len Size of key
+ * @param visit Called for each leaf
+ * @param ctx Passed to visit
+ * @return int Number of leaves visited, or -1 if the prefix is not found or a key does not fit
+ */
+int tp_get_subtree(tp_handle_t *h, const char *prefix, char *key, size_t key_len, tp_visit_cb visit,
+                   void *ctx);
+
 /**
  * @brief Set a parameter value
  *
@@ -40,6 +474,31 @@ char* tp_get(tp_handle_t *h, char *key);
  */
 int tp_set(tp_handle_t *h, char *key, char *value);
 
+/**
+ * @brief Set a parameter value and write it to file in the background
+ *
+ * Returns as soon as the new value is visible to readers. Writing the file
+ * is queued to an I/O worker thread of the handle, started by the first
+ * call, and cb then runs on that thread with the outcome. Writes queued
+ * while the worker is busy are coalesced into one rewrite. Callbacks may
+ * read and set values but must not close the handle; tp_close() waits for
+ * every queued write and its callback.
+ *
+ * The worker syncs like tp_set() at the handle's durability level, RENAME
+ * for TP_DURABILITY_ASYNC. With TP_DURABILITY_NONE nothing is written and
+ * callbacks report 0. On a journaled handle the journal is folded into a
+ * fresh base file. A failed write leaves the value in memory, to be written
+ * by the next successful write.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @param value Value to set
+ * @param cb Called once the write finished, may be NULL
+ * @param ctx Passed to cb
+ * @return int 0 if the value was applied and its write queued, -1 on failure, cb is then not called
+ */
+int tp_set_async(tp_handle_t *h, const char *key, const char *value, tp_done_cb cb, void *ctx);
+
 /**
  * @brief Close the handle and release resources
  *
@@ -47,4 +506,312 @@ int tp_set(tp_handle_t *h, char *key, char *value);
  */
 void tp_close(tp_handle_t *h);
 
+/**
+ * @brief Resolve a dotted key once into a reusable key handle
+ *
+ * The handle caches the resolved node and stays valid across tp_set(). If the
+ * tree is rebuilt it is transparently re-resolved on next use.
+ *
+ * @param h Handle to the JSON file
+ * @param key Key in format "system.audio.volume"
+ * @return tp_key_t* Key handle, or NULL if the key does not exist
+ */
+tp_key_t *tp_key_resolve(tp_handle_t *h, const char *key);
+
+/**
+ * @brief Release a key handle
+ *
+ * @param k Key handle, may be NULL
+ */
+void tp_key_free(tp_key_t *k);
+
+/**
+ * @brief Get a parameter value through a key handle
+ *
+ * @param h Handle the key was resolved against
+ * @param k Key handle from tp_key_resolve()
+ * @return char* Value corresponding to the key, or NULL if not found
+ */
+char *tp_get_h(tp_handle_t *h, tp_key_t *k);
+
+/**
+ * @brief Set a parameter value through a key handle
+ *
+ * @param h Handle the key was resolved against
+ * @param k Key handle from tp_key_resolve()
+ * @param value Value to set
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_h(tp_handle_t *h, tp_key_t *k, const char *value);
+
+/**
+ * @brief Start a batch of updates applied atomically by tp_txn_commit()
+ *
+ * @param h Handle to the JSON file
+ * @return tp_txn_t* Transaction, or NULL on failure
+ */
+tp_txn_t *tp_txn_begin(tp_handle_t *h);
+
+/**
+ * @brief Stage a parameter value in a transaction
+ *
+ * @param t Transaction from tp_txn_begin()
+ * @param key Key in format "system.audio.volume"
+ * @param value Value to set
+ * @return int 0 on success, -1 on failure
+ */
+int tp_txn_set(tp_txn_t *t, const char *key, const char *value);
+
+/**
+ * @brief Apply all staged values and persist once
+ *
+ * All values are swapped in under a single lock acquisition, so readers and
+ * snapshots see either none or all of them. If any key does not exist
+ * nothing is changed. The transaction is released either way.
+ *
+ * @param t Transaction from tp_txn_begin()
+ * @return int 0 on success, -1 on failure
+ */
+int tp_txn_commit(tp_txn_t *t);
+
+/**
+ * @brief Discard a transaction without applying it
+ *
+ * @param t Transaction from tp_txn_begin(), may be NULL
+ */
+void tp_txn_abort(tp_txn_t *t);
+
+/**
+ * @brief Copy the most recent changes, newest first
+ *
+ * With opts->history set, tp_open_ex() allocates a ring of that many
+ * entries and every value changed through the handle, by tp_set(), a
+ * transaction or the typed setters, is recorded there under the write lock
+ * without allocating. Once full the oldest entry is overwritten. Changes
+ * read from the file by tp_reload() or made by other processes are not
+ * recorded, and mounted files keep their own history.
+ *
+ * @param h Handle to the JSON file
+ * @param out Receives up to max entries
+ * @param max Capacity of out
+ * @return int Number of entries copied, -1 if the handle keeps no history
+ */
+int tp_history(tp_handle_t *h, tp_history_t *out, size_t max);
+
+/**
+ * @brief Undo the last n recorded changes as one batch
+ *
+ * The old values are applied like a transaction, so readers see all of
+ * them or none and the file is written once. Undone changes leave the
+ * history and the rollback itself is not recorded, so calling it again goes
+ * further back. It stops early at the oldest entry still recorded or an
+ * entry marked truncated. It fails without changing anything if another
+ * tp_rollback() undid one of the same changes first.
+ *
+ * @param h Handle to the JSON file
+ * @param n Number of changes to undo
+ * @return int Number of changes undone, -1 on failure
+ */
+int tp_rollback(tp_handle_t *h, size_t n);
+
+/**
+ * @brief Write pending changes to file now
+ *
+ * With TP_OPEN_WRITE_BEHIND, tp_set() only marks the handle dirty and the
+ * flusher writes at most once per interval; tp_flush() forces the write and
+ * tp_close() always flushes. Without it every tp_set() already persisted.
+ *
+ * @param h Handle to the JSON file
+ * @return int 0 on success or nothing pending, -1 on failure
+ */
+int tp_flush(tp_handle_t *h);
+
+/**
+ * @brief Change how tp_set() persists on this handle
+ *
+ * TP_DURABILITY_RENAME keeps the file whole across a crash but may lose
+ * recent changes; TP_DURABILITY_FULL also syncs the file and its directory
+ * before tp_set() returns, so a change that was acknowledged survives power
+ * loss. TP_DURABILITY_ASYNC defers writes to the flusher thread like
+ * TP_OPEN_WRITE_BEHIND, starting it if needed; it is not available with
+ * TP_OPEN_JOURNAL, where FULL syncs each appended record instead.
+ * TP_DURABILITY_NONE writes nothing: tp_reload() may replace such changes
+ * with what the file holds, and any later full rewrite includes them.
+ * Switching from NONE or ASYNC to RENAME or FULL first writes out what is
+ * pending.
+ *
+ * @param h Handle to the JSON file
+ * @param level New durability level
+ * @return int 0 on success, -1 on failure
+ */
+int tp_set_durability(tp_handle_t *h, tp_durability_t level);
+
+/**
+ * @brief Pin the latest version of the tree for lock-free reads
+ *
+ * Requires TP_OPEN_SNAPSHOT. Readers never take h->lock; each tp_set()
+ * publishes a new version once its value reached the requested durability
+ * level, so a write that fails and is rolled back is not published by its
+ * own call. A version published meanwhile by another writer may carry it
+ * until the rollback publishes again. A version copies the index in pages
+ * of 16 slots and shares unchanged pages with the previous one, so a write
+ * costs a copy of the pages holding the changed keys. Open and a tp_reload()
+ * that adds or removes keys copy every value. Old versions are freed once
+ * no reader holds them. A thread holds at most one version per handle;
+ * nested acquires share it.
+ *
+ * @param h Handle to the JSON file
+ * @return tp_snapshot_t* Snapshot, or NULL on failure
+ */
+tp_snapshot_t *tp_snapshot_acquire(tp_handle_t *h);
+
+/**
+ * @brief Get a parameter value from a snapshot
+ *
+ * @param s Snapshot from tp_snapshot_acquire()
+ * @param key Key in format "system.audio.volume"
+ * @return char* Value corresponding to the key, or NULL if not found
+ */
+char *tp_snapshot_get(tp_snapshot_t *s, const char *key);
+
+/**
+ * @brief Borrow a parameter value from a snapshot
+ *
+ * Does no heap allocation; the pointer is valid until tp_snapshot_release().
+ *
+ * @param s Snapshot from tp_snapshot_acquire()
+ * @param key Key in format "system.audio.volume"
+ * @return const char* Borrowed value, or NULL if not found
+ */
+const char *tp_snapshot_peek(tp_snapshot_t *s, const char *key);
+
+/**
+ * @brief Release a snapshot
+ *
+ * Must be called on the thread that acquired it.
+ *
+ * @param s Snapshot from tp_snapshot_acquire(), may be NULL
+ */
+void tp_snapshot_release(tp_snapshot_t *s);
+
+/**
+ * @brief Re-read the file if it changed on disk and apply the differences
+ *
+ * Nothing is parsed while the size and mtime are unchanged, or while the
+ * content hash still matches. Otherwise the file is parsed without blocking
+ * readers and diffed against the live tree; when only values changed they
+ * are updated in place, so key handles stay resolved. Watchers are told
+ * about each changed key. Not available with TP_OPEN_JOURNAL or for
+ * compiled images.
+ *
+ * @param h Handle to the JSON file
+ * @return int 1 if the file changed and was reloaded, 0 if unchanged, -1 on failure
+ */
+int tp_reload(tp_handle_t *h);
+
+/**
+ * @brief Register a callback for changes to a key or to every key below a prefix
+ *
+ * The callback runs after a tp_set(), tp_set_h() or committed transaction
+ * changed a matching key, once the new value is on disk, with no handle lock
+ * held. Changes made by other processes are delivered too, by a thread that
+ * waits for inotify events on the file and then pulls the shared store or
+ * calls tp_reload(); this needs a handle without TP_OPEN_JOURNAL. Callbacks of one
+ * handle never run concurrently and may call tp_set(), tp_watch() and
+ * tp_unwatch().
+ *
+ * @param h Handle to the JSON file
+ * @param prefix Key such as "system.audio.volume", prefix such as "system.audio", or "" for all keys
+ * @param cb Callback
+ * @param ctx Caller context passed to cb
+ * @return tp_watch_t* Watch to pass to tp_unwatch(), or NULL on failure
+ */
+tp_watch_t *tp_watch(tp_handle_t *h, const char *prefix, tp_watch_cb cb, void *ctx);
+
+/**
+ * @brief Remove a watch, see tp_watch()
+ *
+ * @param h Handle the watch was registered on
+ * @param w Watch from tp_watch(), may be NULL
+ */
+void tp_unwatch(tp_handle_t *h, tp_watch_t *w);
+
+/**
+ * @brief Compile a JSON parameter file into a binary image
+ *
+ * The image holds a sorted key table and a value blob with little-endian
+ * offsets. tp_open() maps it and answers reads with a binary search, so
+ * startup cost does not depend on the number of keys.
+ *
+ * @param json_file Path to the JSON file
+ * @param image_file Path of the image to write
+ * @return int 0 on success, -1 on failure
+ */
+int tp_compile(const char *json_file, const char *image_file);
+
+/**
+ * @brief Serve every key below a prefix from a separate file
+ *
+ * Keys "<prefix>.<rest>" passed to this handle's tp_get(), tp_set(), typed
+ * and borrowed accessors, key handles, transactions and tp_get_subtree()
+ * are answered by the mounted file as "<rest>". Each mounted file has its
+ * own handle, lock and persistence, so writes to one never rewrite or block
+ * another. A transaction may only touch keys of one file. tp_flush() and
+ * tp_reload() also run on mounted files; snapshots, watches and
+ * tp_set_durability() cover this handle's own file only. Keys of the own
+ * file below a mounted prefix are hidden. Mounts stay until tp_close() and
+ * must be set up before the handle is shared between threads.
+ *
+ * @param h Handle to mount on
+ * @param prefix Dotted prefix such as "system.audio", must not overlap another mount
+ * @param file JSON file or compiled image to mount
+ * @param opts Open options for the mounted file, NULL behaves like tp_open()
+ * @return int 0 on success, -1 on failure
+ */
+int tp_mount(tp_handle_t *h, const char *prefix, char *file, const tp_options_t *opts);
+
+/**
+ * @brief Mirror parameters into the fields of a plain struct
+ *
+ * Every field is filled from the handle, including keys of mounted files,
+ * and then kept up to date by watches, so hot paths read a field with a
+ * plain load instead of looking up a dotted key. tools/tp_gen emits the
+ * struct, the field table and key IDs for a parameter file. Numeric fields
+ * are stored atomically; a string field can be read while it is being
+ * rewritten, so a reader on another thread that needs the whole string
+ * should copy it from tp_get() instead. Mounts must be in place before
+ * binding.
+ *
+ * @param h Handle to the JSON file
+ * @param desc Field table, must stay valid until tp_unbind()
+ * @param n Number of fields
+ * @param base Struct to fill
+ * @return tp_bind_t* Binding, or NULL if a key is missing or cannot be converted
+ */
+tp_bind_t *tp_bind(tp_handle_t *h, const tp_bind_desc_t *desc, size_t n, void *base);
+
+/**
+ * @brief Stop updating a struct bound with tp_bind()
+ *
+ * Must not be called from a watch callback of the bound handle.
+ *
+ * @param b Binding, may be NULL
+ */
+void tp_unbind(tp_bind_t *b);
+
+/**
+ * @brief Read the counters and latency histograms of a handle
+ *
+ * Counting is compiled in only when tinyparam.c is built with
+ * -DTP_ENABLE_STATS; otherwise the hooks expand to nothing and this call
+ * fails. Counters are updated with relaxed atomics and read without
+ * stopping other threads, so fields of one result may be a few operations
+ * apart. Mounted files are added into the result.
+ *
+ * @param h Handle to the JSON file
+ * @param out Receives the counters
+ * @return int 0 on success, -1 if statistics are not compiled in
+ */
+int tp_stats(tp_handle_t *h, tp_stats_t *out);
+
 #endif
@@ -0,0 +1,22 @@
+/**
+ * @file tp_compile.c
+ * @brief Compile a JSON parameter file into a binary image for tp_open()
+ *
+ * Usage: tp_compile <input.json> <output.tpb>
+ */
+#include <stdio.h>
+#include "tinyparam.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <input.json> <output.tpb>\n", argv[0]);
+        return 2;
+    }
+
+    if (tp_compile(argv[1], argv[2]) != 0) {
+        fprintf(stderr, "Failed to compile %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
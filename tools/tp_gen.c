@@ -0,0 +1,349 @@
+/**
+ * @file tp_gen.c
+ * @brief Generate a C header with a struct mirroring a JSON parameter file
+ *
+ * Usage: tp_gen [-n name] [-s size] <input.json> <output.h>
+ *
+ * The header declares key IDs, a struct with one field per leaf nested like
+ * the tree, and the field table for tp_bind(). Field types follow the
+ * values in the file: integers and numeric strings without a fraction
+ * become int, other numbers double, booleans and "true"/"false" int, and
+ * other strings char arrays of at least size bytes (64 by default). Arrays
+ * and nulls are skipped.
+ */
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <cjson/cJSON.h>
+#include "tinyparam.h"
+
+typedef struct gen {
+    FILE *out;          // Header being written
+    const char *name;   // Struct name, lower case
+    char upper[128];    // Name in upper case, for macros
+    size_t strsize;     // Minimum size of string fields
+    size_t count;       // Fields emitted so far
+    int pass;           // 0 emits key IDs, 1 the struct, 2 the field table
+} gen_t;
+
+static const char *keywords[] = {
+    "auto", "break", "case", "char", "const", "continue", "default", "do", "double", "else", "enum",
+    "extern", "float", "for", "goto", "if", "inline", "int", "long", "register", "restrict", "return",
+    "short", "signed", "sizeof", "static", "struct", "switch", "typedef", "union", "unsigned", "void",
+    "volatile", "while", "_Bool", NULL,
+};
+
+/**
+ * @brief Turn a JSON member name into a C identifier
+ */
+static void gen_ident(const char *s, char *buf, size_t len)
+{
+    size_t n = 0;
+
+    if (isdigit((unsigned char)*s) || !*s) {
+        buf[n++] = '_';
+    }
+    for (; *s && n + 2 < len; s++) {
+        buf[n++] = isalnum((unsigned char)*s) ? *s : '_';
+    }
+    buf[n] = '\0';
+    for (int i = 0; keywords[i]; i++) {
+        if (strcmp(buf, keywords[i]) == 0) {
+            buf[n++] = '_';
+            buf[n] = '\0';
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Pick the field type of a leaf
+ *
+ * @return int 0 with *type set, or -1 if the leaf cannot be bound
+ */
+static int gen_type(const gen_t *g, cJSON *c, tp_bind_type_t *type, size_t *size)
+{
+    double num;
+    char *end;
+
+    switch (c->type & 0xFF) {
+    case cJSON_True:
+    case cJSON_False:
+        *type = TP_BIND_BOOL;
+        *size = sizeof(int);
+        return 0;
+    case cJSON_Number:
+        num = c->valuedouble;
+        break;
+    case cJSON_String:
+        if (strcasecmp(c->valuestring, "true") == 0 || strcasecmp(c->valuestring, "false") == 0) {
+            *type = TP_BIND_BOOL;
+            *size = sizeof(int);
+            return 0;
+        }
+        // Same numbers as typed reads accept
+        num = strtod(c->valuestring, &end);
+        if (!*c->valuestring || !(isdigit((unsigned char)*c->valuestring) || strchr("+-.", *c->valuestring)) ||
+            *end) {
+            size_t len = strlen(c->valuestring) + 1;
+            *type = TP_BIND_STRING;
+            *size = len > g->strsize ? (len + 7) & ~(size_t)7 : g->strsize;
+            return 0;
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    if (num == floor(num) && num >= INT_MIN && num <= INT_MAX) {
+        *type = TP_BIND_INT;
+        *size = sizeof(int);
+    } else {
+        *type = TP_BIND_DOUBLE;
+        *size = sizeof(double);
+    }
+    return 0;
+}
+
+/**
+ * @brief Tell whether an earlier sibling already took the identifier, as the first match wins
+ */
+static int gen_shadowed(cJSON *node, cJSON *c, const char *ident)
+{
+    char other[128];
+
+    for (cJSON *p = node->child; p && p != c; p = p->next) {
+        if (!p->string) {
+            continue;
+        }
+        gen_ident(p->string, other, sizeof(other));
+        if (strcasecmp(p->string, c->string) == 0 || strcmp(other, ident) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Tell whether an object has at least one bindable leaf below it
+ */
+static int gen_has_fields(const gen_t *g, cJSON *node)
+{
+    tp_bind_type_t type;
+    size_t size;
+
+    for (cJSON *c = node->child; c; c = c->next) {
+        if (c->string && (c->type == cJSON_Object ? gen_has_fields(g, c) : gen_type(g, c, &type, &size) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Emit one pass over the members of an object
+ *
+ * @param key Dotted key of node
+ * @param field C member path of node
+ * @param depth Nesting depth, for indentation
+ */
+static void gen_walk(gen_t *g, cJSON *node, const char *key, const char *field, int depth)
+{
+    static const char *type_names[] = { "TP_BIND_STRING", "TP_BIND_INT", "TP_BIND_DOUBLE", "TP_BIND_BOOL" };
+    char ident[128];
+    char ckey[512];
+    char cfield[512];
+
+    for (cJSON *c = node->child; c; c = c->next) {
+        tp_bind_type_t type;
+        size_t size;
+
+        if (!c->string) {
+            continue;
+        }
+        gen_ident(c->string, ident, sizeof(ident));
+        snprintf(ckey, sizeof(ckey), "%s%s%s", key, *key ? "." : "", c->string);
+        snprintf(cfield, sizeof(cfield), "%s%s%s", field, *field ? "." : "", ident);
+        if (gen_shadowed(node, c, ident)) {
+            if (g->pass == 0) {
+                fprintf(stderr, "Skipping %s, its name is already taken\n", ckey);
+            }
+            continue;
+        }
+
+        if (c->type == cJSON_Object) {
+            if (!gen_has_fields(g, c)) {
+                continue;
+            }
+            if (g->pass == 1) {
+                fprintf(g->out, "%*sstruct {\n", depth * 4, "");
+            }
+            gen_walk(g, c, ckey, cfield, depth + 1);
+            if (g->pass == 1) {
+                fprintf(g->out, "%*s} %s;\n", depth * 4, "", ident);
+            }
+            continue;
+        }
+
+        if (gen_type(g, c, &type, &size) != 0) {
+            if (g->pass == 0) {
+                fprintf(stderr, "Skipping %s, arrays and nulls cannot be bound\n", ckey);
+            }
+            continue;
+        }
+
+        if (g->pass == 0) {
+            char macro[512];
+            size_t i;
+            for (i = 0; cfield[i] && i + 1 < sizeof(macro); i++) {
+                macro[i] = cfield[i] == '.' ? '_' : (char)toupper((unsigned char)cfield[i]);
+            }
+            macro[i] = '\0';
+            fprintf(g->out, "    %s_%s, // %s\n", g->upper, macro, ckey);
+        } else if (g->pass == 1) {
+            if (type == TP_BIND_STRING) {
+                fprintf(g->out, "%*schar %s[%zu];\n", depth * 4, "", ident, size);
+            } else {
+                fprintf(g->out, "%*s%s %s;\n", depth * 4, "", type == TP_BIND_DOUBLE ? "double" : "int", ident);
+            }
+        } else {
+            fprintf(g->out, "    { \"");
+            for (const char *p = ckey; *p; p++) {
+                if (*p == '"' || *p == '\\') {
+                    fputc('\\', g->out);
+                }
+                fputc(*p, g->out);
+            }
+            fprintf(g->out, "\", %s, offsetof(%s_t, %s), sizeof(((%s_t *)0)->%s) },\n", type_names[type],
+                    g->name, cfield, g->name, cfield);
+        }
+        g->count++;
+    }
+}
+
+/**
+ * @brief Read and parse a JSON file
+ */
+static cJSON *gen_parse(const char *file)
+{
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        perror(file);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = len >= 0 ? (char *)malloc((size_t)len + 1) : NULL;
+    if (!buf || fread(buf, 1, (size_t)len, fp) != (size_t)len) {
+        fprintf(stderr, "Failed to read %s\n", file);
+        fclose(fp);
+        free(buf);
+        return NULL;
+    }
+    fclose(fp);
+    buf[len] = '\0';
+
+    cJSON *root = cJSON_Parse(buf);
+    free(buf);
+    if (!root || root->type != cJSON_Object) {
+        fprintf(stderr, "%s does not hold a JSON object\n", file);
+        cJSON_Delete(root);
+        return NULL;
+    }
+    return root;
+}
+
+int main(int argc, char **argv)
+{
+    gen_t g = { .strsize = 64 };
+    const char *name = NULL;
+    int i = 1;
+
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            name = argv[i + 1];
+        } else if (strcmp(argv[i], "-s") == 0) {
+            g.strsize = strtoul(argv[i + 1], NULL, 10);
+        } else {
+            break;
+        }
+    }
+    if (argc - i != 2 || g.strsize == 0) {
+        fprintf(stderr, "Usage: %s [-n name] [-s size] <input.json> <output.h>\n", argv[0]);
+        return 2;
+    }
+    const char *input = argv[i];
+    const char *output = argv[i + 1];
+
+    // Default the struct name to the output file name
+    char ident[128];
+    if (!name) {
+        const char *base = strrchr(output, '/');
+        base = base ? base + 1 : output;
+        snprintf(ident, sizeof(ident), "%.*s", (int)strcspn(base, "."), base);
+        name = ident;
+    }
+    char lower[128];
+    gen_ident(name, lower, sizeof(lower));
+    for (size_t j = 0; lower[j]; j++) {
+        lower[j] = (char)tolower((unsigned char)lower[j]);
+        g.upper[j] = (char)toupper((unsigned char)lower[j]);
+    }
+    g.upper[strlen(lower)] = '\0';
+    g.name = lower;
+
+    cJSON *root = gen_parse(input);
+    if (!root) {
+        return 1;
+    }
+
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", output);
+    g.out = fopen(tmp, "w");
+    if (!g.out) {
+        perror(tmp);
+        cJSON_Delete(root);
+        return 1;
+    }
+
+    fprintf(g.out, "/**\n * @file %s\n * @brief Parameters of %s, generated by tp_gen; do not edit\n */\n", output, input);
+    fprintf(g.out, "#ifndef __%s_H__\n#define __%s_H__\n\n", g.upper, g.upper);
+    fprintf(g.out, "#include <stddef.h>\n#include \"tinyparam.h\"\n\n");
+
+    fprintf(g.out, "/**\n * Key IDs, index into %s_desc\n */\nenum %s_key {\n", g.name, g.name);
+    g.pass = 0;
+    gen_walk(&g, root, "", "", 1);
+    fprintf(g.out, "    %s_KEY_COUNT\n};\n\n", g.upper);
+
+    fprintf(g.out, "/**\n * Mirror of the parameter tree, fill it with tp_bind()\n */\ntypedef struct %s {\n", g.name);
+    g.pass = 1;
+    g.count = 0;
+    gen_walk(&g, root, "", "", 1);
+    if (!g.count) {
+        fprintf(g.out, "    int unused_; // The file has no bindable leaves\n");
+    }
+    fprintf(g.out, "} %s_t;\n\n", g.name);
+
+    fprintf(g.out, "static const tp_bind_desc_t %s_desc[] = {\n", g.name);
+    g.pass = 2;
+    g.count = 0;
+    gen_walk(&g, root, "", "", 1);
+    if (!g.count) {
+        fprintf(g.out, "    { NULL, TP_BIND_INT, 0, 0 },\n");
+    }
+    fprintf(g.out, "};\n\n#endif\n");
+    cJSON_Delete(root);
+
+    int failed = ferror(g.out);
+    if (fclose(g.out) != 0 || failed || rename(tmp, output) != 0) {
+        fprintf(stderr, "Failed to write %s\n", output);
+        remove(tmp);
+        return 1;
+    }
+    return 0;
+}